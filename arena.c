@@ -0,0 +1,112 @@
+/*
+ *	Tiny File System
+ *	File:	arena.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+
+struct arena_chunk {
+	struct arena_chunk*	next;
+	size_t				size;
+	size_t				used;
+	char				data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+/*
+ * Chunks form a list per thread. cur is the chunk being bumped; chunks after
+ * it are spare and their used count is stale until cur moves onto them.
+ */
+struct arena {
+	struct arena_chunk*	first;
+	struct arena_chunk*	cur;
+};
+
+static __thread struct arena local;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+
+static void arena_free(void *arg) {
+	struct arena* a = arg;
+	while (a->first != NULL) {
+		struct arena_chunk* next = a->first->next;
+		free(a->first);
+		a->first = next;
+	}
+	a->cur = NULL;
+}
+
+static void arena_key_init() {
+	pthread_key_create(&arena_key, arena_free);
+}
+
+static struct arena_chunk *chunk_new(size_t size, struct arena_chunk *next) {
+	if (size < ARENA_CHUNK_SIZE) {
+		size = ARENA_CHUNK_SIZE;
+	}
+	struct arena_chunk* c = malloc(sizeof(struct arena_chunk) + size);
+	c->next = next;
+	c->size = size;
+	c->used = 0;
+	stats_count(CTR_ARENA_GROW, 1);
+	return c;
+}
+
+static struct arena *get_local() {
+	if (local.first == NULL) {
+		// worker threads come and go, so give their chunks back on exit
+		pthread_once(&arena_once, arena_key_init);
+		pthread_setspecific(arena_key, &local);
+		local.first = local.cur = chunk_new(ARENA_CHUNK_SIZE, NULL);
+	}
+	return &local;
+}
+
+void *arena_alloc(size_t size) {
+	struct arena* a = get_local();
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	// Step 1: Move on to the next chunk that fits, growing the list if none does
+	while (a->cur->used + size > a->cur->size) {
+		struct arena_chunk* next = a->cur->next;
+		if (next == NULL || next->size < size) {
+			next = chunk_new(size, next);
+			a->cur->next = next;
+		}
+		a->cur = next;
+		a->cur->used = 0;
+	}
+
+	// Step 2: Bump
+	void* p = a->cur->data + a->cur->used;
+	a->cur->used += size;
+	return p;
+}
+
+void *arena_zalloc(size_t size) {
+	void* p = arena_alloc(size);
+	memset(p, 0, size);
+	return p;
+}
+
+char *arena_strdup(const char *s) {
+	size_t n = strlen(s) + 1;
+	return memcpy(arena_alloc(n), s, n);
+}
+
+struct arena_mark arena_save(void) {
+	struct arena* a = get_local();
+	struct arena_mark mark = { a->cur, a->cur->used };
+	return mark;
+}
+
+void arena_restore(struct arena_mark *mark) {
+	struct arena* a = get_local();
+	a->cur = mark->chunk;
+	a->cur->used = mark->used;
+}
@@ -0,0 +1,37 @@
+/*
+ *	Tiny File System
+ *	File:	arena.h
+ *
+ *	Per-thread bump allocator for the scratch buffers (blocks, inodes,
+ *	dirents, path copies) that FUSE ops and their helpers need only
+ *	until they return. Allocation is a pointer bump; ARENA_SCOPE hands
+ *	everything allocated after it back when the enclosing scope exits,
+ *	so in steady state the hot paths never touch the heap.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_CHUNK_SIZE	(64 * 1024)	/* chunks are kept and reused once grown */
+#define ARENA_ALIGN			16
+
+struct arena_chunk;
+
+struct arena_mark {
+	struct arena_chunk*	chunk;
+	size_t				used;
+};
+
+void *arena_alloc(size_t size);
+void *arena_zalloc(size_t size);
+char *arena_strdup(const char *s);
+struct arena_mark arena_save(void);
+void arena_restore(struct arena_mark *mark);
+
+/* release everything allocated from here on when the enclosing scope exits */
+#define ARENA_SCOPE \
+	struct arena_mark __arena_scope __attribute__((cleanup(arena_restore), unused)) = arena_save()
+
+#endif
@@ -0,0 +1,605 @@
+/*
+ *	Tiny File System
+ *	File:	bench.c
+ *
+ *	Throughput/latency benchmark run against a mounted rufs.
+ *
+ *	./bench -d MOUNTDIR [-w WORKLOADS] [-s IOSIZES] [-t THREADS] ...
+ *
+ *	Every (workload, io size) pair prints one result record with ops/s,
+ *	MB/s and p50/p99/p999 latencies, as JSON lines (default) or CSV, so
+ *	runs can be diffed to catch performance regressions. All random
+ *	choices come from a fixed seed, so runs are reproducible.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+
+#define FSPATHLEN 1024
+#define FILEPERM 0666
+#define DIRPERM 0755
+#define MAX_IOSIZES 16
+
+/* rufs limits: 256 entries per directory, 1024 inodes, ~32 MiB per file */
+#define DEFAULT_FILE_SIZE (8L*1024*1024)
+#define DEFAULT_NFILES 200
+#define DEFAULT_DEPTH 16
+#define DEFAULT_OPS 2000
+
+struct config {
+	const char*	dir;
+	long		ops;			/* timed operations per thread */
+	off_t		file_size;		/* size of data files */
+	int			threads;
+	int			nfiles;			/* files per thread for metadata workloads */
+	int			depth;			/* directory depth for deeppath */
+	unsigned	seed;
+	int			csv;
+};
+
+struct workload;
+
+struct worker {
+	int					id;
+	struct config*		cfg;
+	struct workload*	wl;
+	size_t				io_size;
+	char*				buf;
+	uint64_t			rng;
+	uint64_t*			lat;			/* per-op latency in ns */
+	long				nlat;
+	long				cap;
+	uint64_t			bytes;
+	uint64_t			t_start;		/* wall clock span of the timed phase */
+	uint64_t			t_end;
+	int					failed;
+};
+
+struct workload {
+	const char*	name;
+	int			uses_io_size;
+	void		(*setup)(struct worker *w);
+	void		(*run)(struct worker *w);
+	void		(*teardown)(struct worker *w);
+};
+
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_rand(struct worker *w) { /* xorshift64* */
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return w->rng * 2685821657736338717ull;
+}
+
+static void record(struct worker *w, uint64_t start) {
+	if (w->nlat == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 1024;
+		w->lat = realloc(w->lat, w->cap * sizeof(uint64_t));
+	}
+	w->lat[w->nlat++] = now_ns() - start;
+}
+
+static void fail(struct worker *w, const char *what, const char *path) {
+	if (!w->failed) {
+		fprintf(stderr, "thread %d: %s %s: %s\n", w->id, what, path, strerror(errno));
+	}
+	w->failed = 1;
+}
+
+static void data_path(struct worker *w, char *path) {
+	snprintf(path, FSPATHLEN, "%s/bench.%d", w->cfg->dir, w->id);
+}
+
+static void meta_dir(struct worker *w, char *path) {
+	snprintf(path, FSPATHLEN, "%s/meta.%d", w->cfg->dir, w->id);
+}
+
+static void meta_file(struct worker *w, int i, char *path) {
+	snprintf(path, FSPATHLEN, "%s/meta.%d/f%d", w->cfg->dir, w->id, i);
+}
+
+static off_t rand_offset(struct worker *w) {
+	long slots = w->cfg->file_size / w->io_size;
+	return (off_t)(next_rand(w) % (slots ? slots : 1)) * w->io_size;
+}
+
+/*
+ * data file workloads
+ */
+static void fill_file(struct worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, FILEPERM);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+	for (off_t off = 0; off < w->cfg->file_size; off += w->io_size) {
+		if (pwrite(fd, w->buf, w->io_size, off) != (ssize_t)w->io_size) {
+			fail(w, "pwrite", path);
+			break;
+		}
+	}
+	close(fd);
+}
+
+static void remove_file(struct worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	unlink(path);
+}
+
+static void run_seqwrite(struct worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, FILEPERM);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+	for (off_t off = 0; off + (off_t)w->io_size <= w->cfg->file_size; off += w->io_size) {
+		uint64_t t = now_ns();
+		if (pwrite(fd, w->buf, w->io_size, off) != (ssize_t)w->io_size) {
+			fail(w, "pwrite", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	close(fd);
+}
+
+static void run_seqread(struct worker *w) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+	for (off_t off = 0; off + (off_t)w->io_size <= w->cfg->file_size; off += w->io_size) {
+		uint64_t t = now_ns();
+		if (pread(fd, w->buf, w->io_size, off) != (ssize_t)w->io_size) {
+			fail(w, "pread", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	close(fd);
+}
+
+static void run_random(struct worker *w, int writes) {
+	char path[FSPATHLEN];
+	data_path(w, path);
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+	for (long i = 0; i < w->cfg->ops; i++) {
+		off_t off = rand_offset(w);
+		uint64_t t = now_ns();
+		ssize_t n = writes ? pwrite(fd, w->buf, w->io_size, off) : pread(fd, w->buf, w->io_size, off);
+		if (n != (ssize_t)w->io_size) {
+			fail(w, writes ? "pwrite" : "pread", path);
+			break;
+		}
+		record(w, t);
+		w->bytes += w->io_size;
+	}
+	close(fd);
+}
+
+static void run_randread(struct worker *w) { run_random(w, 0); }
+static void run_randwrite(struct worker *w) { run_random(w, 1); }
+
+/*
+ * small file metadata workloads
+ */
+static void make_meta_dir(struct worker *w) {
+	char path[FSPATHLEN];
+	meta_dir(w, path);
+	if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+		fail(w, "mkdir", path);
+	}
+}
+
+static void create_files(struct worker *w) {
+	char path[FSPATHLEN];
+	make_meta_dir(w);
+	for (int i = 0; i < w->cfg->nfiles && !w->failed; i++) {
+		meta_file(w, i, path);
+		int fd = creat(path, FILEPERM);
+		if (fd < 0) {
+			fail(w, "creat", path);
+			break;
+		}
+		close(fd);
+	}
+}
+
+static void remove_files(struct worker *w) {
+	char path[FSPATHLEN];
+	for (int i = 0; i < w->cfg->nfiles; i++) {
+		meta_file(w, i, path);
+		unlink(path);
+	}
+	meta_dir(w, path);
+	rmdir(path);
+}
+
+static void run_create(struct worker *w) {
+	char path[FSPATHLEN];
+	for (int i = 0; i < w->cfg->nfiles; i++) {
+		meta_file(w, i, path);
+		uint64_t t = now_ns();
+		int fd = creat(path, FILEPERM);
+		if (fd < 0) {
+			fail(w, "creat", path);
+			break;
+		}
+		close(fd);
+		record(w, t);
+	}
+}
+
+static void run_stat(struct worker *w) {
+	char path[FSPATHLEN];
+	struct stat st;
+	for (long i = 0; i < w->cfg->ops; i++) {
+		meta_file(w, next_rand(w) % w->cfg->nfiles, path);
+		uint64_t t = now_ns();
+		if (stat(path, &st) < 0) {
+			fail(w, "stat", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+static void run_delete(struct worker *w) {
+	char path[FSPATHLEN];
+	for (int i = 0; i < w->cfg->nfiles; i++) {
+		meta_file(w, i, path);
+		uint64_t t = now_ns();
+		if (unlink(path) < 0) {
+			fail(w, "unlink", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+static void run_bigdir(struct worker *w) {
+	char path[FSPATHLEN];
+	meta_dir(w, path);
+	for (long i = 0; i < w->cfg->ops / 10 + 1; i++) {
+		uint64_t t = now_ns();
+		DIR* d = opendir(path);
+		if (d == NULL) {
+			fail(w, "opendir", path);
+			break;
+		}
+		while (readdir(d) != NULL) {}
+		closedir(d);
+		record(w, t);
+	}
+}
+
+/*
+ * deep path lookups
+ */
+static void deep_path(struct worker *w, int level, char *path) {
+	int n = snprintf(path, FSPATHLEN, "%s/deep.%d", w->cfg->dir, w->id);
+	for (int i = 0; i < level && n < FSPATHLEN; i++) {
+		n += snprintf(path + n, FSPATHLEN - n, "/d%d", i);
+	}
+}
+
+static void setup_deep(struct worker *w) {
+	char path[FSPATHLEN];
+	for (int i = 0; i <= w->cfg->depth && !w->failed; i++) {
+		deep_path(w, i, path);
+		if (mkdir(path, DIRPERM) < 0 && errno != EEXIST) {
+			fail(w, "mkdir", path);
+		}
+	}
+}
+
+static void teardown_deep(struct worker *w) {
+	char path[FSPATHLEN];
+	for (int i = w->cfg->depth; i >= 0; i--) {
+		deep_path(w, i, path);
+		rmdir(path);
+	}
+}
+
+static void run_deeppath(struct worker *w) {
+	char path[FSPATHLEN];
+	struct stat st;
+	deep_path(w, w->cfg->depth, path);
+	for (long i = 0; i < w->cfg->ops; i++) {
+		uint64_t t = now_ns();
+		if (stat(path, &st) < 0) {
+			fail(w, "stat", path);
+			break;
+		}
+		record(w, t);
+	}
+}
+
+/*
+ * mixed clients: 50% random reads, 20% random writes, 30% stats
+ */
+static void setup_mixed(struct worker *w) {
+	fill_file(w);
+	create_files(w);
+}
+
+static void teardown_mixed(struct worker *w) {
+	remove_file(w);
+	remove_files(w);
+}
+
+static void run_mixed(struct worker *w) {
+	char path[FSPATHLEN], meta[FSPATHLEN];
+	struct stat st;
+	data_path(w, path);
+	int fd = open(path, O_RDWR);
+	if (fd < 0) {
+		fail(w, "open", path);
+		return;
+	}
+	for (long i = 0; i < w->cfg->ops; i++) {
+		int pick = next_rand(w) % 10;
+		off_t off = rand_offset(w);
+		uint64_t t = now_ns();
+		if (pick < 5) {
+			if (pread(fd, w->buf, w->io_size, off) != (ssize_t)w->io_size) {
+				fail(w, "pread", path);
+				break;
+			}
+			w->bytes += w->io_size;
+		} else if (pick < 7) {
+			if (pwrite(fd, w->buf, w->io_size, off) != (ssize_t)w->io_size) {
+				fail(w, "pwrite", path);
+				break;
+			}
+			w->bytes += w->io_size;
+		} else {
+			meta_file(w, next_rand(w) % w->cfg->nfiles, meta);
+			if (stat(meta, &st) < 0) {
+				fail(w, "stat", meta);
+				break;
+			}
+		}
+		record(w, t);
+	}
+	close(fd);
+}
+
+static void nothing(struct worker *w) {}
+
+static struct workload workloads[] = {
+	{ "seqwrite",	1, nothing,			run_seqwrite,	remove_file },
+	{ "seqread",	1, fill_file,		run_seqread,	remove_file },
+	{ "randread",	1, fill_file,		run_randread,	remove_file },
+	{ "randwrite",	1, fill_file,		run_randwrite,	remove_file },
+	{ "create",		0, make_meta_dir,	run_create,		remove_files },
+	{ "stat",		0, create_files,	run_stat,		remove_files },
+	{ "delete",		0, create_files,	run_delete,		remove_files },
+	{ "bigdir",		0, create_files,	run_bigdir,		remove_files },
+	{ "deeppath",	0, setup_deep,		run_deeppath,	teardown_deep },
+	{ "mixed",		1, setup_mixed,		run_mixed,		teardown_mixed },
+};
+#define N_WORKLOADS (sizeof(workloads)/sizeof(workloads[0]))
+
+static void *worker_main(void *arg) {
+	struct worker* w = arg;
+	struct workload* wl = w->wl;
+	w->buf = malloc(w->io_size);
+	memset(w->buf, 0x61 + w->id % 26, w->io_size);
+
+	wl->setup(w);
+	pthread_barrier_wait(&start_barrier);	/* everyone starts together */
+	w->t_start = now_ns();
+	if (!w->failed) {
+		wl->run(w);
+	}
+	w->t_end = now_ns();
+	pthread_barrier_wait(&start_barrier);
+	wl->teardown(w);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(uint64_t *lat, long n, double p) {
+	if (n == 0) {
+		return 0;
+	}
+	long i = (long)(p * (n - 1) + 0.5);
+	return lat[i] / 1000.0;
+}
+
+static int run_one(struct config *cfg, struct workload *wl, size_t io_size) {
+	pthread_t* tids = calloc(cfg->threads, sizeof(pthread_t));
+	struct worker* ws = calloc(cfg->threads, sizeof(struct worker));
+	pthread_barrier_init(&start_barrier, NULL, cfg->threads + 1);
+
+	for (int i = 0; i < cfg->threads; i++) {
+		ws[i].id = i;
+		ws[i].cfg = cfg;
+		ws[i].io_size = io_size;
+		ws[i].rng = (uint64_t)cfg->seed * 0x9E3779B97F4A7C15ull + i + 1;
+		ws[i].wl = wl;
+		pthread_create(&tids[i], NULL, worker_main, &ws[i]);
+	}
+
+	pthread_barrier_wait(&start_barrier);	/* setup done */
+	pthread_barrier_wait(&start_barrier);	/* run done */
+	for (int i = 0; i < cfg->threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	// merge per-thread latencies; the run spans the earliest start to the
+	// latest finish, as stamped by the workers themselves
+	long total = 0;
+	uint64_t bytes = 0;
+	uint64_t first = ws[0].t_start, last = ws[0].t_end;
+	int failed = 0;
+	for (int i = 0; i < cfg->threads; i++) {
+		if (ws[i].t_start < first) {
+			first = ws[i].t_start;
+		}
+		if (ws[i].t_end > last) {
+			last = ws[i].t_end;
+		}
+		total += ws[i].nlat;
+		bytes += ws[i].bytes;
+		failed |= ws[i].failed;
+	}
+	uint64_t* lat = malloc((total ? total : 1) * sizeof(uint64_t));
+	long n = 0;
+	for (int i = 0; i < cfg->threads; i++) {
+		memcpy(lat + n, ws[i].lat, ws[i].nlat * sizeof(uint64_t));
+		n += ws[i].nlat;
+		free(ws[i].lat);
+		free(ws[i].buf);
+	}
+	qsort(lat, n, sizeof(uint64_t), cmp_u64);
+	double secs = (last - first) / 1e9;
+
+	double ops_s = secs > 0 ? n / secs : 0;
+	double mb_s = secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0;
+	size_t shown_io = wl->uses_io_size ? io_size : 0;
+	if (cfg->csv) {
+		printf("%s,%zu,%d,%ld,%.6f,%.1f,%.2f,%.1f,%.1f,%.1f,%s\n",
+			wl->name, shown_io, cfg->threads, n, secs, ops_s, mb_s,
+			percentile_us(lat, n, 0.50), percentile_us(lat, n, 0.99),
+			percentile_us(lat, n, 0.999), failed ? "error" : "ok");
+	} else {
+		printf("{\"workload\":\"%s\",\"io_size\":%zu,\"threads\":%d,\"ops\":%ld,"
+			"\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+			"\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"status\":\"%s\"}\n",
+			wl->name, shown_io, cfg->threads, n, secs, ops_s, mb_s,
+			percentile_us(lat, n, 0.50), percentile_us(lat, n, 0.99),
+			percentile_us(lat, n, 0.999), failed ? "error" : "ok");
+	}
+	fflush(stdout);
+
+	free(lat);
+	free(ws);
+	free(tids);
+	pthread_barrier_destroy(&start_barrier);
+	return failed;
+}
+
+static long parse_size(const char *s) {
+	char* end;
+	long v = strtol(s, &end, 10);
+	switch (*end) {
+	case 'k': case 'K': v *= 1024; break;
+	case 'm': case 'M': v *= 1024 * 1024; break;
+	}
+	return v;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+		"usage: %s -d MOUNTDIR [options]\n"
+		"  -w LIST   comma separated workloads or 'all' (default all):\n"
+		"            seqwrite seqread randread randwrite create stat delete\n"
+		"            bigdir deeppath mixed\n"
+		"  -s LIST   comma separated I/O sizes, k/m suffixes (default 4k,64k,1m)\n"
+		"  -t N      client threads (default 1)\n"
+		"  -n N      timed ops per thread for random/stat workloads (default %d)\n"
+		"  -f SIZE   data file size per thread (default 8m)\n"
+		"  -F N      files per thread for metadata workloads (default %d)\n"
+		"  -D N      directory depth for deeppath (default %d)\n"
+		"  -r SEED   random seed (default 1)\n"
+		"  -c        CSV output instead of JSON lines\n",
+		prog, DEFAULT_OPS, DEFAULT_NFILES, DEFAULT_DEPTH);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	struct config cfg = { NULL, DEFAULT_OPS, DEFAULT_FILE_SIZE, 1, DEFAULT_NFILES, DEFAULT_DEPTH, 1, 0 };
+	char* wlist = "all";
+	char* slist = "4k,64k,1m";
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:w:s:t:n:f:F:D:r:c")) != -1) {
+		switch (opt) {
+		case 'd': cfg.dir = optarg; break;
+		case 'w': wlist = optarg; break;
+		case 's': slist = optarg; break;
+		case 't': cfg.threads = atoi(optarg); break;
+		case 'n': cfg.ops = atol(optarg); break;
+		case 'f': cfg.file_size = parse_size(optarg); break;
+		case 'F': cfg.nfiles = atoi(optarg); break;
+		case 'D': cfg.depth = atoi(optarg); break;
+		case 'r': cfg.seed = strtoul(optarg, NULL, 10); break;
+		case 'c': cfg.csv = 1; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (cfg.dir == NULL || cfg.threads < 1 || cfg.nfiles < 1) {
+		usage(argv[0]);
+	}
+
+	size_t sizes[MAX_IOSIZES];
+	int nsizes = 0;
+	char* slist_copy = strdup(slist);
+	for (char* tok = strtok(slist_copy, ","); tok && nsizes < MAX_IOSIZES; tok = strtok(NULL, ",")) {
+		sizes[nsizes++] = parse_size(tok);
+	}
+	free(slist_copy);
+
+	if (cfg.csv) {
+		printf("workload,io_size,threads,ops,seconds,ops_per_sec,mb_per_sec,p50_us,p99_us,p999_us,status\n");
+	}
+
+	int failed = 0;
+	for (int i = 0; i < N_WORKLOADS; i++) {
+		struct workload* wl = &workloads[i];
+		if (strcmp(wlist, "all") != 0) {
+			// match whole names inside the comma separated list
+			char* copy = strdup(wlist);
+			int want = 0;
+			for (char* tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+				want |= strcmp(tok, wl->name) == 0;
+			}
+			free(copy);
+			if (!want) {
+				continue;
+			}
+		}
+		for (int s = 0; s < (wl->uses_io_size ? nsizes : 1); s++) {
+			failed |= run_one(&cfg, wl, wl->uses_io_size ? sizes[s] : 4096);
+		}
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,276 @@
+/*
+ *	Tiny File System
+ *	File:	microbench.c
+ *
+ *	In-process microbenchmarks for the block, allocator, inode, directory
+ *	and path lookup layers. Links librufs.a directly and runs against a
+ *	scratch DISKFILE, so no FUSE mount or kernel round trip is involved.
+ *
+ *	make microbench && ./microbench [-n ITERS] [-f DISKFILE] [-k]
+ *
+ *	Prints one JSON line per benchmark with the mean time per call.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define BIG_DIR_ENTRIES 250
+#define SCRATCH_BLOCKS 1024
+
+static long iters = 20000;
+static uint64_t rng = 88172645463325252ull;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_rand(void) { /* xorshift64, fixed seed for repeatable runs */
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static void report(const char *name, long n, uint64_t ns) {
+	printf("{\"bench\":\"%s\",\"iters\":%ld,\"ns_per_op\":%.1f}\n", name, n, n ? (double)ns / n : 0.0);
+	fflush(stdout);
+}
+
+static void die(const char *what, int err) {
+	fprintf(stderr, "microbench: %s failed (%d)\n", what, err);
+	exit(1);
+}
+
+/*
+ * block layer
+ */
+static void bench_block(struct inode *scratch) {
+	char* buf = malloc(BLOCK_SIZE);
+	int blocks[SCRATCH_BLOCKS];
+	memset(buf, 0x5a, BLOCK_SIZE);
+	for (int i = 0; i < SCRATCH_BLOCKS; i++) {
+		blocks[i] = ptr_blkno(get_file_blkno(scratch, i));
+	}
+
+	uint64_t t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		bio_write(blocks[i % SCRATCH_BLOCKS], buf);
+	}
+	report("bio_write_seq", iters, now_ns() - t);
+
+	t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		bio_write(blocks[next_rand() % SCRATCH_BLOCKS], buf);
+	}
+	report("bio_write_rand", iters, now_ns() - t);
+
+	t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		bio_read(blocks[i % SCRATCH_BLOCKS], buf);
+	}
+	report("bio_read_seq", iters, now_ns() - t);
+
+	t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		bio_read(blocks[next_rand() % SCRATCH_BLOCKS], buf);
+	}
+	report("bio_read_rand", iters, now_ns() - t);
+
+	free(buf);
+}
+
+/*
+ * inode table
+ */
+static void bench_inodes(int max_ino) {
+	index_node inode;
+
+	uint64_t t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		readi(next_rand() % max_ino, &inode);
+	}
+	report("readi", iters, now_ns() - t);
+
+	readi(0, &inode);
+	t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		writei(0, &inode);
+	}
+	report("writei", iters, now_ns() - t);
+}
+
+/*
+ * directories and path lookup
+ */
+static void bench_dirs() {
+	char path[PATH_MAX];
+	direntry entry;
+	index_node inode;
+	int err;
+
+	if ((err = rufs_ope.mkdir("/big", 0755)) < 0) {
+		die("mkdir /big", err);
+	}
+	uint64_t t = now_ns();
+	for (int i = 0; i < BIG_DIR_ENTRIES; i++) {
+		snprintf(path, sizeof(path), "/big/file%d", i);
+		if ((err = rufs_ope.create(path, S_IFREG | 0644, NULL)) < 0) {
+			die("create", err);
+		}
+	}
+	report("create", BIG_DIR_ENTRIES, now_ns() - t);
+
+	// the same files again, as one RUFS_IOC_BATCH on a second directory
+	static struct rufs_batch batch;
+	size_t off = 0;
+	for (int i = 0; i < BIG_DIR_ENTRIES; i++) {
+		struct rufs_batch_ent* e = (struct rufs_batch_ent*)(batch.data + off);
+		int len = snprintf((char*)(e + 1), sizeof(path), "file%d", i);
+		e->op = RUFS_BATCH_CREATE;
+		e->namelen = len;
+		e->mode = 0644;
+		off += RUFS_BATCH_ENT_SIZE(len);
+	}
+	batch.count = BIG_DIR_ENTRIES;
+	if ((err = rufs_ope.mkdir("/bulk", 0755)) < 0) {
+		die("mkdir /bulk", err);
+	}
+	t = now_ns();
+	if ((err = rufs_ope.ioctl("/bulk", RUFS_IOC_BATCH, NULL, NULL, 0, &batch)) < 0) {
+		die("batch create", err);
+	}
+	report("create_batch", BIG_DIR_ENTRIES, now_ns() - t);
+
+	get_node_by_path("/big", 0, &inode);
+	uint16_t big = inode.ino;
+
+	const char* names[] = { "file0", "file125", "file249", "missing" };
+	const char* labels[] = { "dir_find_first", "dir_find_middle", "dir_find_last", "dir_find_missing" };
+	for (int k = 0; k < 4; k++) {
+		uint64_t t = now_ns();
+		for (long i = 0; i < iters; i++) {
+			dir_find(big, names[k], strlen(names[k]), &entry);
+		}
+		report(labels[k], iters, now_ns() - t);
+	}
+
+	// path lookups at increasing depth
+	int depth = 0;
+	strcpy(path, "");
+	for (int target = 1; target <= 32; target *= 4) {
+		for (; depth < target; depth++) {
+			size_t n = strlen(path);
+			snprintf(path + n, sizeof(path) - n, "/d%d", depth);
+			if ((err = rufs_ope.mkdir(path, 0755)) < 0) {
+				die("mkdir", err);
+			}
+		}
+		char label[64];
+		snprintf(label, sizeof(label), "get_node_by_path_depth%d", depth);
+		uint64_t t = now_ns();
+		for (long i = 0; i < iters; i++) {
+			get_node_by_path(path, 0, &inode);
+		}
+		report(label, iters, now_ns() - t);
+	}
+
+	t = now_ns();
+	for (long i = 0; i < iters; i++) {
+		get_node_by_path("/big/file249", 0, &inode);
+	}
+	report("get_node_by_path_bigdir", iters, now_ns() - t);
+}
+
+/*
+ * allocators; these fill the image, so they run last
+ */
+static void bench_alloc() {
+	int total = superblock->max_dnum;
+	int got;
+
+	uint64_t t = now_ns();
+	long n = 0;
+	for (; n < 128 && get_avail_extent(0, 16, &got) != 0; n++) {}
+	report("get_avail_extent_16", n, now_ns() - t);
+
+	// time single-block allocation in quarters of the bitmap's fill level;
+	// a quarter already filled before the loop starts is not reported
+	const char* labels[] = { "get_avail_blkno_fill25", "get_avail_blkno_fill50",
+		"get_avail_blkno_fill75", "get_avail_blkno_fill100" };
+	int quarter = 0;
+	while (quarter < 3 && total - (int)superblock->free_blocks >= (quarter + 1) * total / 4) {
+		quarter++;
+	}
+	n = 0;
+	t = now_ns();
+	while (get_avail_blkno() != 0) {
+		n++;
+		int used = total - superblock->free_blocks;
+		while (quarter < 3 && used >= (quarter + 1) * total / 4) {
+			report(labels[quarter++], n, now_ns() - t);
+			n = 0;
+			t = now_ns();
+		}
+	}
+	report(labels[quarter], n, now_ns() - t);
+
+	n = 0;
+	t = now_ns();
+	while (get_avail_ino() != 0) {
+		n++;
+	}
+	report("get_avail_ino_until_full", n, now_ns() - t);
+}
+
+int main(int argc, char **argv) {
+	int keep = 0, opt;
+	char* path = "/tmp/rufs_microbench.DISKFILE";
+
+	while ((opt = getopt(argc, argv, "n:f:k")) != -1) {
+		switch (opt) {
+		case 'n': iters = atol(optarg); break;
+		case 'f': path = optarg; break;
+		case 'k': keep = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-n ITERS] [-f DISKFILE] [-k]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	// start from a fresh image so every run measures the same layout
+	strncpy(diskfile_path, path, PATH_MAX - 1);
+	unlink(diskfile_path);
+	rufs_ope.init(NULL);
+
+	index_node scratch;
+	int err;
+	if ((err = rufs_ope.create("/scratch", S_IFREG | 0644, NULL)) < 0 ||
+		(err = rufs_ope.fallocate("/scratch", 0, 0, (off_t)SCRATCH_BLOCKS * BLOCK_SIZE, NULL)) < 0) {
+		die("scratch file", err);
+	}
+	get_node_by_path("/scratch", 0, &scratch);
+
+	bench_block(&scratch);
+	bench_dirs();
+	bench_inodes(BIG_DIR_ENTRIES);
+	bench_alloc();
+
+	rufs_ope.destroy(NULL);
+	if (!keep) {
+		unlink(diskfile_path);
+	}
+	return 0;
+}
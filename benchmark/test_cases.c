@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -7,6 +9,9 @@
 #include <string.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <stdint.h>
 
 /* You need to change this macro to your TFS mount point*/
 #define TESTDIR "/tmp/st1005/mountdir"
@@ -18,6 +23,17 @@
 #define ITERS_LARGE 2048
 #define FILEPERM 0666
 #define DIRPERM 0755
+#define N_PACKERS 8
+#define TAIL_FILES 16
+#define TAILSIZE 500
+
+/* SEEK_DATA/SEEK_HOLE through the ioctl, as declared in rufs.h */
+struct rufs_seek {
+	int64_t		offset;
+	int32_t		whence;
+	int32_t		pad;
+};
+#define RUFS_IOC_SEEK	_IOWR('R', 1, struct rufs_seek)
 
 char buf[BLOCKSIZE];
 
@@ -127,6 +143,224 @@ int main(int argc, char **argv) {
 	printf("TEST 7: Sub-directory create success \n");
 
 
+	/* TEST 8: shrinking truncate */
+	int tfd;
+	if ((tfd = open(TESTDIR "/trunc", O_CREAT | O_RDWR, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < ITERS; i++) {
+		memset(buf, 0x61 + i, BLOCKSIZE);
+		if (write(tfd, buf, BLOCKSIZE) != BLOCKSIZE) {
+			printf("TEST 8: File truncate failure \n");
+			exit(1);
+		}
+	}
+	if (ftruncate(tfd, BLOCKSIZE + 100) < 0) {
+		perror("ftruncate");
+		printf("TEST 8: File truncate failure \n");
+		exit(1);
+	}
+	fstat(tfd, &st);
+	memset(buf, 0, BLOCKSIZE);
+	if (st.st_size != BLOCKSIZE + 100 || pread(tfd, buf, BLOCKSIZE, BLOCKSIZE) != 100 ||
+		buf[0] != 0x62 || buf[99] != 0x62) {
+		printf("TEST 8: File truncate failure \n");
+		exit(1);
+	}
+	printf("TEST 8: File truncate success \n");
+
+
+	/* TEST 9: extending truncate; the cut-off bytes must come back as zeroes */
+	if (ftruncate(tfd, ITERS*BLOCKSIZE) < 0) {
+		perror("ftruncate");
+		printf("TEST 9: File extend failure \n");
+		exit(1);
+	}
+	fstat(tfd, &st);
+	if (st.st_size != ITERS*BLOCKSIZE || pread(tfd, buf, BLOCKSIZE, BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 9: File extend failure \n");
+		exit(1);
+	}
+	for (i = 100; i < BLOCKSIZE; i++) {
+		if (buf[i] != 0) {
+			printf("TEST 9: File extend failure \n");
+			exit(1);
+		}
+	}
+	if (pread(tfd, buf, BLOCKSIZE, (ITERS - 1)*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0) {
+		printf("TEST 9: File extend failure \n");
+		exit(1);
+	}
+	close(tfd);
+	printf("TEST 9: File extend success \n");
+
+
+	/* TEST 10: unlink an open file. rufs has no rename for FUSE to hide
+	 * open files with, so this needs a mount with -o hard_remove */
+	if ((tfd = open(TESTDIR "/unlinked", O_CREAT | O_RDWR, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(buf, 0x7a, BLOCKSIZE);
+	if (write(tfd, buf, BLOCKSIZE) != BLOCKSIZE || unlink(TESTDIR "/unlinked") < 0) {
+		perror("unlink");
+		printf("TEST 10: Unlink open file failure \n");
+		exit(1);
+	}
+	if (stat(TESTDIR "/unlinked", &st) == 0 || errno != ENOENT || close(tfd) < 0) {
+		printf("TEST 10: Unlink open file failure \n");
+		exit(1);
+	}
+	printf("TEST 10: Unlink open file success \n");
+
+
+	/* TEST 11: rmdir refuses a non-empty directory */
+	if (mkdir(TESTDIR "/full", DIRPERM) < 0 || (tfd = creat(TESTDIR "/full/file", FILEPERM)) < 0) {
+		perror("mkdir");
+		exit(1);
+	}
+	close(tfd);
+	if (rmdir(TESTDIR "/full") == 0 || errno != ENOTEMPTY) {
+		printf("TEST 11: Non-empty rmdir failure \n");
+		exit(1);
+	}
+	if (unlink(TESTDIR "/full/file") < 0 || rmdir(TESTDIR "/full") < 0 ||
+		stat(TESTDIR "/full", &st) == 0) {
+		printf("TEST 11: Non-empty rmdir failure \n");
+		exit(1);
+	}
+	printf("TEST 11: Non-empty rmdir success \n");
+
+
+	/* TEST 12: small files closed at the same time share fragment blocks;
+	 * every packed tail must keep its own contents */
+	if (mkdir(TESTDIR "/tails", DIRPERM) < 0) {
+		perror("mkdir");
+		exit(1);
+	}
+	for (i = 0; i < N_PACKERS; i++) {
+		if (fork() == 0) {
+			int j;
+			for (j = 0; j < TAIL_FILES; j++) {
+				char tail_path[FSPATHLEN];
+				sprintf(tail_path, "%s/p%d_%d", TESTDIR "/tails", i, j);
+				memset(buf, 'A' + i * TAIL_FILES + j, TAILSIZE);
+				if ((tfd = creat(tail_path, FILEPERM)) < 0 ||
+					write(tfd, buf, TAILSIZE) != TAILSIZE || close(tfd) < 0) {
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+	}
+	for (i = 0; i < N_PACKERS; i++) {
+		int status;
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("TEST 12: Concurrent tail pack failure \n");
+			exit(1);
+		}
+	}
+	for (i = 0; i < N_PACKERS * TAIL_FILES; i++) {
+		char tail_path[FSPATHLEN];
+		int j;
+		sprintf(tail_path, "%s/p%d_%d", TESTDIR "/tails", i / TAIL_FILES, i % TAIL_FILES);
+		memset(buf, 0, BLOCKSIZE);
+		if ((tfd = open(tail_path, O_RDONLY)) < 0 || read(tfd, buf, BLOCKSIZE) != TAILSIZE) {
+			printf("TEST 12: Concurrent tail pack failure \n");
+			exit(1);
+		}
+		close(tfd);
+		for (j = 0; j < TAILSIZE; j++) {
+			if (buf[j] != (char)('A' + i)) {
+				printf("TEST 12: Concurrent tail pack failure \n");
+				exit(1);
+			}
+		}
+	}
+	printf("TEST 12: Concurrent tail pack success \n");
+
+
+	/* TEST 13: a write past the end leaves a hole that reads as zeroes
+	 * and takes no space */
+	if ((tfd = open(TESTDIR "/sparse", O_CREAT | O_RDWR, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	memset(buf, 0x73, BLOCKSIZE);
+	if (pwrite(tfd, buf, BLOCKSIZE, 8*BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 13: Sparse file failure \n");
+		exit(1);
+	}
+	fstat(tfd, &st);
+	if (st.st_size != 9*BLOCKSIZE || st.st_blocks != BLOCKSIZE / 512 ||
+		pread(tfd, buf, BLOCKSIZE, 3*BLOCKSIZE) != BLOCKSIZE) {
+		printf("TEST 13: Sparse file failure \n");
+		exit(1);
+	}
+	for (i = 0; i < BLOCKSIZE; i++) {
+		if (buf[i] != 0) {
+			printf("TEST 13: Sparse file failure \n");
+			exit(1);
+		}
+	}
+	printf("TEST 13: Sparse file success \n");
+
+
+	/* TEST 14: RUFS_IOC_SEEK finds the data and the hole after it */
+	struct rufs_seek seek = { .offset = 0, .whence = SEEK_DATA };
+	if (ioctl(tfd, RUFS_IOC_SEEK, &seek) < 0 || seek.offset != 8*BLOCKSIZE) {
+		perror("ioctl");
+		printf("TEST 14: Seek data/hole failure \n");
+		exit(1);
+	}
+	seek.whence = SEEK_HOLE;
+	if (ioctl(tfd, RUFS_IOC_SEEK, &seek) < 0 || seek.offset != 9*BLOCKSIZE) {
+		printf("TEST 14: Seek data/hole failure \n");
+		exit(1);
+	}
+	seek.offset = 9*BLOCKSIZE;
+	seek.whence = SEEK_DATA;
+	if (ioctl(tfd, RUFS_IOC_SEEK, &seek) == 0 || errno != ENXIO) {
+		printf("TEST 14: Seek data/hole failure \n");
+		exit(1);
+	}
+	close(tfd);
+	printf("TEST 14: Seek data/hole success \n");
+
+
+	/* TEST 15: fallocate reserves blocks that read as zeroes, and a range
+	 * past the largest file size is refused rather than wrapped around */
+	if ((tfd = open(TESTDIR "/prealloc", O_CREAT | O_RDWR, FILEPERM)) < 0) {
+		perror("open");
+		exit(1);
+	}
+	if (fallocate(tfd, 0, 0, 4*BLOCKSIZE) < 0) {
+		perror("fallocate");
+		printf("TEST 15: Fallocate failure \n");
+		exit(1);
+	}
+	fstat(tfd, &st);
+	memset(buf, 0x70, BLOCKSIZE);
+	if (st.st_size != 4*BLOCKSIZE || st.st_blocks != 4*(BLOCKSIZE / 512) ||
+		pread(tfd, buf, BLOCKSIZE, 2*BLOCKSIZE) != BLOCKSIZE || buf[0] != 0 || buf[BLOCKSIZE - 1] != 0) {
+		printf("TEST 15: Fallocate failure \n");
+		exit(1);
+	}
+	if (fallocate(tfd, FALLOC_FL_KEEP_SIZE, 4*BLOCKSIZE, BLOCKSIZE) < 0 ||
+		fstat(tfd, &st) < 0 || st.st_size != 4*BLOCKSIZE) {
+		printf("TEST 15: Fallocate failure \n");
+		exit(1);
+	}
+	if (fallocate(tfd, 0, 0, (off_t)1 << 44) == 0 || errno != EFBIG ||
+		fstat(tfd, &st) < 0 || st.st_size != 4*BLOCKSIZE) {
+		printf("TEST 15: Fallocate failure \n");
+		exit(1);
+	}
+	close(tfd);
+	printf("TEST 15: Fallocate success \n");
+
+
 	/* Close operation */	
 	if (close(fd) < 0) {
 		perror("close largefile");
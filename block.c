@@ -7,76 +7,966 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "block.h"
+#include "cache.h"
+#include "log.h"
+#include "stats.h"
+#include "trace.h"
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
-int diskfile = -1;
+/*
+ * The disk is one backing file, or several with block numbers striped
+ * across them stripe_blocks at a time: stripe unit u lives on file
+ * u % ndisks. With a single file the layout is the plain one whatever the
+ * stripe width, and block 0 is always at the start of the first file.
+ */
+static int diskfile[MAX_STRIPES];
+static int ndisks;
+static int stripe_blocks = DEFAULT_STRIPE_BLOCKS;
+
+/*
+ * In direct mode the backing files are opened with O_DIRECT so their pages
+ * stay out of the host page cache. The kernel then needs block aligned
+ * buffers; callers' buffers that are not go through a fixed pool of
+ * aligned bounce buffers, so the memory used for I/O has a hard bound.
+ */
+static int direct_io;
+static char* pool_mem;
+static void* pool[DIRECT_POOL_BUFFERS];
+static int pool_free;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+
+#define IS_ALIGNED(p)	(((uintptr_t)(p) & (BLOCK_SIZE - 1)) == 0)
+
+/* a new image is formatted as a log; log_mode says the open one is */
+static int log_format_new;
+static int log_mode;
+
+/*
+ * RAM mode. The whole image sits in anonymous memory, on huge pages when
+ * asked and available. RAM_SCRATCH has no backing file at all; RAM_PERSIST
+ * loads the image when it is opened and writes the blocks changed since
+ * back at dev_sync() and dev_close().
+ */
+static int ram_mode, ram_huge;
+static char* ram;					/* NULL unless the open image is in memory */
+static uint64_t* ram_dirty;			/* a bit per block changed since the last save */
+static int ram_pending;				/* striped image: only block 0 loaded until dev_set_stripe() */
+
+/* the part of a multi-block request that falls on one backing file */
+struct stripe_io {
+	int			fd;
+	int			write;
+	int			nsegs;
+	struct {
+		char*	buf;
+		off_t	off;
+		size_t	len;
+	}*			segs;
+	int			ret;
+	pthread_t	tid;
+};
+
+static int split_paths(const char* diskfile_path, char paths[MAX_STRIPES][PATH_MAX]) {
+	int n = 0;
+	const char* p = diskfile_path;
+	while (n < MAX_STRIPES) {
+		const char* end = strchr(p, ',');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		if (len >= PATH_MAX) {
+			len = PATH_MAX - 1;
+		}
+		memcpy(paths[n], p, len);
+		paths[n++][len] = '\0';
+		if (end == NULL) {
+			break;
+		}
+		p = end + 1;
+	}
+	return n;
+}
+
+static void pool_init() {
+    if (!direct_io || pool_mem != NULL) {
+		return;
+    }
+    if (posix_memalign((void**)&pool_mem, BLOCK_SIZE, (size_t)DIRECT_POOL_BUFFERS * BLOCK_SIZE) != 0) {
+		perror("bounce buffer pool");
+		exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < DIRECT_POOL_BUFFERS; i++) {
+		pool[i] = pool_mem + (size_t)i * BLOCK_SIZE;
+    }
+    pool_free = DIRECT_POOL_BUFFERS;
+}
+
+static void *pool_get() {
+    pthread_mutex_lock(&pool_lock);
+    while (pool_free == 0) {
+		pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    void* buf = pool[--pool_free];
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+static void pool_put(void *buf) {
+    pthread_mutex_lock(&pool_lock);
+    pool[pool_free++] = buf;
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// falls back to buffered I/O where the file system has no O_DIRECT, e.g. tmpfs
+static int open_backing(const char *path, int flags) {
+    if (direct_io) {
+		int fd = open(path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+		if (fd >= 0 || errno != EINVAL) {
+			return fd;
+		}
+		fprintf(stderr, "%s: O_DIRECT not supported, using buffered I/O\n", path);
+    }
+    return open(path, flags, S_IRUSR | S_IWUSR);
+}
+
+static int bio_rw_blocks(const int block_num, const int count, char *buf, int write);
+
+static int map_block(int block_num, off_t *off) {
+	int unit = block_num / stripe_blocks;
+	*off = ((off_t)(unit / ndisks) * stripe_blocks + block_num % stripe_blocks) * BLOCK_SIZE;
+	return diskfile[unit % ndisks];
+}
+
+/*
+ * Write-back. bio_write() copies the block into a table of dirty blocks
+ * and returns. A flusher thread sweeps the table once WB_DIRTY_BACKGROUND
+ * blocks are dirty or the oldest has waited WB_EXPIRE_MS. A sweep sorts the
+ * blocks like an elevator and writes each run of adjacent ones with a
+ * single pwritev. A block written again while its sweep is in flight gets
+ * a new buffer and stays dirty.
+ */
+#define WB_BUCKETS 4096
+
+struct wb_block {
+	struct wb_block*	hnext;
+	int					blk;
+	uint64_t			seq;		/* bumped by every write */
+	char*				data;
+	char*				held;		/* buffer a sweep is writing, or NULL */
+};
+
+struct wb_item {
+	int			blk;
+	uint64_t	seq;
+	char*		data;
+};
+
+static int writeback;
+static struct wb_block* wb_table[WB_BUCKETS];
+static int wb_dirty;
+static uint64_t wb_seq;
+static uint64_t wb_gen;			/* bumped when a sweep cleans blocks */
+static uint64_t wb_since;		/* when the oldest dirty block was dirtied */
+static int wb_running, wb_stopping;
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t wb_sweep_lock = PTHREAD_MUTEX_INITIALIZER;	/* one sweep at a time */
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;		/* wakes the flusher */
+static pthread_cond_t wb_space = PTHREAD_COND_INITIALIZER;		/* wakes throttled writers */
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct wb_block **wb_find(int blk) {
+    struct wb_block** p = &wb_table[(unsigned)blk % WB_BUCKETS];
+    while (*p != NULL && (*p)->blk != blk) {
+		p = &(*p)->hnext;
+    }
+    return p;
+}
+
+static int wb_cmp(const void *a, const void *b) {
+    return ((const struct wb_item*)a)->blk - ((const struct wb_item*)b)->blk;
+}
+
+static void wb_write(int blk, const void *buf) {
+    pthread_mutex_lock(&wb_lock);
+    struct wb_block** p = wb_find(blk);
+    while (*p == NULL && wb_dirty >= WB_DIRTY_MAX) {
+		pthread_cond_signal(&wb_cond);
+		pthread_cond_wait(&wb_space, &wb_lock);
+		p = wb_find(blk);
+    }
+
+    struct wb_block* e = *p;
+    if (e == NULL) {
+		e = calloc(1, sizeof(struct wb_block));
+		e->blk = blk;
+		*p = e;
+		if (wb_dirty++ == 0) {
+			wb_since = now_ns();
+		}
+    }
+    if (e->data == NULL || e->data == e->held) {
+		e->data = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+    }
+    memcpy(e->data, buf, BLOCK_SIZE);
+    e->seq = ++wb_seq;
+    if (wb_dirty == WB_DIRTY_BACKGROUND) {
+		pthread_cond_signal(&wb_cond);
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+
+static int wb_read(int blk, void *buf) {
+    pthread_mutex_lock(&wb_lock);
+    struct wb_block* e = *wb_find(blk);
+    if (e != NULL) {
+		memcpy(buf, e->data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return e != NULL;
+}
+
+// copy the dirty blocks of a range over what was read from disk
+static void wb_overlay(int block_num, int count, char *buf) {
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; wb_dirty > 0 && i < count; i++) {
+		struct wb_block* e = *wb_find(block_num + i);
+		if (e != NULL) {
+			memcpy(buf + (size_t)i * BLOCK_SIZE, e->data, BLOCK_SIZE);
+		}
+    }
+    pthread_mutex_unlock(&wb_lock);
+}
+
+static int wb_write_run(struct wb_item *items, int n) {
+    struct iovec iov[WB_MAX_RUN];
+    for (int i = 0; i < n; i++) {
+		iov[i].iov_base = items[i].data;
+		iov[i].iov_len = BLOCK_SIZE;
+    }
+    off_t off;
+    int fd = map_block(items[0].blk, &off);
+    size_t left = (size_t)n * BLOCK_SIZE;
+    struct iovec* v = iov;
+    while (left > 0) { // pwritev may stop short; resume where it did
+		ssize_t w = pwritev(fd, v, n - (v - iov), off);
+		if (w <= 0) {
+			perror("block_write failed");
+			return -1;
+		}
+		left -= w;
+		off += w;
+		while (w > 0 && w >= (ssize_t)v->iov_len) {
+			w -= v->iov_len;
+			v++;
+		}
+		if (w > 0) {
+			v->iov_base = (char*)v->iov_base + w;
+			v->iov_len -= w;
+		}
+    }
+    stats_count(CTR_WB_RUNS, 1);
+    stats_count(CTR_WB_BLOCKS, n);
+    return 0;
+}
+
+/*
+ * Write out every block that is dirty when the sweep starts
+ */
+static void wb_sweep() {
+    pthread_mutex_lock(&wb_sweep_lock);
+
+    // Step 1: Take the dirty blocks, then sort them by block number
+    pthread_mutex_lock(&wb_lock);
+    int n = 0;
+    struct wb_item* items = malloc((wb_dirty + 1) * sizeof(struct wb_item));
+    for (int b = 0; b < WB_BUCKETS; b++) {
+		for (struct wb_block* e = wb_table[b]; e != NULL; e = e->hnext) {
+			e->held = e->data;
+			items[n].blk = e->blk;
+			items[n].seq = e->seq;
+			items[n].data = e->data;
+			n++;
+		}
+    }
+    pthread_mutex_unlock(&wb_lock);
+    qsort(items, n, sizeof(struct wb_item), wb_cmp);
+
+    // Step 2: One pwritev per run of adjacent blocks on the same stripe unit
+    uint8_t* failed = calloc(n + 1, 1);
+    for (int i = 0; i < n; ) {
+		int j = i + 1;
+		while (j < n && j - i < WB_MAX_RUN && items[j].blk == items[j - 1].blk + 1 &&
+			(ndisks == 1 || items[j].blk % stripe_blocks != 0)) {
+			j++;
+		}
+		if (wb_write_run(items + i, j - i) < 0) {
+			memset(failed + i, 1, j - i);
+		}
+		i = j;
+    }
+
+    // Step 3: Blocks not written again meanwhile are clean
+    pthread_mutex_lock(&wb_lock);
+    for (int i = 0; i < n; i++) {
+		struct wb_block** p = wb_find(items[i].blk);
+		struct wb_block* e = *p;
+		if (e->seq == items[i].seq && !failed[i]) {
+			*p = e->hnext;
+			free(e->data);
+			free(e);
+			wb_dirty--;
+			continue;
+		}
+		if (e->data != items[i].data) {
+			free(items[i].data);
+		}
+		e->held = NULL;
+    }
+    wb_gen++;
+    wb_since = now_ns();
+    pthread_cond_broadcast(&wb_space);
+    pthread_mutex_unlock(&wb_lock);
+
+    free(failed);
+    free(items);
+    pthread_mutex_unlock(&wb_sweep_lock);
+}
+
+static void *wb_main(void *arg) {
+    pthread_mutex_lock(&wb_lock);
+    while (!wb_stopping) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += WB_INTERVAL_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000L;
+		ts.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&wb_cond, &wb_lock, &ts);
+		if (wb_dirty >= WB_DIRTY_BACKGROUND ||
+			(wb_dirty > 0 && now_ns() - wb_since >= WB_EXPIRE_MS * 1000000ull)) {
+			pthread_mutex_unlock(&wb_lock);
+			wb_sweep();
+			pthread_mutex_lock(&wb_lock);
+		}
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+static void wb_start() {
+    wb_stopping = 0;
+    wb_running = writeback && pthread_create(&wb_thread, NULL, wb_main, NULL) == 0;
+}
+
+static void wb_stop() {
+    if (wb_running) {
+		pthread_mutex_lock(&wb_lock);
+		wb_stopping = 1;
+		pthread_cond_signal(&wb_cond);
+		pthread_mutex_unlock(&wb_lock);
+		pthread_join(wb_thread, NULL);
+		wb_running = 0;
+    }
+    while (wb_dirty > 0) {
+		int before = wb_dirty;
+		wb_sweep();
+		if (wb_dirty == before) { // the device keeps failing; give up on them
+			break;
+		}
+    }
+    for (int b = 0; b < WB_BUCKETS; b++) {
+		while (wb_table[b] != NULL) {
+			struct wb_block* e = wb_table[b];
+			wb_table[b] = e->hnext;
+			free(e->data);
+			free(e);
+		}
+    }
+    wb_dirty = 0;
+}
+
+static int ram_alloc() {
+    size_t size = (size_t)RAM_BLOCKS * BLOCK_SIZE;
+    void* p = MAP_FAILED;
+    if (ram_huge) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p != MAP_FAILED && ram_huge) { // no reserved huge pages; transparent ones will do
+			madvise(p, size, MADV_HUGEPAGE);
+		}
+    }
+    if (p == MAP_FAILED) {
+		perror("ram image");
+		return -1;
+    }
+    ram = p;
+    ram_dirty = calloc(RAM_BLOCKS / 64, sizeof(uint64_t));
+    return 0;
+}
+
+static int backing_rw(int block_num, int count, char *buf, int write) {
+    if (log_mode) {
+		return write ? log_write(block_num, count, buf) : log_read(block_num, count, buf);
+    }
+    return bio_rw_blocks(block_num, count, buf, write);
+}
+
+// blocks first..RAM_BLOCKS-1, laid out by the current stripe unit
+static int ram_load(int first) {
+    for (int b = first; b < RAM_BLOCKS; b += WB_MAX_RUN) {
+		int run = RAM_BLOCKS - b < WB_MAX_RUN ? RAM_BLOCKS - b : WB_MAX_RUN;
+		if (backing_rw(b, run, ram + (size_t)b * BLOCK_SIZE, 0) < 0) {
+			return -1;
+		}
+    }
+    return 0;
+}
+
+// write each run of changed blocks with one call; blocks changed meanwhile stay dirty
+static void ram_save() {
+    int start = -1;
+    for (int w = 0; w <= RAM_BLOCKS / 64; w++) {
+		uint64_t bits = w < RAM_BLOCKS / 64 ? __atomic_exchange_n(&ram_dirty[w], 0, __ATOMIC_ACQ_REL) : 0;
+		for (int bit = 0; bit < 64; bit++) {
+			int blk = w * 64 + bit;
+			if (bits & (1ull << bit)) {
+				if (start < 0) {
+					start = blk;
+				}
+				continue;
+			}
+			if (start >= 0) {
+				if (backing_rw(start, blk - start, ram + (size_t)start * BLOCK_SIZE, 1) < 0) {
+					for (int b = start; b < blk; b++) { // try again at the next save
+						__atomic_or_fetch(&ram_dirty[b / 64], 1ull << (b % 64), __ATOMIC_RELEASE);
+					}
+				}
+				start = -1;
+			}
+		}
+    }
+}
+
+static void ram_free() {
+    if (ram != NULL) {
+		munmap(ram, (size_t)RAM_BLOCKS * BLOCK_SIZE);
+		free(ram_dirty);
+		ram = NULL;
+		ram_dirty = NULL;
+    }
+}
+
+static int ram_range(int block_num, int count) {
+    return block_num >= 0 && count >= 0 && block_num + count <= RAM_BLOCKS;
+}
+
+static void ram_mark(int block_num, int count) {
+    if (ram_mode == RAM_PERSIST) {
+		for (int b = block_num; b < block_num + count; b++) {
+			__atomic_or_fetch(&ram_dirty[b / 64], 1ull << (b % 64), __ATOMIC_RELEASE);
+		}
+    }
+}
 
-//Creates a file which is your new emulated disk
+//Creates the files which are your new emulated disk
 void dev_init(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (ndisks > 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (ram_mode == RAM_SCRATCH) {
+		if (ram_alloc() < 0) {
+			exit(EXIT_FAILURE);
+		}
+		ndisks = 1;
+		diskfile[0] = -1;
+		return;
+    }
+
+    char paths[MAX_STRIPES][PATH_MAX];
+    int n = split_paths(diskfile_path, paths);
+    if (log_format_new && n > 1) {
+		fprintf(stderr, "rufs: a log-structured image needs a single backing file\n");
 		exit(EXIT_FAILURE);
     }
-	
-    ftruncate(diskfile, DISK_SIZE);
+    off_t units = (DISK_SIZE / BLOCK_SIZE + stripe_blocks - 1) / stripe_blocks;
+    off_t size = (units + n - 1) / n * stripe_blocks * BLOCK_SIZE;
+    for (int i = 0; i < n; i++) {
+		diskfile[i] = open_backing(paths[i], O_CREAT | O_RDWR);
+		if (diskfile[i] < 0) {
+			perror("disk_open failed");
+			exit(EXIT_FAILURE);
+		}
+		ftruncate(diskfile[i], n == 1 ? DISK_SIZE : size);
+    }
+    ndisks = n;
+    pool_init();
+    if (log_format_new) { // start from an empty file so no stale segment looks valid
+		ftruncate(diskfile[0], 0);
+		ftruncate(diskfile[0], (off_t)log_disk_blocks() * BLOCK_SIZE);
+		log_format();
+		if (log_open() < 0) {
+			exit(EXIT_FAILURE);
+		}
+		log_mode = 1;
+    }
+    if (ram_mode == RAM_PERSIST) { // the new file is all zeroes, and so is fresh memory
+		if (ram_alloc() < 0) {
+			exit(EXIT_FAILURE);
+		}
+		return;
+    }
+    if (!log_mode) {
+		wb_start();
+    }
 }
 
-//Function to open the disk file
+//Function to open the disk files
 int dev_open(const char* diskfile_path) {
-    if (diskfile >= 0) {
+    if (ndisks > 0) {
 		return 0;
     }
-    
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
-		perror("disk_open failed");
+    if (ram_mode == RAM_SCRATCH) { // nothing to open; the caller formats a new image
 		return -1;
     }
+    
+    char paths[MAX_STRIPES][PATH_MAX];
+    int n = split_paths(diskfile_path, paths);
+    for (int i = 0; i < n; i++) {
+		diskfile[i] = open_backing(paths[i], O_RDWR);
+		if (diskfile[i] < 0) {
+			perror("disk_open failed");
+			while (i-- > 0) {
+				close(diskfile[i]);
+			}
+			return -1;
+		}
+    }
+    ndisks = n;
+    pool_init();
+    if (n == 1 && log_probe()) {
+		if (log_open() < 0) {
+			close(diskfile[0]);
+			ndisks = 0;
+			return -1;
+		}
+		log_mode = 1;
+    }
+    if (ram_mode == RAM_PERSIST) {
+		// over several files only block 0 is where it is whatever the stripe
+		// unit, so the rest waits for dev_set_stripe() with the superblock's
+		ram_pending = n > 1;
+		if (ram_alloc() < 0 || (ram_pending ? backing_rw(0, 1, ram, 0) : ram_load(0)) < 0) {
+			fprintf(stderr, "rufs: cannot load the image into memory\n");
+			dev_close();
+			return -1;
+		}
+		return 0;
+    }
+    if (!log_mode) {
+		wb_start();
+    }
 	return 0;
 }
 
 void dev_close() {
-    if (diskfile >= 0) {
-		close(diskfile);
+    if (ram != NULL && ram_mode == RAM_PERSIST) {
+		ram_save();
+    }
+    ram_free();
+    ram_pending = 0;
+    if (log_mode) {
+		log_close();
+		log_mode = 0;
+    }
+    wb_stop();
+    for (int i = 0; i < ndisks; i++) {
+		if (diskfile[i] >= 0) {
+			close(diskfile[i]);
+		}
+    }
+    ndisks = 0;
+    free(pool_mem);
+    pool_mem = NULL;
+}
+
+void dev_set_direct(int on) {
+    direct_io = on;
+}
+
+void dev_set_writeback(int on) {
+    writeback = on;
+}
+
+void dev_set_log(int on) {
+    log_format_new = on;
+}
+
+void dev_set_ram(int mode, int huge) {
+    ram_mode = mode;
+    ram_huge = huge;
+}
+
+int dev_in_memory() {
+    return ram != NULL;
+}
+
+// nothing will be written from here on, so the flusher has nothing to do
+// and reads need not look for dirty blocks
+void dev_readonly() {
+    wb_stop();
+}
+
+void dev_flush() {
+    if (log_mode) {
+		log_flush();
+    }
+    if (wb_running) {
+		wb_sweep();
+    }
+}
+
+void dev_sync() {
+    if (ram != NULL && ram_mode == RAM_PERSIST) {
+		ram_save();
+    }
+    if (log_mode) {
+		log_checkpoint();
+    }
+    dev_flush();
+    for (int i = 0; i < ndisks; i++) {
+		if (diskfile[i] >= 0) {
+			fsync(diskfile[i]);
+		}
     }
 }
 
+int dev_set_stripe(int blocks) {
+    if (blocks > 0) {
+		stripe_blocks = blocks;
+    }
+    if (ram_pending) {
+		ram_pending = 0;
+		if (ram_load(1) < 0) {
+			fprintf(stderr, "rufs: cannot load the image into memory\n");
+			return -1;
+		}
+    }
+    return 0;
+}
+
+int dev_stripes() {
+    return ndisks;
+}
+
+int dev_stripe_blocks() {
+    return stripe_blocks;
+}
+
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
+    TRACE_SCOPE(EV_BIO_READ, block_num);
+    if (ram != NULL) {
+		stats_count(CTR_BIO_READ, 1);
+		stats_count(CTR_BIO_READ_BYTES, BLOCK_SIZE);
+		if (!ram_range(block_num, 1)) {
+			memset(buf, 0, BLOCK_SIZE);
+			return -1;
+		}
+		memcpy(buf, ram + (size_t)block_num * BLOCK_SIZE, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+    if (cache_lookup(CACHE_BLOCK, block_num, NULL, buf, BLOCK_SIZE) == BLOCK_SIZE) {
+		return BLOCK_SIZE;
+    }
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (wb_running && wb_read(block_num, buf)) {
+		cache_insert(CACHE_BLOCK, block_num, NULL, buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
+    if (log_mode) {
+		retstat = log_read(block_num, 1, buf);
+    } else {
+		off_t off;
+		int fd = map_block(block_num, &off);
+		void* io = (direct_io && !IS_ALIGNED(buf)) ? pool_get() : buf;
+		retstat = pread(fd, io, BLOCK_SIZE, off);
+		if (io != buf) {
+			memcpy(buf, io, BLOCK_SIZE);
+			pool_put(io);
+		}
+    }
+    stats_count(CTR_BIO_READ, 1);
+    stats_count(CTR_BIO_READ_BYTES, BLOCK_SIZE);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
+    if (retstat == BLOCK_SIZE) {
+		cache_insert(CACHE_BLOCK, block_num, NULL, buf, BLOCK_SIZE);
+    } else {
+		cache_abandon(CACHE_BLOCK, block_num, NULL);
+    }
 
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
+    TRACE_SCOPE(EV_BIO_WRITE, block_num);
+    if (ram != NULL) {
+		stats_count(CTR_BIO_WRITE, 1);
+		stats_count(CTR_BIO_WRITE_BYTES, BLOCK_SIZE);
+		if (!ram_range(block_num, 1)) {
+			return -1;
+		}
+		memcpy(ram + (size_t)block_num * BLOCK_SIZE, buf, BLOCK_SIZE);
+		ram_mark(block_num, 1);
+		return BLOCK_SIZE;
+    }
+    if (wb_running) {
+		wb_write(block_num, buf);
+		cache_update(CACHE_BLOCK, block_num, NULL, buf, BLOCK_SIZE);
+		stats_count(CTR_BIO_WRITE, 1);
+		stats_count(CTR_BIO_WRITE_BYTES, BLOCK_SIZE);
+		return BLOCK_SIZE;
+    }
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (log_mode) {
+		retstat = log_write(block_num, 1, buf);
+    } else {
+		off_t off;
+		int fd = map_block(block_num, &off);
+		void* io = (direct_io && !IS_ALIGNED(buf)) ? pool_get() : (void*)buf;
+		if (io != buf) {
+			memcpy(io, buf, BLOCK_SIZE);
+		}
+		retstat = pwrite(fd, io, BLOCK_SIZE, off);
+		if (io != buf) {
+			pool_put(io);
+		}
+    }
+    stats_count(CTR_BIO_WRITE, 1);
+    stats_count(CTR_BIO_WRITE_BYTES, BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
+		    cache_invalidate(CACHE_BLOCK, block_num, NULL);
+    } else {
+		    cache_update(CACHE_BLOCK, block_num, NULL, buf, BLOCK_SIZE);
     }
     return retstat;
 }
 
+/*
+ * Transfer every segment of one backing file's share of a request. Reads
+ * past the end of a file come back as zeroes.
+ */
+static void *stripe_io_run(void *arg) {
+    struct stripe_io* io = arg;
+    io->ret = 0;
+    for (int s = 0; s < io->nsegs; s++) {
+		size_t done = 0, len = io->segs[s].len;
+		while (done < len) {
+			char* p = io->segs[s].buf + done;
+			off_t off = io->segs[s].off + done;
+			ssize_t n = io->write ? pwrite(io->fd, p, len - done, off) : pread(io->fd, p, len - done, off);
+			if (n < 0 || (n == 0 && io->write)) {
+				perror(io->write ? "block_write failed" : "block_read failed");
+				io->ret = -1;
+				return NULL;
+			}
+			if (n == 0) {
+				memset(p, 0, len - done);
+				break;
+			}
+			done += n;
+		}
+    }
+    return NULL;
+}
+
+/*
+ * Split count consecutive blocks into per-file segments, then move each
+ * file's share on its own thread so all backing devices work at once
+ */
+static int bio_rw_blocks(const int block_num, const int count, char *buf, int write) {
+    if (direct_io && !IS_ALIGNED(buf)) { // a block at a time through the pool
+		void* bounce = pool_get();
+		int ret = count * BLOCK_SIZE;
+		for (int i = 0; i < count && ret >= 0; i++) {
+			if (write) {
+				memcpy(bounce, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+			}
+			if (bio_rw_blocks(block_num + i, 1, bounce, write) < 0) {
+				ret = -1;
+			} else if (!write) {
+				memcpy(buf + (size_t)i * BLOCK_SIZE, bounce, BLOCK_SIZE);
+			}
+		}
+		pool_put(bounce);
+		return ret;
+    }
+
+    struct stripe_io io[MAX_STRIPES];
+    int max_segs = count / stripe_blocks + 2;
+    for (int d = 0; d < ndisks; d++) {
+		io[d].fd = diskfile[d];
+		io[d].write = write;
+		io[d].nsegs = 0;
+		io[d].segs = NULL;
+    }
+
+    // Step 1: Cut the range at stripe unit boundaries
+    for (int b = block_num; b < block_num + count; ) {
+		int len = stripe_blocks - b % stripe_blocks;
+		if (len > block_num + count - b) {
+			len = block_num + count - b;
+		}
+		off_t off;
+		int d = (b / stripe_blocks) % ndisks;
+		map_block(b, &off);
+		char* p = buf + (size_t)(b - block_num) * BLOCK_SIZE;
+		if (io[d].segs == NULL) {
+			io[d].segs = malloc(max_segs * sizeof(*io[d].segs));
+		}
+		int last = io[d].nsegs - 1;
+		if (last >= 0 && io[d].segs[last].buf + io[d].segs[last].len == p &&
+			io[d].segs[last].off + (off_t)io[d].segs[last].len == off) { // always the case with one file
+			io[d].segs[last].len += (size_t)len * BLOCK_SIZE;
+		} else {
+			io[d].segs[io[d].nsegs].buf = p;
+			io[d].segs[io[d].nsegs].off = off;
+			io[d].segs[io[d].nsegs].len = (size_t)len * BLOCK_SIZE;
+			io[d].nsegs++;
+		}
+		b += len;
+    }
+
+    // Step 2: One thread per extra file involved; the caller takes the first
+    int first = -1;
+    for (int d = 0; d < ndisks; d++) {
+		if (io[d].nsegs == 0) {
+			continue;
+		}
+		if (first < 0) {
+			first = d;
+		} else if (pthread_create(&io[d].tid, NULL, stripe_io_run, &io[d]) != 0) {
+			io[d].tid = 0;
+			stripe_io_run(&io[d]);
+		}
+    }
+    stripe_io_run(&io[first]);
+
+    // Step 3: Wait for the rest
+    int ret = count * BLOCK_SIZE;
+    for (int d = 0; d < ndisks; d++) {
+		if (io[d].nsegs > 0 && d != first && io[d].tid != 0) {
+			pthread_join(io[d].tid, NULL);
+		}
+		if (io[d].nsegs > 0 && io[d].ret < 0) {
+			ret = -1;
+		}
+		free(io[d].segs);
+    }
+    return ret;
+}
+
+//Read count consecutive blocks with as few system calls as possible
+int bio_read_blocks(const int block_num, const int count, void *buf) {
+    TRACE_SCOPE(EV_BIO_READ, block_num);
+    stats_count(CTR_BIO_READ, 1);
+    stats_count(CTR_BIO_READ_BYTES, (uint64_t)count * BLOCK_SIZE);
+    if (ram != NULL) {
+		if (!ram_range(block_num, count)) {
+			return -1;
+		}
+		memcpy(buf, ram + (size_t)block_num * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+		return count * BLOCK_SIZE;
+    }
+    if (log_mode) {
+		return log_read(block_num, count, buf);
+    }
+    if (!wb_running) {
+		return bio_rw_blocks(block_num, count, buf, 0);
+    }
+
+    // a block cleaned by a sweep between the read and the overlay may have
+    // been read before the sweep wrote it, so go again if a sweep finished
+    int ret;
+    uint64_t gen;
+    do {
+		gen = __atomic_load_n(&wb_gen, __ATOMIC_ACQUIRE);
+		ret = bio_rw_blocks(block_num, count, buf, 0);
+		wb_overlay(block_num, count, buf);
+    } while (ret >= 0 && __atomic_load_n(&wb_gen, __ATOMIC_ACQUIRE) != gen);
+    return ret;
+}
+
+//Write count consecutive blocks with as few system calls as possible
+int bio_write_blocks(const int block_num, const int count, const void *buf) {
+    TRACE_SCOPE(EV_BIO_WRITE, block_num);
+    stats_count(CTR_BIO_WRITE, 1);
+    stats_count(CTR_BIO_WRITE_BYTES, (uint64_t)count * BLOCK_SIZE);
+    int ret = count * BLOCK_SIZE;
+    if (ram != NULL) {
+		if (!ram_range(block_num, count)) {
+			return -1;
+		}
+		memcpy(ram + (size_t)block_num * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+		ram_mark(block_num, count);
+		return ret;
+    }
+    if (log_mode) {
+		ret = log_write(block_num, count, buf);
+    } else if (wb_running) {
+		for (int i = 0; i < count; i++) {
+			wb_write(block_num + i, (const char*)buf + (size_t)i * BLOCK_SIZE);
+		}
+    } else {
+		ret = bio_rw_blocks(block_num, count, (char*)buf, 1);
+    }
+    for (int i = 0; i < count; i++) {
+		if (ret < 0) {
+			cache_invalidate(CACHE_BLOCK, block_num + i, NULL);
+			continue;
+		}
+		cache_update(CACHE_BLOCK, block_num + i, NULL, (const char*)buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+    }
+    return ret;
+}
+
+int dev_raw_read(int pblk, int count, void *buf) {
+    return bio_rw_blocks(pblk, count, buf, 0);
+}
+
+int dev_raw_write(int pblk, int count, const void *buf) {
+    return bio_rw_blocks(pblk, count, (char*)buf, 1);
+}
@@ -10,10 +10,54 @@
 
 #define BLOCK_SIZE 4096
 
+#define MAX_STRIPES 8				/* backing files one disk can be striped over */
+#define DEFAULT_STRIPE_BLOCKS 16	/* blocks per stripe unit */
+#define DIRECT_POOL_BUFFERS 64		/* aligned bounce buffers for O_DIRECT */
+
+#define WB_DIRTY_MAX 4096			/* writers wait while this many blocks are dirty */
+#define WB_DIRTY_BACKGROUND 1024	/* dirty blocks that start a flush */
+#define WB_EXPIRE_MS 3000			/* or the age of the oldest that does */
+#define WB_INTERVAL_MS 500			/* how often the flusher looks */
+#define WB_MAX_RUN 256				/* blocks per pwritev */
+
+#define RAM_OFF 0
+#define RAM_SCRATCH 1				/* the image lives and dies in memory */
+#define RAM_PERSIST 2				/* loaded from the disk file at open, saved at sync and close */
+#define RAM_BLOCKS 16384			/* blocks held in memory, MAX_DNUM in rufs.h */
+
+/*
+ * A disk path may list several backing files separated by commas; block
+ * numbers are then striped across them. With write-back on, bio_write()
+ * only dirties a block; dev_flush() writes every dirty block out and
+ * dev_sync() also makes them durable. An image made with dev_set_log(1)
+ * is log-structured (see log.h) and is recognized as such when opened.
+ * In RAM mode the image is held in memory and bio_read()/bio_write() are
+ * a memcpy; write-back and the block cache are then bypassed. A persistent
+ * RAM image striped over several files is loaded in two steps: dev_open()
+ * reads block 0, and dev_set_stripe() the rest once the caller knows the
+ * stripe unit.
+ */
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+void dev_sync();
+void dev_flush();
+void dev_set_writeback(int on);
+void dev_set_direct(int on);
+void dev_set_log(int on);
+void dev_set_ram(int mode, int huge);	/* RAM_*, huge: try huge pages */
+int dev_in_memory();
+void dev_readonly();		/* after dev_open(): the image is not written again */
+int dev_set_stripe(int blocks);
+int dev_stripes();
+int dev_stripe_blocks();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_read_blocks(const int block_num, const int count, void *buf);
+int bio_write_blocks(const int block_num, const int count, const void *buf);
+
+/* blocks where they sit in the backing files, under the cache, write-back and log */
+int dev_raw_read(int pblk, int count, void *buf);
+int dev_raw_write(int pblk, int count, const void *buf);
 
 #endif
@@ -0,0 +1,542 @@
+/*
+ *	Tiny File System
+ *	File:	cache.c
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "cache.h"
+#include "stats.h"
+
+/*
+ * A missed key gets a pending entry that is on no list. Readers that miss
+ * fill it with what they read from disk; a write or invalidation while
+ * they are reading marks it stale, so old data never becomes live.
+ */
+enum cache_list_id {
+	LIST_A1IN,			/* seen once, FIFO */
+	LIST_AM,			/* seen again, LRU */
+	LIST_A1OUT,			/* ghosts: keys recently dropped from A1in, no data */
+	LIST_PENDING,
+	LISTS = LIST_PENDING
+};
+
+struct cache_entry {
+	struct cache_entry*	hnext;
+	struct cache_entry*	prev;		/* on its list; the head is the most recent */
+	struct cache_entry*	next;
+	uint32_t			hash;
+	uint32_t			id;
+	uint8_t				kind;
+	uint8_t				list;
+	uint8_t				stale;		/* pending: changed while being read */
+	uint8_t				promote;	/* pending: was a ghost, so goes to Am */
+	uint16_t			readers;	/* pending: misses still to fill or abandon */
+	uint16_t			namelen;
+	uint32_t			len;
+	void*				data;
+	char				name[];
+};
+
+struct cache_list {
+	struct cache_entry*	head;
+	struct cache_entry*	tail;
+	size_t				bytes;
+	int					count;
+};
+
+struct cache_kind_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	size_t		bytes;
+	int			entries;
+};
+
+static const char* kind_names[CACHE_KINDS] = { "block", "inode", "dentry" };
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled;
+static size_t budget = CACHE_DEFAULT_BUDGET;
+static size_t limit;				/* the budget, or less while memory is short */
+static struct cache_entry** table;
+static uint32_t nbuckets;
+static struct cache_list lists[LISTS];
+static struct cache_kind_stats kinds[CACHE_KINDS];
+static uint64_t ghost_hits, evictions, shrinks;
+
+static pthread_t pressure_thread;
+static pthread_cond_t pressure_cond = PTHREAD_COND_INITIALIZER;
+static int stopping;
+
+/*
+ * hash table and lists, callers hold cache_lock
+ */
+static uint32_t hash_key(int kind, uint32_t id, const char *name, size_t namelen) {
+	uint32_t h = 2166136261u;	// FNV-1a
+	h = (h ^ kind) * 16777619u;
+	for (int i = 0; i < 4; i++) {
+		h = (h ^ ((id >> (8 * i)) & 0xff)) * 16777619u;
+	}
+	for (size_t i = 0; i < namelen; i++) {
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return h;
+}
+
+static struct cache_entry **find(int kind, uint32_t id, const char *name, size_t namelen, uint32_t hash) {
+	struct cache_entry** p = &table[hash & (nbuckets - 1)];
+	for (; *p != NULL; p = &(*p)->hnext) {
+		struct cache_entry* e = *p;
+		if (e->hash == hash && e->kind == kind && e->id == id && e->namelen == namelen &&
+			(namelen == 0 || memcmp(e->name, name, namelen) == 0)) {
+			break;
+		}
+	}
+	return p;
+}
+
+static size_t charge(struct cache_entry *e) {
+	return sizeof(struct cache_entry) + e->namelen + e->len;
+}
+
+static void list_remove(struct cache_entry *e) {
+	if (e->list == LIST_PENDING) {
+		return;
+	}
+	struct cache_list* l = &lists[e->list];
+	if (e->prev) e->prev->next = e->next; else l->head = e->next;
+	if (e->next) e->next->prev = e->prev; else l->tail = e->prev;
+	l->count--;
+	if (e->list != LIST_A1OUT) {
+		l->bytes -= charge(e);
+		kinds[e->kind].bytes -= charge(e);
+		kinds[e->kind].entries--;
+	}
+	e->list = LIST_PENDING;
+}
+
+static void list_push(int list, struct cache_entry *e) {
+	struct cache_list* l = &lists[list];
+	e->list = list;
+	e->prev = NULL;
+	e->next = l->head;
+	if (l->head) l->head->prev = e; else l->tail = e;
+	l->head = e;
+	l->count++;
+	if (list != LIST_A1OUT) {
+		l->bytes += charge(e);
+		kinds[e->kind].bytes += charge(e);
+		kinds[e->kind].entries++;
+	}
+}
+
+static void entry_drop(struct cache_entry **p) {
+	struct cache_entry* e = *p;
+	list_remove(e);
+	*p = e->hnext;
+	free(e->data);
+	free(e);
+}
+
+static void entry_unhash_drop(struct cache_entry *e) {
+	entry_drop(find(e->kind, e->id, e->name, e->namelen, e->hash));
+}
+
+/*
+ * Evict until the live entries fit in the limit. A1in keeps a quarter of
+ * it; what falls out of A1in leaves a ghost, what falls out of Am does not.
+ */
+static void evict() {
+	size_t ghost_max = limit / BLOCK_SIZE / 2;
+	while (lists[LIST_A1IN].bytes + lists[LIST_AM].bytes > limit) {
+		struct cache_entry* e;
+		if (lists[LIST_A1IN].tail != NULL && (lists[LIST_A1IN].bytes > limit / 4 || lists[LIST_AM].tail == NULL)) {
+			e = lists[LIST_A1IN].tail;
+			list_remove(e);
+			free(e->data);
+			e->data = NULL;
+			e->len = 0;
+			list_push(LIST_A1OUT, e);
+		} else {
+			entry_unhash_drop(lists[LIST_AM].tail);
+		}
+		evictions++;
+	}
+	while ((size_t)lists[LIST_A1OUT].count > ghost_max) {
+		entry_unhash_drop(lists[LIST_A1OUT].tail);
+	}
+}
+
+static void set_data(struct cache_entry *e, const void *buf, size_t len) {
+	if (len != e->len) {
+		e->data = realloc(e->data, len ? len : 1);
+	}
+	e->len = len;
+	if (len > 0) { // cached dentry misses have no data
+		memcpy(e->data, buf, len);
+	}
+}
+
+/*
+ * cache operations
+ */
+void cache_set_budget(size_t bytes) {
+	budget = bytes;
+}
+
+/*
+ * Headroom of the cgroup's memory limit if there is one, else of the host
+ */
+static int mem_headroom(uint64_t *avail, uint64_t *total) {
+	FILE* f = fopen("/sys/fs/cgroup/memory.max", "r");
+	if (f != NULL) {
+		unsigned long long max = 0, cur = 0;
+		int limited = fscanf(f, "%llu", &max) == 1;
+		fclose(f);
+		f = limited ? fopen("/sys/fs/cgroup/memory.current", "r") : NULL;
+		if (f != NULL) {
+			int ok = fscanf(f, "%llu", &cur) == 1;
+			fclose(f);
+			if (ok) {
+				*total = max;
+				*avail = cur < max ? max - cur : 0;
+				return 0;
+			}
+		}
+	}
+
+	f = fopen("/proc/meminfo", "r");
+	if (f == NULL) {
+		return -1;
+	}
+	char line[128];
+	unsigned long long kb;
+	int found = 0;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "MemTotal: %llu kB", &kb) == 1) {
+			*total = kb * 1024;
+			found |= 1;
+		} else if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+			*avail = kb * 1024;
+			found |= 2;
+		}
+	}
+	fclose(f);
+	return found == 3 ? 0 : -1;
+}
+
+/*
+ * Halve the limit while less than a tenth of memory is available, double it
+ * back towards the budget once a quarter is
+ */
+static void *pressure_main(void *arg) {
+	pthread_mutex_lock(&cache_lock);
+	while (!stopping) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += CACHE_PRESSURE_MS / 1000;
+		ts.tv_nsec += (CACHE_PRESSURE_MS % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pressure_cond, &cache_lock, &ts);
+		if (stopping) {
+			break;
+		}
+
+		pthread_mutex_unlock(&cache_lock);
+		uint64_t avail = 0, total = 0;
+		int known = mem_headroom(&avail, &total) == 0;
+		pthread_mutex_lock(&cache_lock);
+		if (!known) {
+			continue;
+		}
+
+		int shrunk = 0;
+		if (avail < total / 10 && limit > CACHE_MIN_BUDGET) {
+			limit = limit / 2 > CACHE_MIN_BUDGET ? limit / 2 : CACHE_MIN_BUDGET;
+			evict();
+			shrinks++;
+			shrunk = 1;
+		} else if (avail > total / 4 && limit < budget) {
+			limit = limit * 2 < budget ? limit * 2 : budget;
+		}
+		if (shrunk) { // hand the freed memory back rather than keep it in malloc
+			pthread_mutex_unlock(&cache_lock);
+			malloc_trim(0);
+			pthread_mutex_lock(&cache_lock);
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return NULL;
+}
+
+void cache_init() {
+	if (budget == 0 || enabled) {
+		return;
+	}
+	nbuckets = 1024;
+	while (nbuckets < budget / BLOCK_SIZE * 2) {
+		nbuckets *= 2;
+	}
+	table = calloc(nbuckets, sizeof(struct cache_entry*));
+	memset(lists, 0, sizeof(lists));
+	memset(kinds, 0, sizeof(kinds));
+	ghost_hits = evictions = shrinks = 0;
+	limit = budget;
+	stopping = 0;
+	__atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+	pthread_create(&pressure_thread, NULL, pressure_main, NULL);
+}
+
+void cache_destroy() {
+	if (!enabled) {
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	stopping = 1;
+	pthread_cond_signal(&pressure_cond);
+	pthread_mutex_unlock(&cache_lock);
+	pthread_join(pressure_thread, NULL);
+
+	__atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+	for (uint32_t b = 0; b < nbuckets; b++) {
+		while (table[b] != NULL) {
+			entry_drop(&table[b]);
+		}
+	}
+	free(table);
+	table = NULL;
+}
+
+static struct cache_entry *make_pending(struct cache_entry **p, int kind, uint32_t id, const char *name, size_t namelen, uint32_t hash) {
+	struct cache_entry* e = *p;
+	if (e == NULL) {
+		e = calloc(1, sizeof(struct cache_entry) + namelen);
+		e->hash = hash;
+		e->id = id;
+		e->kind = kind;
+		e->namelen = namelen;
+		if (namelen > 0) {
+			memcpy(e->name, name, namelen);
+		}
+		e->list = LIST_PENDING;
+		*p = e;
+	} else if (e->list == LIST_A1OUT) {
+		list_remove(e);
+		e->promote = 1;
+		e->stale = 0;
+		ghost_hits++;
+	}
+	if (e->list == LIST_PENDING) {
+		e->readers++;
+	}
+	return e;
+}
+
+/*
+ * Copy a cached entry into buf and return its length, or return -1 on a
+ * miss. The caller must answer every miss with cache_insert() or
+ * cache_abandon().
+ */
+int cache_lookup(enum cache_kind kind, uint32_t id, const char *name, void *buf, size_t len) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+	size_t namelen = name ? strlen(name) : 0;
+	uint32_t hash = hash_key(kind, id, name, namelen);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry** p = find(kind, id, name, namelen, hash);
+	struct cache_entry* e = *p;
+	if (e != NULL && (e->list == LIST_A1IN || e->list == LIST_AM) && e->len <= len) {
+		int n = e->len;
+		if (n > 0) {
+			memcpy(buf, e->data, n);
+		}
+		if (e->list == LIST_AM) { // A1in stays FIFO, so a scan cannot refresh itself
+			list_remove(e);
+			list_push(LIST_AM, e);
+		}
+		kinds[kind].hits++;
+		pthread_mutex_unlock(&cache_lock);
+		stats_count(CTR_CACHE_HIT, 1);
+		return n;
+	}
+
+	// Step 2: Miss; leave a pending entry for the caller to fill
+	make_pending(p, kind, id, name, namelen, hash);
+	kinds[kind].misses++;
+	pthread_mutex_unlock(&cache_lock);
+	stats_count(CTR_CACHE_MISS, 1);
+	return -1;
+}
+
+static void fill(enum cache_kind kind, uint32_t id, const char *name, const void *buf, size_t len) {
+	size_t namelen = name ? strlen(name) : 0;
+	uint32_t hash = hash_key(kind, id, name, namelen);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry** p = find(kind, id, name, namelen, hash);
+	struct cache_entry* e = *p;
+	if (e == NULL || e->list != LIST_PENDING) { // filled by another reader, or gone
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	e->readers--;
+	if (e->stale || buf == NULL || sizeof(struct cache_entry) + namelen + len > limit / 4) {
+		if (e->readers == 0) {
+			entry_drop(p);
+		}
+		pthread_mutex_unlock(&cache_lock);
+		return;
+	}
+	set_data(e, buf, len);
+	list_push(e->promote ? LIST_AM : LIST_A1IN, e);
+	e->promote = 0;
+	e->readers = 0;
+	evict();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Fill the entry a cache_lookup() miss left, with what was just read
+ */
+void cache_insert(enum cache_kind kind, uint32_t id, const char *name, const void *buf, size_t len) {
+	if (__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		fill(kind, id, name, buf, len);
+	}
+}
+
+/*
+ * Set up a fill for a key known to be hot, without counting a lookup.
+ * Returns 1 if the caller must answer with cache_insert() or
+ * cache_abandon(), 0 if the key is cached or already being read.
+ */
+int cache_reserve(enum cache_kind kind, uint32_t id, const char *name) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	size_t namelen = name ? strlen(name) : 0;
+	uint32_t hash = hash_key(kind, id, name, namelen);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry** p = find(kind, id, name, namelen, hash);
+	int reserved = *p == NULL || (*p)->list == LIST_A1OUT;
+	if (reserved) {
+		make_pending(p, kind, id, name, namelen, hash)->promote = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return reserved;
+}
+
+/*
+ * Give up on a miss without filling it, e.g. after a failed read
+ */
+void cache_abandon(enum cache_kind kind, uint32_t id, const char *name) {
+	if (__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		fill(kind, id, name, NULL, 0);
+	}
+}
+
+/*
+ * Write-through: refresh a cached copy, and keep a read in flight from
+ * caching what it read before the write
+ */
+void cache_update(enum cache_kind kind, uint32_t id, const char *name, const void *buf, size_t len) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	size_t namelen = name ? strlen(name) : 0;
+	uint32_t hash = hash_key(kind, id, name, namelen);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry* e = *find(kind, id, name, namelen, hash);
+	if (e != NULL && e->list == LIST_PENDING) {
+		e->stale = 1;
+	} else if (e != NULL && e->list != LIST_A1OUT) {
+		int list = e->list;
+		list_remove(e);
+		set_data(e, buf, len);
+		list_push(list, e);
+		evict();
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_invalidate(enum cache_kind kind, uint32_t id, const char *name) {
+	if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	size_t namelen = name ? strlen(name) : 0;
+	uint32_t hash = hash_key(kind, id, name, namelen);
+
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry** p = find(kind, id, name, namelen, hash);
+	if (*p != NULL && (*p)->list == LIST_PENDING) {
+		(*p)->stale = 1;
+	} else if (*p != NULL) {
+		entry_drop(p);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Up to max cached block numbers, hottest first: Am from its most recently
+ * used end, then A1in from its newest
+ */
+int cache_hot_blocks(uint32_t *ids, int max) {
+	int n = 0;
+	pthread_mutex_lock(&cache_lock);
+	for (int list = LIST_AM; enabled && list >= LIST_A1IN; list--) {
+		for (struct cache_entry* e = lists[list].head; e != NULL && n < max; e = e->next) {
+			if (e->kind == CACHE_BLOCK) {
+				ids[n++] = e->id;
+			}
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return n;
+}
+
+/*
+ * Print the cache accounting in the Prometheus text format of stats_render()
+ */
+int cache_render(char *buf, size_t size) {
+	size_t n = 0;
+#define EMIT(...) do { \
+		if (n < size) { \
+			n += snprintf(buf + n, size - n, __VA_ARGS__); \
+		} \
+	} while (0)
+
+	pthread_mutex_lock(&cache_lock);
+	EMIT("rufs_cache_budget_bytes %zu\n", enabled ? budget : 0);
+	EMIT("rufs_cache_limit_bytes %zu\n", enabled ? limit : 0);
+	EMIT("rufs_cache_bytes{queue=\"a1in\"} %zu\n", lists[LIST_A1IN].bytes);
+	EMIT("rufs_cache_bytes{queue=\"am\"} %zu\n", lists[LIST_AM].bytes);
+	EMIT("rufs_cache_ghosts %d\n", lists[LIST_A1OUT].count);
+	for (int k = 0; k < CACHE_KINDS; k++) {
+		EMIT("rufs_cache_entries{kind=\"%s\"} %d\n", kind_names[k], kinds[k].entries);
+		EMIT("rufs_cache_entry_bytes{kind=\"%s\"} %zu\n", kind_names[k], kinds[k].bytes);
+		EMIT("rufs_cache_hits{kind=\"%s\"} %llu\n", kind_names[k], (unsigned long long)kinds[k].hits);
+		EMIT("rufs_cache_misses{kind=\"%s\"} %llu\n", kind_names[k], (unsigned long long)kinds[k].misses);
+	}
+	EMIT("rufs_cache_ghost_hits %llu\n", (unsigned long long)ghost_hits);
+	EMIT("rufs_cache_evictions %llu\n", (unsigned long long)evictions);
+	EMIT("rufs_cache_pressure_shrinks %llu\n", (unsigned long long)shrinks);
+	pthread_mutex_unlock(&cache_lock);
+#undef EMIT
+
+	return n < size ? n : size;
+}
@@ -0,0 +1,50 @@
+/*
+ *	Tiny File System
+ *	File:	cache.h
+ *
+ *	One memory budget shared by the block, inode and dentry caches.
+ *	Replacement is 2Q: new entries wait in a FIFO (A1in), and only keys
+ *	seen again after they left it (tracked by the A1out ghost list) get
+ *	into the LRU main queue (Am). A scan touches each key once, so it
+ *	streams through A1in without pushing the hot set out of Am. A
+ *	background thread halves the limit while the host or container is
+ *	short of memory and grows it back when the pressure is gone.
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_DEFAULT_BUDGET	(16 * 1024 * 1024)
+#define CACHE_MIN_BUDGET		(256 * 1024)	/* pressure never shrinks it below this */
+#define CACHE_PRESSURE_MS		1000			/* how often memory headroom is checked */
+
+enum cache_kind {
+	CACHE_BLOCK,		/* id: block number */
+	CACHE_INODE,		/* id: inode number */
+	CACHE_DENTRY,		/* id: directory inode number, name: entry name */
+	CACHE_KINDS
+};
+
+void cache_set_budget(size_t bytes);
+void cache_init();
+void cache_destroy();
+
+/*
+ * Entries are copied in and out under the cache lock. A dentry entry of
+ * length 0 records that the name does not exist. Every cache_lookup()
+ * miss must be answered by cache_insert() or cache_abandon().
+ */
+int cache_lookup(enum cache_kind kind, uint32_t id, const char *name, void *buf, size_t len);
+void cache_insert(enum cache_kind kind, uint32_t id, const char *name, const void *buf, size_t len);
+void cache_abandon(enum cache_kind kind, uint32_t id, const char *name);
+int cache_reserve(enum cache_kind kind, uint32_t id, const char *name);
+void cache_update(enum cache_kind kind, uint32_t id, const char *name, const void *buf, size_t len);
+void cache_invalidate(enum cache_kind kind, uint32_t id, const char *name);
+
+int cache_hot_blocks(uint32_t *ids, int max);
+int cache_render(char *buf, size_t size);
+
+#endif
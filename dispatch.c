@@ -0,0 +1,187 @@
+/*
+ *	Tiny File System
+ *	File:	dispatch.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "arena.h"
+#include "dispatch.h"
+#include "stats.h"
+
+struct dispatch_job {
+	int				(*fn)(void *);
+	void*			arg;
+	int				ret;
+	int				done;
+	uint64_t		queued;		/* stats_now() at submission */
+	pthread_cond_t	cond;
+};
+
+struct dispatch_pool {
+	pthread_mutex_t			lock;
+	pthread_cond_t			work;		/* a job was queued, or stopping */
+	pthread_cond_t			room;		/* a slot in the queue freed up */
+	struct dispatch_job*	queue[DISPATCH_QUEUE_DEPTH];
+	int						head;
+	int						count;
+	int						nthreads;
+	pthread_t*				threads;
+	int						stopping;
+	uint64_t				jobs;
+	uint64_t				wait_ns;	/* summed time jobs spent queued */
+	int						max_depth;
+};
+
+static const char* class_names[DISPATCH_CLASSES] = { "meta", "data" };
+
+static struct dispatch_pool pools[DISPATCH_CLASSES];
+static int threads[DISPATCH_CLASSES] = { DISPATCH_META_THREADS, DISPATCH_DATA_THREADS };
+static int running;
+
+void dispatch_set_threads(int meta, int data) {
+	if (meta >= 0) {
+		threads[DISPATCH_META] = meta;
+	}
+	if (data >= 0) {
+		threads[DISPATCH_DATA] = data;
+	}
+}
+
+static void *worker_main(void *arg) {
+	struct dispatch_pool* pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->count == 0 && !pool->stopping) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+		if (pool->count == 0) { // stopping and drained
+			break;
+		}
+		struct dispatch_job* job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % DISPATCH_QUEUE_DEPTH;
+		pool->count--;
+		pool->jobs++;
+		pool->wait_ns += stats_now() - job->queued;
+		pthread_cond_signal(&pool->room);
+		pthread_mutex_unlock(&pool->lock);
+
+		int ret;
+		{
+			ARENA_SCOPE;
+			ret = job->fn(job->arg);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		job->ret = ret;
+		job->done = 1;
+		pthread_cond_signal(&job->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+void dispatch_start() {
+	if (running) {
+		return;
+	}
+	for (int c = 0; c < DISPATCH_CLASSES; c++) {
+		struct dispatch_pool* pool = &pools[c];
+		pthread_mutex_init(&pool->lock, NULL);
+		pthread_cond_init(&pool->work, NULL);
+		pthread_cond_init(&pool->room, NULL);
+		pool->head = pool->count = pool->stopping = 0;
+		pool->jobs = pool->wait_ns = 0;
+		pool->max_depth = 0;
+		pool->threads = malloc(threads[c] * sizeof(pthread_t));
+		pool->nthreads = 0;
+		for (int i = 0; i < threads[c]; i++) {
+			if (pthread_create(&pool->threads[pool->nthreads], NULL, worker_main, pool) == 0) {
+				pool->nthreads++;
+			}
+		}
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+}
+
+// callers must have returned from every dispatch_run()
+void dispatch_stop() {
+	if (!running) {
+		return;
+	}
+	__atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+	for (int c = 0; c < DISPATCH_CLASSES; c++) {
+		struct dispatch_pool* pool = &pools[c];
+		pthread_mutex_lock(&pool->lock);
+		pool->stopping = 1;
+		pthread_cond_broadcast(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+		for (int i = 0; i < pool->nthreads; i++) {
+			pthread_join(pool->threads[i], NULL);
+		}
+		free(pool->threads);
+		pool->threads = NULL;
+		pool->nthreads = 0;
+	}
+}
+
+int dispatch_run(enum dispatch_class cls, int (*fn)(void *), void *arg) {
+	struct dispatch_pool* pool = &pools[cls];
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || pool->nthreads == 0) {
+		ARENA_SCOPE;
+		return fn(arg);
+	}
+
+	struct dispatch_job job = { .fn = fn, .arg = arg };
+	pthread_cond_init(&job.cond, NULL);
+
+	// Step 1: Queue the job, waiting while the queue is full
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == DISPATCH_QUEUE_DEPTH) {
+		pthread_cond_wait(&pool->room, &pool->lock);
+	}
+	job.queued = stats_now();
+	pool->queue[(pool->head + pool->count) % DISPATCH_QUEUE_DEPTH] = &job;
+	if (++pool->count > pool->max_depth) {
+		pool->max_depth = pool->count;
+	}
+	pthread_cond_signal(&pool->work);
+
+	// Step 2: Wait for a worker to finish it
+	while (!job.done) {
+		pthread_cond_wait(&job.cond, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_cond_destroy(&job.cond);
+	return job.ret;
+}
+
+/*
+ * Print per-pool counters in the Prometheus text format of stats_render()
+ */
+int dispatch_render(char *buf, size_t size) {
+	size_t n = 0;
+#define EMIT(...) do { \
+		if (n < size) { \
+			n += snprintf(buf + n, size - n, __VA_ARGS__); \
+		} \
+	} while (0)
+
+	for (int c = 0; c < DISPATCH_CLASSES && running; c++) {
+		struct dispatch_pool* pool = &pools[c];
+		pthread_mutex_lock(&pool->lock);
+		EMIT("rufs_dispatch_threads{pool=\"%s\"} %d\n", class_names[c], pool->nthreads);
+		EMIT("rufs_dispatch_queued{pool=\"%s\"} %d\n", class_names[c], pool->count);
+		EMIT("rufs_dispatch_queued_max{pool=\"%s\"} %d\n", class_names[c], pool->max_depth);
+		EMIT("rufs_dispatch_jobs{pool=\"%s\"} %llu\n", class_names[c], (unsigned long long)pool->jobs);
+		EMIT("rufs_dispatch_wait_ns{pool=\"%s\"} %llu\n", class_names[c], (unsigned long long)pool->wait_ns);
+		pthread_mutex_unlock(&pool->lock);
+	}
+#undef EMIT
+
+	return n < size ? n : size;
+}
@@ -0,0 +1,47 @@
+/*
+ *	Tiny File System
+ *	File:	dispatch.h
+ *
+ *	FUSE ops are split into two classes. Bulk data ops (read, write,
+ *	truncate, fallocate) run on a small pool that bounds how many are in
+ *	flight, so streaming clients cannot tie up the device and the locks.
+ *	Metadata ops (getattr, open, create, ...) get a pool of their own when
+ *	DISPATCH_META_THREADS is set; at 0 they run on the FUSE thread that
+ *	received them and skip the handoff. Each pool has a bounded queue;
+ *	submitters wait when it is full.
+ *
+ *	Dispatch is synchronous: the FUSE thread that received an op waits
+ *	until a worker has run it. The pools only limit how many ops of a
+ *	class run at once; they add no concurrency, so a single-threaded
+ *	mount (-s) still runs one op at a time.
+ */
+
+#ifndef _DISPATCH_H_
+#define _DISPATCH_H_
+
+#include <stddef.h>
+
+#define DISPATCH_META_THREADS	0		/* 0: on the calling thread */
+#define DISPATCH_DATA_THREADS	2
+#define DISPATCH_QUEUE_DEPTH	64		/* queued ops per pool */
+
+enum dispatch_class {
+	DISPATCH_META,
+	DISPATCH_DATA,
+	DISPATCH_CLASSES
+};
+
+void dispatch_set_threads(int meta, int data);	/* negative keeps the current count */
+void dispatch_start();
+void dispatch_stop();
+
+/*
+ * Run fn(arg) on a worker of the class, blocking until it returns, and
+ * return its result. Runs it on the calling thread when the pools are not
+ * started or the class has no workers.
+ */
+int dispatch_run(enum dispatch_class cls, int (*fn)(void *), void *arg);
+
+int dispatch_render(char *buf, size_t size);
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ *	Tiny File System
+ *	File:	extent.c
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "extent.h"
+
+#define LEAF_BITS	64
+
+static void leaf_summary(struct extent_index *ix, int node) {
+	uint64_t w = ix->free[node - ix->nleaves];
+	ix->pre[node] = (~w == 0) ? LEAF_BITS : __builtin_ctzll(~w);
+	ix->suf[node] = (~w == 0) ? LEAF_BITS : __builtin_clzll(~w);
+
+	// each step shortens every run of ones by one, so the steps taken are
+	// the longest run
+	int run = 0;
+	while (w != 0) {
+		w &= w << 1;
+		run++;
+	}
+	ix->best[node] = run;
+}
+
+static void node_summary(struct extent_index *ix, int node, int len) { // len: blocks under each child
+	int l = 2 * node, r = 2 * node + 1;
+	ix->pre[node] = (ix->pre[l] == len) ? len + ix->pre[r] : ix->pre[l];
+	ix->suf[node] = (ix->suf[r] == len) ? len + ix->suf[l] : ix->suf[r];
+	int best = ix->suf[l] + ix->pre[r];
+	if (ix->best[l] > best) {
+		best = ix->best[l];
+	}
+	if (ix->best[r] > best) {
+		best = ix->best[r];
+	}
+	ix->best[node] = best;
+}
+
+void extent_open(struct extent_index *ix, int nbits) {
+	ix->nbits = nbits;
+	ix->nleaves = 1;
+	while (ix->nleaves * LEAF_BITS < nbits) {
+		ix->nleaves *= 2;
+	}
+	ix->free = calloc(ix->nleaves, sizeof(uint64_t));
+	ix->pre = calloc(2 * ix->nleaves, sizeof(int32_t));
+	ix->suf = calloc(2 * ix->nleaves, sizeof(int32_t));
+	ix->best = calloc(2 * ix->nleaves, sizeof(int32_t));
+	ix->scanned = 0;
+}
+
+void extent_close(struct extent_index *ix) {
+	free(ix->free);
+	free(ix->pre);
+	free(ix->suf);
+	free(ix->best);
+	memset(ix, 0, sizeof(struct extent_index));
+}
+
+/*
+ * Mark [start, start+len) used or free, then recompute the nodes above the
+ * leaves that changed, one level at a time
+ */
+void extent_mark(struct extent_index *ix, int start, int len, int used) {
+	if (len <= 0) {
+		return;
+	}
+
+	// Step 1: Flip the bits in the leaf words
+	for (int i = start; i < start + len; ) {
+		int bit = i % LEAF_BITS;
+		int n = LEAF_BITS - bit < start + len - i ? LEAF_BITS - bit : start + len - i;
+		uint64_t mask = (n == LEAF_BITS) ? ~0ull : ((1ull << n) - 1) << bit;
+		if (used) {
+			ix->free[i / LEAF_BITS] &= ~mask;
+		} else {
+			ix->free[i / LEAF_BITS] |= mask;
+		}
+		i += n;
+	}
+
+	// Step 2: Refresh the summaries from the leaves to the root
+	int lo = ix->nleaves + start / LEAF_BITS;
+	int hi = ix->nleaves + (start + len - 1) / LEAF_BITS;
+	for (int node = lo; node <= hi; node++) {
+		leaf_summary(ix, node);
+	}
+	for (int child_len = LEAF_BITS; lo > 1; child_len *= 2) {
+		lo /= 2;
+		hi /= 2;
+		for (int node = lo; node <= hi; node++) {
+			node_summary(ix, node, child_len);
+		}
+	}
+}
+
+/*
+ * Walk the nodes covering [lo, hi) left to right from block from on, with
+ * *carry holding the free run that ends where the node starts. Whole nodes
+ * that cannot hold the run are stepped over using their summaries, so only
+ * the path to from and the path to the answer are descended.
+ */
+static int find_in(struct extent_index *ix, int node, int lo, int hi, int from, int want, int *carry) {
+	if (hi <= from) {
+		return -1;
+	}
+	if (lo >= from) {
+		if (*carry + ix->pre[node] >= want) {
+			return lo - *carry;
+		}
+		if (ix->best[node] < want) {
+			*carry = (ix->pre[node] == hi - lo) ? *carry + hi - lo : ix->suf[node];
+			return -1;
+		}
+	}
+
+	// a leaf the run starts in, or the one holding from: look at its bits
+	if (node >= ix->nleaves) {
+		uint64_t w = ix->free[node - ix->nleaves];
+		if (lo < from) {
+			w &= ~0ull << (from - lo);
+		}
+		ix->scanned += LEAF_BITS;
+		for (int bit = 0; bit < LEAF_BITS; bit++) {
+			if (!(w & (1ull << bit))) {
+				*carry = 0;
+			} else if (++*carry >= want) {
+				return lo + bit - want + 1;
+			}
+		}
+		return -1;
+	}
+
+	int mid = lo + (hi - lo) / 2;
+	int found = find_in(ix, 2 * node, lo, mid, from, want, carry);
+	if (found < 0) {
+		found = find_in(ix, 2 * node + 1, mid, hi, from, want, carry);
+	}
+	return found;
+}
+
+int extent_find(struct extent_index *ix, int from, int want) {
+	int carry = 0;
+	ix->scanned = 0;
+	if (want <= 0 || from < 0 || from >= ix->nbits || ix->best[1] < want) {
+		return -1;
+	}
+	return find_in(ix, 1, 0, ix->nleaves * LEAF_BITS, from, want, &carry);
+}
+
+int extent_largest(struct extent_index *ix, int *start) {
+	int len = ix->best[1];
+	*start = len > 0 ? extent_find(ix, 0, len) : -1;
+	return len;
+}
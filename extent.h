@@ -0,0 +1,40 @@
+/*
+ *	Tiny File System
+ *	File:	extent.h
+ *
+ *	Free-space index over an allocation bitmap. Leaves are 64-block words
+ *	and every node of the tree above them keeps the free run at its start,
+ *	the run at its end and the longest run anywhere beneath it, so "n
+ *	contiguous blocks at or after x" and "the largest free extent" are
+ *	answered in O(log n) without scanning the bitmap. The index lives in
+ *	memory only and is rebuilt from the bitmap; callers serialize access.
+ */
+
+#ifndef _EXTENT_H_
+#define _EXTENT_H_
+
+#include <stdint.h>
+
+struct extent_index {
+	int			nbits;
+	int			nleaves;	/* leaf words, a power of two */
+	uint64_t*	free;		/* leaf words, a set bit is a free block */
+	int32_t*	pre;		/* per node, 1-based heap order: free run at the start, */
+	int32_t*	suf;		/* at the end, */
+	int32_t*	best;		/* and the longest one */
+	int			scanned;	/* bits examined by the last extent_find() */
+};
+
+void extent_open(struct extent_index *ix, int nbits);	/* every block starts out used */
+void extent_close(struct extent_index *ix);
+void extent_mark(struct extent_index *ix, int start, int len, int used);
+
+/*
+ * First block of the lowest run of want free blocks that starts at or
+ * after from, or -1. extent_largest() returns the length of the longest
+ * free run and stores its first block in *start.
+ */
+int extent_find(struct extent_index *ix, int from, int want);
+int extent_largest(struct extent_index *ix, int *start);
+
+#endif
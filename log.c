@@ -0,0 +1,529 @@
+/*
+ *	Tiny File System
+ *	File:	log.c
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "log.h"
+
+#define LOG_MAGIC		0x4c4f4753		/* "LOGS" */
+#define SEG_DATA		(LOG_SEG_BLOCKS - 1)
+#define MAP_BLOCKS		((LOG_BLOCKS * (int)sizeof(int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define CKPT_BLOCKS		(1 + MAP_BLOCKS)
+#define SEG_START		(1 + 2 * CKPT_BLOCKS)
+#define SUM_SEED		0xcbf29ce484222325ull
+
+struct log_header {
+	uint32_t	magic;
+	uint32_t	seg_blocks;
+	uint32_t	segments;
+	uint32_t	blocks;
+} typedef log_header;
+
+struct log_checkpoint {
+	uint32_t	magic;
+	uint32_t	pad;
+	uint64_t	gen;		/* the newer of the two slots wins */
+	uint64_t	seq;		/* segments from this one on are rolled forward */
+	uint64_t	sum;		/* of the map */
+} typedef log_ckpt;
+
+struct log_summary {
+	uint32_t	magic;
+	uint32_t	nblocks;			/* blocks that follow */
+	uint64_t	seq;				/* bumped every time a segment is opened */
+	uint64_t	sum;				/* of those blocks */
+	int32_t		blkno[SEG_DATA];
+} typedef log_summary;
+
+static int log_on;
+static int32_t* map;					/* block number -> place in the log, -1 if never written */
+static int seg_live[LOG_SEGMENTS];		/* blocks in each segment the map still points at */
+static uint64_t seg_seq[LOG_SEGMENTS];
+static char* seg_buf;					/* the open segment, summary first */
+static int cur_seg = -1, last_seg;
+static int cur_n, cur_written;			/* blocks appended to it, and written out so far */
+static uint64_t cur_sum, next_seq = 1, ckpt_gen;
+static uint64_t seg_writes, cleaned, moved;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake = PTHREAD_COND_INITIALIZER;		/* wakes the cleaner */
+static pthread_cond_t log_space = PTHREAD_COND_INITIALIZER;		/* a segment was freed */
+static pthread_t clean_thread;
+static int clean_running, clean_stopping, clean_stuck;
+
+static int seg_base(int s) {
+	return SEG_START + s * LOG_SEG_BLOCKS;
+}
+
+static int seg_of(int pblk) {
+	return (pblk - SEG_START) / LOG_SEG_BLOCKS;
+}
+
+static uint64_t sum_blocks(uint64_t h, const void *data, int count) {
+	const uint64_t* w = data;
+	for (size_t i = 0; i < (size_t)count * BLOCK_SIZE / sizeof(uint64_t); i++) {
+		h = (h ^ w[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+/*
+ * segments, callers hold log_lock
+ */
+static int free_count() {
+	int n = 0;
+	for (int s = 0; s < LOG_SEGMENTS; s++) {
+		n += seg_live[s] == 0 && s != cur_seg;
+	}
+	return n;
+}
+
+// next free segment after the last one opened, keeping back the reserve
+static int seg_take(int reserve) {
+	if (free_count() <= (reserve ? 0 : LOG_RESERVE)) {
+		return -1;
+	}
+	for (int k = 1; k <= LOG_SEGMENTS; k++) {
+		int s = (last_seg + k) % LOG_SEGMENTS;
+		if (seg_live[s] == 0 && s != cur_seg) {
+			return s;
+		}
+	}
+	return -1;
+}
+
+static int seg_write() {
+	log_summary* sum = (log_summary*)seg_buf;
+	if (cur_seg < 0 || cur_n == cur_written) {
+		return 0;
+	}
+	sum->nblocks = cur_n;
+	sum->sum = cur_sum;
+
+	// the blocks go before the summary that names them
+	int base = seg_base(cur_seg), ret = 0;
+	if (cur_written == 0) {
+		ret = dev_raw_write(base, 1 + cur_n, seg_buf);
+	} else {
+		ret = dev_raw_write(base + 1 + cur_written, cur_n - cur_written, seg_buf + (size_t)(1 + cur_written) * BLOCK_SIZE);
+		if (ret >= 0) {
+			ret = dev_raw_write(base, 1, seg_buf);
+		}
+	}
+	cur_written = cur_n;
+	seg_writes++;
+	return ret < 0 ? -1 : 0;
+}
+
+static int seg_open(int reserve) {
+	while (cur_seg < 0) {
+		int s = seg_take(reserve || clean_stuck || !clean_running);
+		if (s >= 0) {
+			cur_seg = last_seg = s;
+			seg_seq[s] = next_seq++;
+			cur_n = cur_written = 0;
+			cur_sum = SUM_SEED;
+			memset(seg_buf, 0, BLOCK_SIZE);
+			log_summary* sum = (log_summary*)seg_buf;
+			sum->magic = LOG_MAGIC;
+			sum->seq = seg_seq[s];
+			if (free_count() < LOG_CLEAN_LOW) {
+				pthread_cond_signal(&log_wake);
+			}
+			return 0;
+		}
+		if (reserve || clean_stuck || !clean_running) {
+			fprintf(stderr, "rufs: log is full\n");
+			return -1;
+		}
+		pthread_cond_signal(&log_wake);
+		pthread_cond_wait(&log_space, &log_lock);
+	}
+	return 0;
+}
+
+static int append(int blkno, const void *data, int reserve) {
+	while (cur_seg < 0 || cur_n == SEG_DATA) {
+		if (cur_seg >= 0) {
+			seg_write();
+			cur_seg = -1;
+		}
+		if (seg_open(reserve) < 0) {
+			return -1;
+		}
+	}
+
+	int pblk = seg_base(cur_seg) + 1 + cur_n;
+	memcpy(seg_buf + (size_t)(1 + cur_n) * BLOCK_SIZE, data, BLOCK_SIZE);
+	cur_sum = sum_blocks(cur_sum, data, 1);
+	((log_summary*)seg_buf)->blkno[cur_n++] = blkno;
+
+	int old = map[blkno];
+	map[blkno] = pblk;
+	seg_live[cur_seg]++;
+	if (old >= 0 && --seg_live[seg_of(old)] == 0 && seg_of(old) != cur_seg) {
+		pthread_cond_broadcast(&log_space);
+	}
+	return 0;
+}
+
+static int write_checkpoint() {
+	char* buf = aligned_alloc(BLOCK_SIZE, (size_t)CKPT_BLOCKS * BLOCK_SIZE);
+	memset(buf, 0, BLOCK_SIZE);
+	memcpy(buf + BLOCK_SIZE, map, (size_t)LOG_BLOCKS * sizeof(int32_t));
+	log_ckpt* ck = (log_ckpt*)buf;
+	ck->magic = LOG_MAGIC;
+	ck->gen = ++ckpt_gen;
+	ck->seq = cur_seg >= 0 ? seg_seq[cur_seg] : next_seq;
+	ck->sum = sum_blocks(SUM_SEED, buf + BLOCK_SIZE, MAP_BLOCKS);
+	int ret = dev_raw_write(1 + (ck->gen % 2) * CKPT_BLOCKS, CKPT_BLOCKS, buf);
+	free(buf);
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Cleaner. Takes the segment with the fewest live blocks, reads it whole
+ * without the lock, then appends the blocks the map still points at. A
+ * victim reopened meanwhile has a new sequence number and is left alone.
+ */
+static int clean_one(char *buf) {
+	pthread_mutex_lock(&log_lock);
+	int victim = -1;
+	for (int s = 0; s < LOG_SEGMENTS; s++) {
+		if (s != cur_seg && seg_live[s] > 0 && seg_live[s] < SEG_DATA &&
+			(victim < 0 || seg_live[s] < seg_live[victim])) {
+			victim = s;
+		}
+	}
+	uint64_t seq = victim >= 0 ? seg_seq[victim] : 0;
+	pthread_mutex_unlock(&log_lock);
+	if (victim < 0 || dev_raw_read(seg_base(victim), LOG_SEG_BLOCKS, buf) < 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	log_summary* sum = (log_summary*)buf;
+	int n = 0;
+	for (int i = 0; seg_seq[victim] == seq && i < (int)sum->nblocks && i < SEG_DATA; i++) {
+		int blkno = sum->blkno[i];
+		if (blkno >= 0 && blkno < LOG_BLOCKS && map[blkno] == seg_base(victim) + 1 + i) {
+			if (append(blkno, buf + (size_t)(1 + i) * BLOCK_SIZE, 1) < 0) {
+				break;
+			}
+			n++;
+		}
+	}
+	moved += n;
+	cleaned++;
+	pthread_cond_broadcast(&log_space);
+	pthread_mutex_unlock(&log_lock);
+	return 1;
+}
+
+static void *clean_main(void *arg) {
+	char* buf = aligned_alloc(BLOCK_SIZE, (size_t)LOG_SEG_BLOCKS * BLOCK_SIZE);
+	pthread_mutex_lock(&log_lock);
+	while (!clean_stopping) {
+		if (free_count() >= LOG_CLEAN_LOW) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += LOG_CLEAN_MS * 1000000L;
+			ts.tv_sec += ts.tv_nsec / 1000000000L;
+			ts.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&log_wake, &log_lock, &ts);
+			continue;
+		}
+		while (!clean_stopping && free_count() < LOG_CLEAN_HIGH) {
+			pthread_mutex_unlock(&log_lock);
+			int progress = clean_one(buf);
+			pthread_mutex_lock(&log_lock);
+			if (!progress) { // nothing left to compact; let writers have the reserve
+				clean_stuck = 1;
+				pthread_cond_broadcast(&log_space);
+				break;
+			}
+			clean_stuck = 0;
+		}
+		if (!clean_stopping && free_count() < LOG_CLEAN_LOW) {
+			pthread_cond_wait(&log_wake, &log_lock);
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+	free(buf);
+	return NULL;
+}
+
+int log_disk_blocks() {
+	return SEG_START + LOG_SEGMENTS * LOG_SEG_BLOCKS;
+}
+
+int log_probe() {
+	log_header* h = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+	int ok = dev_raw_read(0, 1, h) >= 0 && h->magic == LOG_MAGIC;
+	free(h);
+	return ok;
+}
+
+/*
+ * Lay out an empty log on a fresh backing file
+ */
+void log_format() {
+	log_header* h = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
+	memset(h, 0, BLOCK_SIZE);
+	h->magic = LOG_MAGIC;
+	h->seg_blocks = LOG_SEG_BLOCKS;
+	h->segments = LOG_SEGMENTS;
+	h->blocks = LOG_BLOCKS;
+	dev_raw_write(0, 1, h);
+	free(h);
+
+	map = malloc((size_t)LOG_BLOCKS * sizeof(int32_t));
+	memset(map, 0xff, (size_t)LOG_BLOCKS * sizeof(int32_t));
+	ckpt_gen = 0;
+	cur_seg = -1;
+	next_seq = 1;
+	write_checkpoint();
+	free(map);
+	map = NULL;
+}
+
+static int cmp_seq(const void *a, const void *b) {
+	uint64_t x = seg_seq[*(const int*)a], y = seg_seq[*(const int*)b];
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Load the newest checkpoint, roll forward through the segments written
+ * since, then start a segment of our own and record where we are
+ */
+int log_open() {
+	// Step 1: The header must describe the layout this build uses
+	char* buf = aligned_alloc(BLOCK_SIZE, (size_t)LOG_SEG_BLOCKS * BLOCK_SIZE);
+	log_header* h = (log_header*)buf;
+	if (dev_raw_read(0, 1, buf) < 0 || h->magic != LOG_MAGIC || h->seg_blocks != LOG_SEG_BLOCKS ||
+		h->segments != LOG_SEGMENTS || h->blocks != LOG_BLOCKS) {
+		fprintf(stderr, "rufs: unsupported log layout\n");
+		free(buf);
+		return -1;
+	}
+
+	// Step 2: Take the newer of the two checkpoints that is intact
+	map = malloc((size_t)LOG_BLOCKS * sizeof(int32_t));
+	log_ckpt ck = {0};
+	for (int slot = 0; slot < 2; slot++) {
+		log_ckpt* c = (log_ckpt*)buf;
+		if (dev_raw_read(1 + slot * CKPT_BLOCKS, CKPT_BLOCKS, buf) < 0 || c->magic != LOG_MAGIC ||
+			c->sum != sum_blocks(SUM_SEED, buf + BLOCK_SIZE, MAP_BLOCKS) || c->gen <= ck.gen) {
+			continue;
+		}
+		ck = *c;
+		memcpy(map, buf + BLOCK_SIZE, (size_t)LOG_BLOCKS * sizeof(int32_t));
+	}
+	if (ck.magic != LOG_MAGIC) {
+		fprintf(stderr, "rufs: no valid log checkpoint\n");
+		free(map);
+		free(buf);
+		map = NULL;
+		return -1;
+	}
+	ckpt_gen = ck.gen;
+
+	// Step 3: Roll forward, oldest first, through intact segments opened
+	// since the checkpoint; a torn last segment fails its checksum
+	int replay[LOG_SEGMENTS], nreplay = 0;
+	uint64_t max_seq = ck.seq;
+	last_seg = LOG_SEGMENTS - 1;
+	for (int s = 0; s < LOG_SEGMENTS; s++) {
+		log_summary* sum = (log_summary*)buf;
+		seg_seq[s] = 0;
+		seg_live[s] = 0;
+		if (dev_raw_read(seg_base(s), 1, buf) < 0 || sum->magic != LOG_MAGIC || sum->nblocks > SEG_DATA) {
+			continue;
+		}
+		seg_seq[s] = sum->seq;
+		if (sum->seq > max_seq) {
+			max_seq = sum->seq;
+			last_seg = s;
+		}
+		if (sum->seq >= ck.seq) {
+			replay[nreplay++] = s;
+		}
+	}
+	qsort(replay, nreplay, sizeof(int), cmp_seq);
+	for (int r = 0; r < nreplay; r++) {
+		int s = replay[r];
+		log_summary* sum = (log_summary*)buf;
+		if (dev_raw_read(seg_base(s), LOG_SEG_BLOCKS, buf) < 0 ||
+			sum->sum != sum_blocks(SUM_SEED, buf + BLOCK_SIZE, sum->nblocks)) {
+			continue;
+		}
+		for (int i = 0; i < (int)sum->nblocks; i++) {
+			if (sum->blkno[i] >= 0 && sum->blkno[i] < LOG_BLOCKS) {
+				map[sum->blkno[i]] = seg_base(s) + 1 + i;
+			}
+		}
+	}
+	free(buf);
+
+	// Step 4: Count what the map points at in each segment
+	for (int b = 0; b < LOG_BLOCKS; b++) {
+		if (map[b] >= SEG_START && seg_of(map[b]) < LOG_SEGMENTS) {
+			seg_live[seg_of(map[b])]++;
+		} else {
+			map[b] = -1;
+		}
+	}
+
+	// Step 5: Open a segment past everything on disk and checkpoint, so the
+	// next mount has nothing to roll forward
+	seg_buf = aligned_alloc(BLOCK_SIZE, (size_t)LOG_SEG_BLOCKS * BLOCK_SIZE);
+	pthread_mutex_lock(&log_lock);
+	next_seq = max_seq + 1;
+	cur_seg = -1;
+	seg_writes = cleaned = moved = 0;
+	clean_stuck = 0;
+	int ret = seg_open(1);
+	if (ret == 0) {
+		ret = write_checkpoint();
+	}
+	pthread_mutex_unlock(&log_lock);
+	if (ret < 0) {
+		free(seg_buf);
+		free(map);
+		seg_buf = NULL;
+		map = NULL;
+		return -1;
+	}
+
+	clean_stopping = 0;
+	clean_running = pthread_create(&clean_thread, NULL, clean_main, NULL) == 0;
+	log_on = 1;
+	return 0;
+}
+
+void log_close() {
+	if (!log_on) {
+		return;
+	}
+	if (clean_running) {
+		pthread_mutex_lock(&log_lock);
+		clean_stopping = 1;
+		pthread_cond_signal(&log_wake);
+		pthread_mutex_unlock(&log_lock);
+		pthread_join(clean_thread, NULL);
+		clean_running = 0;
+	}
+	log_checkpoint();
+	log_on = 0;
+	free(seg_buf);
+	free(map);
+	seg_buf = NULL;
+	map = NULL;
+	cur_seg = -1;
+}
+
+int log_read(int block_num, int count, void *buf) {
+	char* out = buf;
+	int ret = count * BLOCK_SIZE;
+	pthread_mutex_lock(&log_lock);
+	for (int i = 0; i < count; ) {
+		int blkno = block_num + i;
+		if (blkno < 0 || blkno >= LOG_BLOCKS) {
+			ret = -1;
+			break;
+		}
+		int pblk = map[blkno];
+		if (pblk < 0) { // never written
+			memset(out + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+		if (seg_of(pblk) == cur_seg) {
+			memcpy(out + (size_t)i * BLOCK_SIZE, seg_buf + (size_t)(pblk - seg_base(cur_seg)) * BLOCK_SIZE, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		// blocks written together sit together; read them in one go
+		int run = 1;
+		while (i + run < count && block_num + i + run < LOG_BLOCKS && map[block_num + i + run] == pblk + run &&
+			seg_of(pblk + run) == seg_of(pblk)) {
+			run++;
+		}
+		if (dev_raw_read(pblk, run, out + (size_t)i * BLOCK_SIZE) < 0) {
+			ret = -1;
+			break;
+		}
+		i += run;
+	}
+	pthread_mutex_unlock(&log_lock);
+	return ret;
+}
+
+int log_write(int block_num, int count, const void *buf) {
+	int ret = count * BLOCK_SIZE;
+	pthread_mutex_lock(&log_lock);
+	for (int i = 0; i < count; i++) {
+		if (block_num + i < 0 || block_num + i >= LOG_BLOCKS ||
+			append(block_num + i, (const char*)buf + (size_t)i * BLOCK_SIZE, 0) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&log_lock);
+	return ret;
+}
+
+void log_flush() {
+	pthread_mutex_lock(&log_lock);
+	seg_write();
+	pthread_mutex_unlock(&log_lock);
+}
+
+void log_checkpoint() {
+	pthread_mutex_lock(&log_lock);
+	seg_write();
+	write_checkpoint();
+	pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Print log counters in the Prometheus text format of stats_render()
+ */
+int log_render(char *buf, size_t size) {
+	size_t n = 0;
+	if (!log_on) {
+		return 0;
+	}
+#define EMIT(...) do { \
+		if (n < size) { \
+			n += snprintf(buf + n, size - n, __VA_ARGS__); \
+		} \
+	} while (0)
+
+	pthread_mutex_lock(&log_lock);
+	int live = 0;
+	for (int s = 0; s < LOG_SEGMENTS; s++) {
+		live += seg_live[s];
+	}
+	EMIT("rufs_log_segments_free %d\n", free_count());
+	EMIT("rufs_log_live_blocks %d\n", live);
+	EMIT("rufs_log_segment_writes %llu\n", (unsigned long long)seg_writes);
+	EMIT("rufs_log_cleaned_segments %llu\n", (unsigned long long)cleaned);
+	EMIT("rufs_log_cleaner_moved_blocks %llu\n", (unsigned long long)moved);
+	pthread_mutex_unlock(&log_lock);
+#undef EMIT
+
+	return n < size ? n : size;
+}
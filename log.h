@@ -0,0 +1,45 @@
+/*
+ *	Tiny File System
+ *	File:	log.h
+ *
+ *	Log-structured mode. The backing file no longer holds block n at
+ *	offset n: every block written, data, inode table and bitmaps alike,
+ *	is appended to the open segment, and a map from block number to its
+ *	latest place in the log plays the part of an inode map. Full segments
+ *	go out with one sequential write. A checkpoint saves the map; a mount
+ *	loads the newest one and rolls forward through the segments written
+ *	after it. A background cleaner copies the live blocks out of the
+ *	emptiest segments so writers always find a free one ahead of them.
+ *
+ *	On disk: a header block, two checkpoint slots (a header block and the
+ *	map each), then LOG_SEGMENTS segments of a summary block naming the
+ *	blocks that follow and LOG_SEG_BLOCKS - 1 of those blocks.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <stddef.h>
+
+#define LOG_SEG_BLOCKS		256		/* summary block included */
+#define LOG_SEGMENTS		96		/* room for every block half again over */
+#define LOG_BLOCKS			16384	/* block numbers the map covers, MAX_DNUM in rufs.h */
+#define LOG_CLEAN_LOW		16		/* free segments that wake the cleaner */
+#define LOG_CLEAN_HIGH		24		/* and that it stops at */
+#define LOG_RESERVE			4		/* free segments only the cleaner may take */
+#define LOG_CLEAN_MS		500		/* how often the cleaner looks anyway */
+
+int log_disk_blocks();
+int log_probe();		/* the open backing file holds a log */
+void log_format();
+int log_open();
+void log_close();
+
+int log_read(int block_num, int count, void *buf);
+int log_write(int block_num, int count, const void *buf);
+void log_flush();		/* write the open segment as far as it goes */
+void log_checkpoint();	/* and save the map */
+
+int log_render(char *buf, size_t size);
+
+#endif
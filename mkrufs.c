@@ -0,0 +1,519 @@
+/*
+ *	Tiny File System
+ *	File:	mkrufs.c
+ *
+ *	Builds a DISKFILE straight from a host directory tree, without a
+ *	FUSE mount:
+ *
+ *	./mkrufs [-f] [-l] [-r] [-v] [-s BLOCKS] SRCDIR [DISKFILE[,DISKFILE...]]
+ *
+ *	The image is formatted with rufs_mkfs(). Inode numbers are then
+ *	handed out breadth first with each directory's entries sorted by
+ *	name, so siblings share inode table blocks. All directory blocks
+ *	follow the inode table as one run, then the fragment blocks holding
+ *	the packed tails of small files, and file data follows in the same
+ *	order. Each file is contiguous with its indirect blocks just ahead of
+ *	its data. Everything is written with large sequential writes, so the
+ *	build runs at disk bandwidth. Only regular files and directories are
+ *	copied; anything else is skipped with a warning.
+ *
+ *	With -r the image is finalized for read-only serving: a perfect hash
+ *	table per directory is placed after the file data (see rufs.h) and the
+ *	image can then only be mounted read-only.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+
+/* rufs.h has its own struct dirent; keep the host's for readdir() */
+#define dirent rufs_dirent
+#include "rufs.h"
+#undef dirent
+
+#define MKRUFS_CHUNK_BLOCKS		256		/* file data is copied 1 MiB at a time */
+#define MAX_NAME				(sizeof(((direntry*)0)->name) - 1)
+
+struct node {
+	char*			name;
+	char*			path;		/* on the host */
+	struct stat		st;
+	uint16_t		ino;
+	int				nchildren;
+	struct node**	children;	/* sorted by name */
+	int				subdirs;
+	int				nblocks;	/* data or directory blocks, packed tail excluded */
+	int				nind;		/* indirect blocks */
+	int				first_blk;	/* indirect blocks, then data */
+	int				nfrags;		/* fragments of a packed tail, or 0 */
+	int				frag;		/* first fragment, counted from the first fragment block */
+};
+
+static const char* progname = "mkrufs";
+static int verbose;
+
+static void die(const char *fmt, const char *arg) {
+	fprintf(stderr, "%s: ", progname);
+	fprintf(stderr, fmt, arg);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static int by_name(const void *a, const void *b) {
+	return strcmp((*(struct node**)a)->name, (*(struct node**)b)->name);
+}
+
+/*
+ * Read one host directory into n->children, sorted by name
+ */
+static void scan_dir(struct node *n) {
+	DIR* dir = opendir(n->path);
+	if (dir == NULL) {
+		die("cannot open %s", n->path);
+	}
+	int cap = 0;
+	struct dirent* de;
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		struct node* c = calloc(1, sizeof(struct node));
+		c->name = strdup(de->d_name);
+		c->path = malloc(strlen(n->path) + strlen(de->d_name) + 2);
+		sprintf(c->path, "%s/%s", n->path, de->d_name);
+		if (lstat(c->path, &c->st) < 0) {
+			die("cannot stat %s", c->path);
+		}
+		if (!S_ISREG(c->st.st_mode) && !S_ISDIR(c->st.st_mode)) {
+			fprintf(stderr, "%s: skipping %s: not a regular file or directory\n", progname, c->path);
+			free(c->name);
+			free(c->path);
+			free(c);
+			continue;
+		}
+		if (strlen(c->name) > MAX_NAME) {
+			die("name too long: %s", c->path);
+		}
+		if (n->nchildren == cap) {
+			cap = cap ? cap * 2 : 16;
+			n->children = realloc(n->children, cap * sizeof(struct node*));
+		}
+		n->children[n->nchildren++] = c;
+		n->subdirs += S_ISDIR(c->st.st_mode);
+	}
+	closedir(dir);
+	if (n->nchildren > (int)(DIRECT_PTRS * MAX_DIRENTS)) {
+		die("too many entries in %s", n->path);
+	}
+	qsort(n->children, n->nchildren, sizeof(struct node*), by_name);
+}
+
+/*
+ * Copy one file's data into its run of blocks with large writes, and a
+ * packed tail into its place in the fragment blocks
+ */
+static void copy_file(struct node *n, char *buf, char *frags) {
+	int fd = open(n->path, O_RDONLY);
+	if (fd < 0) {
+		die("cannot open %s", n->path);
+	}
+	int blk = n->first_blk + n->nind;
+	for (int done = 0; done < n->nblocks; ) {
+		int count = n->nblocks - done < MKRUFS_CHUNK_BLOCKS ? n->nblocks - done : MKRUFS_CHUNK_BLOCKS;
+		size_t want = (size_t)count * BLOCK_SIZE, got = 0;
+		while (got < want) {
+			ssize_t r = read(fd, buf + got, want - got);
+			if (r < 0) {
+				die("cannot read %s", n->path);
+			}
+			if (r == 0) { // the file shrank under us; the tail reads as zeroes
+				break;
+			}
+			got += r;
+		}
+		memset(buf + got, 0, want - got);
+		if (bio_write_blocks(blk + done, count, buf) < 0) {
+			exit(1);
+		}
+		done += count;
+	}
+	if (n->nfrags > 0) {
+		char* tail = frags + (size_t)n->frag * FRAG_SIZE;
+		size_t want = n->st.st_size - (off_t)n->nblocks * BLOCK_SIZE, got = 0;
+		ssize_t r = 0;
+		while (got < want && (r = read(fd, tail + got, want - got)) > 0) {
+			got += r;
+		}
+		if (r < 0) {
+			die("cannot read %s", n->path);
+		}
+	}
+	close(fd);
+}
+
+static void fill_inode(index_node *in, struct node *n, time_t now) {
+	memset(in, 0, sizeof(index_node));
+	in->ino = n->ino;
+	in->valid = VALID;
+	in->version = INODE_VERSION;
+	in->mode = n->st.st_mode;
+	in->uid = n->st.st_uid;
+	in->gid = n->st.st_gid;
+	in->mtime = n->st.st_mtime;
+	in->ctime = now;
+	in->blocks = n->nblocks;
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		in->direct_ptr[i] = -1;
+	}
+	for (int i = 0; i < INDIRECT_PTRS; i++) {
+		in->indirect_ptr[i] = -1;
+	}
+	if (S_ISDIR(n->st.st_mode)) {
+		in->link = 2 + n->subdirs;
+		in->size = n->nblocks * BLOCK_SIZE;
+	} else {
+		in->link = 1;
+		in->size = n->st.st_size;
+	}
+}
+
+/*
+ * Build a directory's perfect hash table at t, hash and displace style:
+ * names are spread over buckets of about RO_BUCKET_KEYS, and the biggest
+ * buckets are placed first, each with the lowest displacement that sends
+ * all its names to free slots. Returns the words used.
+ */
+static int build_table(struct node *n, uint16_t *t) {
+	int nkeys = n->nchildren, nbuckets = (nkeys + RO_BUCKET_KEYS - 1) / RO_BUCKET_KEYS;
+	uint16_t* disp = t + 2;
+	uint16_t* slot = disp + nbuckets;
+	t[0] = nkeys;
+	t[1] = nbuckets;
+
+	// Step 1: Bucket the names, then order the buckets biggest first
+	int* bucket = malloc(nkeys * sizeof(int));
+	int* order = malloc(nbuckets * sizeof(int));
+	int* size = calloc(nbuckets, sizeof(int));
+	for (int k = 0; k < nkeys; k++) {
+		bucket[k] = dir_hash(n->children[k]->name, 0) % nbuckets;
+		size[bucket[k]]++;
+	}
+	for (int b = 0; b < nbuckets; b++) {
+		int i = b;
+		for (; i > 0 && size[order[i - 1]] < size[b]; i--) {
+			order[i] = order[i - 1];
+		}
+		order[i] = b;
+	}
+
+	// Step 2: Find each bucket a displacement that fits it in
+	uint8_t* taken = calloc(nkeys, 1);
+	int* want = malloc(nkeys * sizeof(int));
+	for (int i = 0; i < nbuckets && size[order[i]] > 0; i++) {
+		int b = order[i], d = 0;
+		for (; d <= RO_DISP_MAX; d++) {
+			int m = 0, ok = 1;
+			for (int k = 0; k < nkeys && ok; k++) {
+				if (bucket[k] != b) {
+					continue;
+				}
+				int s = dir_hash(n->children[k]->name, d + 1) % nkeys;
+				ok = !taken[s];
+				for (int j = 0; j < m && ok; j++) {
+					ok = want[j] != s;
+				}
+				want[m++] = s;
+			}
+			if (ok) {
+				break;
+			}
+		}
+		if (d > RO_DISP_MAX) {
+			die("no perfect hash for %s", n->path);
+		}
+		disp[b] = d;
+		for (int k = 0, m = 0; k < nkeys; k++) {
+			if (bucket[k] == b) {
+				taken[want[m]] = 1;
+				slot[want[m++]] = k;
+			}
+		}
+	}
+	free(want);
+	free(taken);
+	free(size);
+	free(order);
+	free(bucket);
+	return 2 + nbuckets + nkeys;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: %s [-f] [-l] [-r] [-v] [-s BLOCKS] SRCDIR [DISKFILE[,DISKFILE...]]\n"
+		"  -f    overwrite an existing DISKFILE\n"
+		"  -l    make a log-structured image\n"
+		"  -r    finalize the image for read-only serving\n"
+		"  -v    list files as they are copied\n"
+		"  -s    stripe unit in blocks when several DISKFILEs are given\n", progname);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int force = 0, finalize = 0, log_image = 0, opt;
+	while ((opt = getopt(argc, argv, "flrvs:")) != -1) {
+		switch (opt) {
+		case 'f': force = 1; break;
+		case 'l': log_image = 1; dev_set_log(1); break;
+		case 'r': finalize = 1; break;
+		case 'v': verbose = 1; break;
+		case 's': dev_set_stripe(atoi(optarg)); break;
+		default: usage();
+		}
+	}
+	if (optind >= argc) {
+		usage();
+	}
+	if (finalize && log_image) { // a read-only image gains nothing from the log, and its map takes a lock
+		die("%s", "-r and -l cannot be combined");
+	}
+	const char* src = argv[optind];
+	const char* image = optind + 1 < argc ? argv[optind + 1] : "DISKFILE";
+	time_t now = time(NULL);
+
+	// Step 1: Walk the host tree breadth first; the queue order is the
+	// inode number order
+	struct node root = { .name = "", .path = (char*)src };
+	if (stat(src, &root.st) < 0 || !S_ISDIR(root.st.st_mode)) {
+		die("%s is not a directory", src);
+	}
+	struct node** queue = malloc(MAX_INUM * sizeof(struct node*));
+	int nnodes = 0;
+	queue[nnodes++] = &root;
+	for (int i = 0; i < nnodes; i++) {
+		struct node* n = queue[i];
+		n->ino = i;
+		if (!S_ISDIR(n->st.st_mode)) {
+			continue;
+		}
+		scan_dir(n);
+		if (nnodes + n->nchildren > MAX_INUM) {
+			die("%s holds more files and directories than an image has inodes", src);
+		}
+		for (int k = 0; k < n->nchildren; k++) {
+			queue[nnodes++] = n->children[k];
+		}
+	}
+
+	// Step 2: Format, which fixes the layout
+	strncpy(diskfile_path, image, PATH_MAX - 1);
+	char* paths = strdup(image);
+	for (char* path = strtok(paths, ","); path != NULL; path = strtok(NULL, ",")) {
+		if (access(path, F_OK) == 0) {
+			if (!force) {
+				die("%s exists; use -f to overwrite it", path);
+			}
+			unlink(path);
+		}
+	}
+	free(paths);
+	rufs_mkfs();
+	superblock = malloc(BLOCK_SIZE);
+	bio_read(0, superblock);
+
+	// Step 3: Place directory blocks as one run, then each file's indirect
+	// blocks and data in the same order
+	int next = superblock->d_start_blk;
+	int dir_start = next;
+	for (int i = 0; i < nnodes; i++) {
+		struct node* n = queue[i];
+		if (S_ISDIR(n->st.st_mode)) {
+			n->nblocks = n->nchildren ? (n->nchildren + MAX_DIRENTS - 1) / MAX_DIRENTS : 1;
+			n->first_blk = next;
+			next += n->nblocks;
+		}
+	}
+	int dir_blocks = next - dir_start;
+
+	// a partial last block that fits in the direct pointers and needs less
+	// than a block of fragments is packed; runs never straddle a block
+	int nfrags = 0, frag_map = 0, frag_start = 0, frag_blocks = 0;
+	for (int i = 0; i < nnodes; i++) {
+		struct node* n = queue[i];
+		off_t tail = n->st.st_size % BLOCK_SIZE;
+		if (S_ISREG(n->st.st_mode) && tail != 0 && n->st.st_size <= DIRECT_PTRS * BLOCK_SIZE &&
+			(tail + FRAG_SIZE - 1) / FRAG_SIZE < FRAGS_PER_BLOCK) {
+			n->nfrags = (tail + FRAG_SIZE - 1) / FRAG_SIZE;
+			if (nfrags % FRAGS_PER_BLOCK + n->nfrags > FRAGS_PER_BLOCK) {
+				nfrags += FRAGS_PER_BLOCK - nfrags % FRAGS_PER_BLOCK;
+			}
+			n->frag = nfrags;
+			nfrags += n->nfrags;
+		}
+	}
+	if (nfrags > 0) {
+		frag_map = next;
+		frag_start = frag_map + FRAG_MAP_BLOCKS;
+		frag_blocks = (nfrags + FRAGS_PER_BLOCK - 1) / FRAGS_PER_BLOCK;
+		next = frag_start + frag_blocks;
+	}
+
+	for (int i = 0; i < nnodes; i++) {
+		struct node* n = queue[i];
+		if (S_ISREG(n->st.st_mode)) {
+			n->nblocks = n->nfrags ? n->st.st_size / BLOCK_SIZE : (n->st.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+			if (n->nblocks > (int)MAX_FILE_BLOCKS) {
+				die("%s is too large", n->path);
+			}
+			n->nind = n->nblocks > DIRECT_PTRS ? (n->nblocks - DIRECT_PTRS + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK : 0;
+			n->first_blk = next;
+			next += n->nind + n->nblocks;
+		}
+	}
+
+	// the hash tables of a finalized image go last
+	uint16_t* index = NULL;
+	int index_start = 0, index_blocks = 0;
+	if (finalize) {
+		size_t words = MAX_INUM * sizeof(uint32_t) / sizeof(uint16_t);
+		for (int i = 0; i < nnodes; i++) {
+			if (queue[i]->nchildren > 0) {
+				words += 2 + (queue[i]->nchildren + RO_BUCKET_KEYS - 1) / RO_BUCKET_KEYS + queue[i]->nchildren;
+			}
+		}
+		index_blocks = (words * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		index = calloc(index_blocks, BLOCK_SIZE);
+		uint32_t* table_at = (uint32_t*)index;
+		words = MAX_INUM * sizeof(uint32_t) / sizeof(uint16_t);
+		for (int i = 0; i < nnodes; i++) {
+			if (queue[i]->nchildren > 0) {
+				table_at[queue[i]->ino] = words;
+				words += build_table(queue[i], index + words);
+			}
+		}
+		index_start = next;
+		next += index_blocks;
+	}
+	if (next > superblock->max_dnum) {
+		fprintf(stderr, "%s: %s needs %d blocks, the image has %d\n", progname, src, next, superblock->max_dnum);
+		return 1;
+	}
+
+	// Step 4: Inode table, directory blocks and indirect blocks are built in
+	// memory and written in one go each
+	int itable_blocks = (nnodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	index_node* itable = calloc(itable_blocks, BLOCK_SIZE);
+	direntry* dirs = calloc(dir_blocks, BLOCK_SIZE);
+	int32_t* ptrs = malloc(BLOCK_SIZE);
+	char* buf = malloc((size_t)MKRUFS_CHUNK_BLOCKS * BLOCK_SIZE);
+	char* frags = calloc(frag_blocks ? frag_blocks : 1, BLOCK_SIZE);
+	bitmap_t frag_bitmap = calloc(FRAG_MAP_BLOCKS, BLOCK_SIZE);
+	long long bytes = 0;
+
+	for (int i = 0; i < nnodes; i++) {
+		struct node* n = queue[i];
+		index_node* in = &itable[n->ino];
+		fill_inode(in, n, now);
+
+		if (S_ISDIR(n->st.st_mode)) {
+			direntry* d = dirs + (size_t)(n->first_blk - dir_start) * MAX_DIRENTS;
+			for (int k = 0; k < n->nchildren; k++) {
+				struct node* c = n->children[k];
+				d[k].ino = c->ino;
+				d[k].valid = VALID;
+				strcpy(d[k].name, c->name);
+				d[k].len = strlen(c->name);
+			}
+			for (int b = 0; b < n->nblocks; b++) {
+				in->direct_ptr[b] = n->first_blk + b;
+			}
+			continue;
+		}
+
+		// Step 5: Map and copy a regular file
+		int data = n->first_blk + n->nind;
+		for (int b = 0; b < n->nblocks && b < DIRECT_PTRS; b++) {
+			in->direct_ptr[b] = data + b;
+		}
+		if (n->nfrags > 0) {
+			int blkno = frag_start + n->frag / FRAGS_PER_BLOCK;
+			in->direct_ptr[n->nblocks] = make_frag_ptr(blkno, n->frag % FRAGS_PER_BLOCK);
+			for (int k = 0; k < n->nfrags; k++) {
+				set_bitmap(frag_bitmap, blkno * FRAGS_PER_BLOCK + n->frag % FRAGS_PER_BLOCK + k);
+			}
+		}
+		for (int k = 0; k < n->nind; k++) {
+			memset(ptrs, 0xff, BLOCK_SIZE);
+			for (int e = 0; e < PTRS_PER_BLOCK; e++) {
+				int b = DIRECT_PTRS + k * PTRS_PER_BLOCK + e;
+				if (b < n->nblocks) {
+					ptrs[e] = data + b;
+				}
+			}
+			in->indirect_ptr[k] = n->first_blk + k;
+			bio_write(n->first_blk + k, ptrs);
+		}
+		copy_file(n, buf, frags);
+		bytes += n->st.st_size;
+		if (verbose) {
+			printf("%5d %10lld %s\n", n->ino, (long long)n->st.st_size, n->path);
+		}
+	}
+	bio_write_blocks(dir_start, dir_blocks, dirs);
+	bio_write_blocks(superblock->i_start_blk, itable_blocks, itable);
+	if (nfrags > 0) {
+		bio_write_blocks(frag_map, FRAG_MAP_BLOCKS, frag_bitmap);
+		bio_write_blocks(frag_start, frag_blocks, frags);
+	}
+	if (finalize) {
+		bio_write_blocks(index_start, index_blocks, index);
+	}
+
+	// Step 6: Bitmaps and superblock; everything up to next is in use
+	bitmap_t inode_bitmap = calloc(1, BLOCK_SIZE);
+	bitmap_t data_bitmap = calloc(1, BLOCK_SIZE);
+	for (int i = 0; i < nnodes; i++) {
+		set_bitmap(inode_bitmap, i);
+	}
+	for (int i = 0; i < next; i++) {
+		set_bitmap(data_bitmap, i);
+	}
+	bio_write(superblock->i_bitmap_blk, inode_bitmap);
+	bio_write(superblock->d_bitmap_blk, data_bitmap);
+
+	superblock->itable_init = itable_blocks;
+	superblock->frag_map_blk = frag_map;
+	superblock->free_inodes = superblock->max_inum - nnodes;
+	superblock->free_blocks = superblock->max_dnum - next;
+	superblock->state = SB_CLEAN;
+	if (finalize) {
+		superblock->flags |= SB_READONLY;
+		superblock->ro_index_blk = index_start;
+		superblock->ro_index_blocks = index_blocks;
+		superblock->ro_dir_blk = dir_start;
+		superblock->ro_dir_blocks = dir_blocks;
+	}
+	bio_write(0, superblock);
+	dev_close();
+
+	printf("%s: %d inodes, %d blocks, %lld bytes of file data from %s\n", image, nnodes, next, bytes, src);
+
+	free(inode_bitmap);
+	free(data_bitmap);
+	free(frag_bitmap);
+	free(index);
+	free(frags);
+	free(buf);
+	free(ptrs);
+	free(dirs);
+	free(itable);
+	free(queue);
+	free(superblock);
+	return 0;
+}
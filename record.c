@@ -0,0 +1,152 @@
+/*
+ *	Tiny File System
+ *	File:	record.c
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+static char record_path[PATH_MAX];
+static int record_fd = -1;
+static uint64_t origin;				/* stats_now() when the recording began */
+
+// one buffer for every thread; a full one is written out under the lock
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static char* buf;
+static size_t used;
+static uint16_t nthreads;
+static __thread uint16_t thread_no;	/* 0 until the thread's first op */
+
+void record_set_file(const char *path) {
+	if (path == NULL) {
+		path = "";
+	}
+	strncpy(record_path, path, PATH_MAX - 1);
+}
+
+int record_enabled() {
+	return __atomic_load_n(&record_fd, __ATOMIC_ACQUIRE) >= 0;
+}
+
+static int write_all(int fd, const char *p, size_t n) {
+	while (n > 0) {
+		ssize_t w = write(fd, p, n);
+		if (w < 0 && errno == EINTR) {
+			continue;
+		}
+		if (w <= 0) {
+			return -1;
+		}
+		p += w;
+		n -= w;
+	}
+	return 0;
+}
+
+// with record_lock held; a failed write ends the recording rather than the op
+static void flush_locked() {
+	if (used > 0 && write_all(record_fd, buf, used) < 0) {
+		fprintf(stderr, "rufs: writing %s failed, recording stopped\n", record_path);
+		close(record_fd);
+		__atomic_store_n(&record_fd, -1, __ATOMIC_RELEASE);
+	}
+	used = 0;
+}
+
+void record_start() {
+	if (record_path[0] == '\0' || record_enabled()) {
+		return;
+	}
+
+	// Step 1: A new recording replaces an old one at the same path
+	int fd = open(record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "rufs: cannot open %s, not recording\n", record_path);
+		return;
+	}
+
+	// Step 2: The header says when, so a trace can be matched to its logs
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	record_header hdr = {
+		.magic = RECORD_MAGIC,
+		.version = RECORD_VERSION,
+		.start_unix_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec,
+	};
+	if (write_all(fd, (const char*)&hdr, sizeof(hdr)) < 0) {
+		fprintf(stderr, "rufs: writing %s failed, not recording\n", record_path);
+		close(fd);
+		return;
+	}
+
+	buf = malloc(RECORD_BUF_BYTES);
+	used = 0;
+	nthreads = 0;
+	origin = stats_now();
+	__atomic_store_n(&record_fd, fd, __ATOMIC_RELEASE);
+}
+
+void record_stop() {
+	pthread_mutex_lock(&record_lock);
+	if (record_enabled()) {
+		flush_locked();
+	}
+	if (record_enabled()) {
+		close(record_fd);
+		__atomic_store_n(&record_fd, -1, __ATOMIC_RELEASE);
+	}
+	free(buf);
+	buf = NULL;
+	pthread_mutex_unlock(&record_lock);
+}
+
+void record_add(enum stats_op op, const char *path, uint64_t start_ns, int ret,
+	uint64_t offset, uint64_t len, uint32_t mode, uint32_t flags) {
+	uint64_t end = stats_now();
+	size_t pathlen = path ? strnlen(path, PATH_MAX) : 0;
+
+	record_op r = {
+		.start_ns = start_ns > origin ? start_ns - origin : 0,
+		.offset = offset,
+		.len = len,
+		.dur_ns = end - start_ns > UINT32_MAX ? UINT32_MAX : (uint32_t)(end - start_ns),
+		.ret = ret,
+		.mode = mode,
+		.flags = flags,
+		.op = op,
+		.pathlen = pathlen,
+	};
+
+	pthread_mutex_lock(&record_lock);
+	if (!record_enabled()) {	// stopped while this op ran
+		pthread_mutex_unlock(&record_lock);
+		return;
+	}
+	if (thread_no == 0) {
+		thread_no = ++nthreads;
+	}
+	r.thread = thread_no;
+	if (used + sizeof(r) + pathlen > RECORD_BUF_BYTES) {
+		flush_locked();
+		if (!record_enabled()) {
+			pthread_mutex_unlock(&record_lock);
+			return;
+		}
+	}
+	memcpy(buf + used, &r, sizeof(r));
+	if (pathlen > 0) {
+		memcpy(buf + used + sizeof(r), path, pathlen);
+	}
+	used += sizeof(r) + pathlen;
+	pthread_mutex_unlock(&record_lock);
+}
@@ -0,0 +1,54 @@
+/*
+ *	Tiny File System
+ *	File:	record.h
+ *
+ *	Op recorder. With a record file set, every timed FUSE op appends one
+ *	entry saying what was asked (op, path, offset, size, mode, flags),
+ *	when it started, how long it took and what it returned. rufs-replay
+ *	reads the file back and drives librufs with the same ops.
+ *
+ *	On disk: a record_header, then record_ops, each followed by the
+ *	pathlen bytes of its path without a terminating NUL.
+ */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <stdint.h>
+
+#include "stats.h"
+
+#define RECORD_MAGIC		0x52464f50	/* "RFOP" */
+#define RECORD_VERSION		1
+#define RECORD_BUF_BYTES	(1 << 20)	/* buffered before each write(2) */
+
+struct record_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	start_unix_ns;		/* wall clock when the recording began */
+} typedef record_header;
+
+struct record_op {
+	uint64_t	start_ns;			/* since the recording began */
+	uint64_t	offset;				/* read, write, readdir, fallocate; truncate: the new size */
+	uint64_t	len;				/* read, write, fallocate */
+	uint32_t	dur_ns;				/* saturates at about 4 s */
+	int32_t		ret;
+	uint32_t	mode;				/* mkdir, create, fallocate: mode; fsync: datasync; ioctl: cmd */
+	uint32_t	flags;				/* open flags of the file handle, if any */
+	uint16_t	thread;				/* recording threads numbered as they first show up */
+	uint8_t		op;					/* enum stats_op */
+	uint8_t		pad;
+	uint16_t	pathlen;
+	uint16_t	pad2;
+} typedef record_op;
+
+void record_set_file(const char *path);	/* NULL or "" turns recording off */
+void record_start();
+void record_stop();
+
+int record_enabled();
+void record_add(enum stats_op op, const char *path, uint64_t start_ns, int ret,
+	uint64_t offset, uint64_t len, uint32_t mode, uint32_t flags);
+
+#endif
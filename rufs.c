@@ -6,6 +6,7 @@
  */
 
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
 #include <fuse.h>
 #include <stdlib.h>
@@ -19,96 +20,1265 @@
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 
 #include "block.h"
 #include "rufs.h"
+#include "arena.h"
+#include "cache.h"
+#include "dispatch.h"
+#include "extent.h"
+#include "log.h"
+#include "record.h"
+#include "stats.h"
+#include "trace.h"
 
 char diskfile_path[PATH_MAX];
+sb* superblock;
 
 // Declare your in-memory data structures here
 
+/*
+ * Blocks of removed or truncated files waiting for the background reclaimer.
+ * Whole indirect blocks are handed over as-is, so detaching them is O(1) on
+ * the caller's path; the reclaimer walks them and frees what they map.
+ */
+struct reclaim_item {
+	struct reclaim_item*	next;
+	int						ndirect;
+	int32_t*				direct;						/* data blocks to free */
+	int32_t					indirect[INDIRECT_PTRS];	/* indirect blocks to free with their data */
+	int32_t					frag_ptr;					/* packed tail to give back */
+	int						nfrags;						/* its fragments, 0 for none */
+};
+
+static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;	/* guards both bitmaps and the free counts */
+static pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;	/* serializes inode table initialization */
+static pthread_mutex_t frag_lock = PTHREAD_MUTEX_INITIALIZER;	/* guards the fragment map, taken before bitmap_lock */
+
+/*
+ * An inode table block holds INODES_PER_BLOCK inodes, so writing one inode
+ * is a read-modify-write of a block other ops may be rewriting for their
+ * own inodes. These serialize it, striped by block; several are taken in
+ * ascending order.
+ */
+#define ITABLE_LOCKS	32
+static pthread_mutex_t itable_block_locks[ITABLE_LOCKS] = {
+	[0 ... ITABLE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*
+ * Lookups hold no inode lock, yet dir_add, dir_remove and dir_batch
+ * rewrite directory blocks in place. A lookup holds its directory's
+ * stripe shared across the scan and the dentry cache fill, and the
+ * writers hold it exclusively from their first block write to the last
+ * cache invalidation, so no scan sees an entry halfway through a move and
+ * no stale answer is cached after it.
+ */
+#define DIR_LOCKS		32
+static pthread_rwlock_t dir_locks[DIR_LOCKS] = {
+	[0 ... DIR_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
+
+/*
+ * In-memory copy of a bitmap. Each block-sized segment is read the first time
+ * an allocator touches it and written through when it changes, so mounting
+ * reads no bitmap at all.
+ */
+#define BITS_PER_SEG	(BLOCK_SIZE * 8)
+#define ITABLE_INIT_BATCH	8	/* inode table blocks zeroed per superblock update */
+
+struct bitmap_cache {
+	uint32_t	start_blk;
+	int			nbits;
+	int			nsegs;
+	bitmap_t*	segs;		/* NULL until loaded */
+	uint8_t*	dirty;
+};
+
+static struct bitmap_cache inode_map, data_map, frag_map;
+
+/* free runs of the data bitmap, built on the first data allocation */
+static struct extent_index data_free;
+
+/* fragment blocks known to have free slots, 0 for an empty entry */
+#define FRAG_HINTS	8
+static int frag_hint[FRAG_HINTS];
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;		/* work queued or stopping */
+static pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;		/* a batch was freed */
+static struct reclaim_item* reclaim_queue;
+static int reclaim_busy;
+static int reclaim_stopping;
+static pthread_t reclaim_thread;
+
+/*
+ * bitmap cache, callers hold bitmap_lock
+ */
+static void bitmap_open(struct bitmap_cache *bc, uint32_t start_blk, int nbits) {
+	bc->start_blk = start_blk;
+	bc->nbits = nbits;
+	bc->nsegs = (nbits + BITS_PER_SEG - 1) / BITS_PER_SEG;
+	bc->segs = calloc(bc->nsegs, sizeof(bitmap_t));
+	bc->dirty = calloc(bc->nsegs, 1);
+}
+
+static void bitmap_close(struct bitmap_cache *bc) {
+	for (int i = 0; i < bc->nsegs; i++) {
+		free(bc->segs[i]);
+	}
+	free(bc->segs);
+	free(bc->dirty);
+	memset(bc, 0, sizeof(struct bitmap_cache));
+}
+
+static bitmap_t bitmap_seg(struct bitmap_cache *bc, int i) {
+	int seg = i / BITS_PER_SEG;
+	if (bc->segs[seg] == NULL) {
+		bc->segs[seg] = aligned_alloc(BLOCK_SIZE, BLOCK_SIZE); // no bounce in direct mode
+		bio_read(bc->start_blk + seg, bc->segs[seg]);
+	}
+	return bc->segs[seg];
+}
+
+static int bitmap_get(struct bitmap_cache *bc, int i) {
+	return get_bitmap(bitmap_seg(bc, i), i % BITS_PER_SEG);
+}
+
+static void bitmap_set(struct bitmap_cache *bc, int i, int used) {
+	if (used) {
+		set_bitmap(bitmap_seg(bc, i), i % BITS_PER_SEG);
+	} else {
+		unset_bitmap(bitmap_seg(bc, i), i % BITS_PER_SEG);
+	}
+	bc->dirty[i / BITS_PER_SEG] = 1;
+}
+
+static void bitmap_sync(struct bitmap_cache *bc) {
+	for (int seg = 0; seg < bc->nsegs; seg++) {
+		if (bc->dirty[seg]) {
+			bio_write(bc->start_blk + seg, bc->segs[seg]);
+			bc->dirty[seg] = 0;
+		}
+	}
+}
+
+static int bitmap_count_free(struct bitmap_cache *bc) {
+	int n = 0;
+	for (int i = 0; i < bc->nbits; i++) {
+		n += !bitmap_get(bc, i);
+	}
+	return n;
+}
+
+/*
+ * free-extent index over the data bitmap, callers hold bitmap_lock
+ */
+static struct extent_index *data_index() {
+	if (data_free.nbits == 0) {
+		extent_open(&data_free, data_map.nbits);
+		for (int i = 0; i < data_map.nbits; ) {
+			if (bitmap_get(&data_map, i)) {
+				i++;
+				continue;
+			}
+			int start = i;
+			while (i < data_map.nbits && !bitmap_get(&data_map, i)) {
+				i++;
+			}
+			extent_mark(&data_free, start, i - start, 0);
+		}
+	}
+	return &data_free;
+}
+
+static void data_mark(int start, int len, int used) { // bitmap and index together
+	for (int i = start; i < start + len; i++) {
+		bitmap_set(&data_map, i, used);
+	}
+	if (data_free.nbits != 0) {
+		extent_mark(&data_free, start, len, used);
+	}
+}
+
 /* 
  * Get available inode number from bitmap
  */
 int get_avail_ino() {
-	// Step 1: Read inode bitmap from disk
-	bitmap_t inode_bitmap = (unsigned char*) malloc(BLOCK_SIZE);
-	bio_read(superblock->i_bitmap_blk, inode_bitmap);
+	TRACE_SCOPE(EV_ALLOC_INO, 0);
+
+	// Step 1: Lock the inode bitmap
+	pthread_mutex_lock(&bitmap_lock);
 	
 	// Step 2: Traverse inode bitmap to find an available slot
 	int ino = 0;
-	for(; ino < superblock->max_inum && get_bitmap(inode_bitmap, ino); ino++) {}
+	for(; ino < superblock->max_inum && bitmap_get(&inode_map, ino); ino++) {}
+	stats_alloc_scan(ino + 1);
 	
 	// Step 3: Update inode bitmap and write to disk
 	if (ino < superblock->max_inum) {
-		set_bitmap(inode_bitmap, ino);
-		bio_write(superblock->i_bitmap_blk, inode_bitmap);
-		free(inode_bitmap);
+		bitmap_set(&inode_map, ino, 1);
+		bitmap_sync(&inode_map);
+		superblock->free_inodes--;
+		pthread_mutex_unlock(&bitmap_lock);
 		return ino;
 	}
-	free(inode_bitmap);
+	pthread_mutex_unlock(&bitmap_lock);
 
 	return 0;
 }
 
+/*
+ * Take up to want free inode numbers, lowest first, in one pass over the
+ * inode bitmap. Returns how many were stored in inos.
+ */
+int get_avail_inos(int want, uint16_t *inos) {
+	TRACE_SCOPE(EV_ALLOC_INO, want);
+
+	pthread_mutex_lock(&bitmap_lock);
+	int got = 0, ino = 0;
+	for (; ino < superblock->max_inum && got < want; ino++) {
+		if (!bitmap_get(&inode_map, ino)) {
+			bitmap_set(&inode_map, ino, 1);
+			inos[got++] = ino;
+		}
+	}
+	stats_alloc_scan(ino);
+	if (got > 0) {
+		bitmap_sync(&inode_map);
+		superblock->free_inodes -= got;
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+	return got;
+}
+
 /* 
  * Get available data block number from bitmap
  */
 int get_avail_blkno() {
-	// Step 1: Read data block bitmap from disk
-	bitmap_t data_bitmap = (unsigned char*) malloc(BLOCK_SIZE);
-	bio_read(superblock->d_bitmap_blk, data_bitmap);
+	TRACE_SCOPE(EV_ALLOC_BLKNO, 0);
+
+	// Step 1: Lock the data block bitmap
+	pthread_mutex_lock(&bitmap_lock);
+
+	// Step 2: Ask the free-extent index for the lowest free block
+	struct extent_index* ix = data_index();
+	int i = extent_find(ix, 0, 1);
+	stats_alloc_scan(ix->scanned);
+
+	// Step 3: Update data block bitmap and write to disk 
+	if (i >= 0) {
+		data_mark(i, 1, 1);
+		bitmap_sync(&data_map);
+		superblock->free_blocks--;
+		pthread_mutex_unlock(&bitmap_lock);
+		return i;
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+	return 0;
+}
+
+/* 
+ * Get up to want contiguous data blocks from bitmap, searching from goal
+ * first so that files grow sequentially. Stores the run length in *got and
+ * returns the first block, or 0 if no block is free.
+ */
+int get_avail_extent(int goal, int want, int *got) {
+	TRACE_SCOPE(EV_ALLOC_EXTENT, want);
+
+	// Step 1: Lock the data block bitmap
+	pthread_mutex_lock(&bitmap_lock);
+
+	// Step 2: Take the first run of want free blocks at or after goal, then
+	// wrap around; failing both, the largest free extent there is
+	int max = superblock->max_dnum;
+	if (goal < (int)superblock->d_start_blk || goal >= max) {
+		goal = superblock->d_start_blk;
+	}
+	struct extent_index* ix = data_index();
+	int best_len = want, scanned = 0;
+	int best = extent_find(ix, goal, want);
+	scanned += ix->scanned;
+	if (best < 0 && goal != (int)superblock->d_start_blk) {
+		best = extent_find(ix, superblock->d_start_blk, want);
+		scanned += ix->scanned;
+	}
+	if (best < 0) {
+		best_len = extent_largest(ix, &best);
+		scanned += ix->scanned;
+	}
+	stats_alloc_scan(scanned);
+
+	// Step 3: Update data block bitmap and write to disk
+	if (best_len > 0) {
+		data_mark(best, best_len, 1);
+		bitmap_sync(&data_map);
+		superblock->free_blocks -= best_len;
+	} else {
+		best = 0;
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+	*got = best_len;
+	return best;
+}
+
+/* 
+ * Return an inode number to the inode bitmap
+ */
+void release_ino(uint16_t ino) {
+	pthread_mutex_lock(&bitmap_lock);
+	bitmap_set(&inode_map, ino, 0);
+	bitmap_sync(&inode_map);
+	superblock->free_inodes++;
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+/* 
+ * Return a data block to the data bitmap right away
+ */
+static void release_blkno(int blkno) {
+	cache_invalidate(CACHE_BLOCK, blkno, NULL);
+	pthread_mutex_lock(&bitmap_lock);
+	data_mark(blkno, 1, 0);
+	bitmap_sync(&data_map);
+	superblock->free_blocks++;
+	pthread_mutex_unlock(&bitmap_lock);
+}
+
+/*
+ * fragment allocation, callers hold frag_lock
+ */
+static int frag_map_create() {
+	int got = 0;
+	int start = get_avail_extent(superblock->d_start_blk, FRAG_MAP_BLOCKS, &got);
+	if (got < FRAG_MAP_BLOCKS) {
+		for (int i = 0; i < got; i++) {
+			release_blkno(start + i);
+		}
+		return -ENOSPC;
+	}
+
+	// the zeroed map must be on disk before the superblock points at it
+	void* zeroes = arena_zalloc(BLOCK_SIZE);
+	for (int i = 0; i < FRAG_MAP_BLOCKS; i++) {
+		bio_write(start + i, zeroes);
+	}
+	dev_flush();
+	superblock->frag_map_blk = start;
+	bio_write(0, superblock);
+	bitmap_open(&frag_map, start, superblock->max_dnum * FRAGS_PER_BLOCK);
+	return 0;
+}
+
+static int frag_find(int blkno, int count) { // first slot of a free run, or -1
+	int run = 0;
+	for (int slot = 0; slot < FRAGS_PER_BLOCK; slot++) {
+		run = bitmap_get(&frag_map, blkno * FRAGS_PER_BLOCK + slot) ? 0 : run + 1;
+		if (run == count) {
+			return slot - count + 1;
+		}
+	}
+	return -1;
+}
+
+static void frag_remember(int blkno) {
+	for (int h = 0; h < FRAG_HINTS; h++) {
+		if (frag_hint[h] == blkno) {
+			return;
+		}
+	}
+	for (int h = 0; h < FRAG_HINTS; h++) {
+		if (frag_hint[h] == 0) {
+			frag_hint[h] = blkno;
+			return;
+		}
+	}
+}
+
+static void frag_forget(int blkno) {
+	for (int h = 0; h < FRAG_HINTS; h++) {
+		if (frag_hint[h] == blkno) {
+			frag_hint[h] = 0;
+		}
+	}
+}
+
+/* 
+ * Get count contiguous fragments, preferring fragment blocks that already
+ * have room. Returns a fragment pointer with frag_lock still held, so the
+ * caller can patch the shared block before another tail lands in it, or a
+ * negative error with the lock dropped.
+ */
+static int32_t get_avail_frags(int count) {
+	pthread_mutex_lock(&frag_lock);
+	if (superblock->frag_map_blk == 0 && frag_map_create() < 0) {
+		pthread_mutex_unlock(&frag_lock);
+		return -ENOSPC;
+	}
+
+	// Step 1: Look for a run in the fragment blocks with free slots
+	int blkno = 0, slot = -1;
+	for (int h = 0; h < FRAG_HINTS && slot < 0; h++) {
+		if (frag_hint[h] != 0) {
+			blkno = frag_hint[h];
+			slot = frag_find(blkno, count);
+		}
+	}
+
+	// Step 2: Otherwise start a new fragment block
+	if (slot < 0) {
+		blkno = get_avail_blkno();
+		if (blkno == 0 && reclaim_wait()) {
+			blkno = get_avail_blkno();
+		}
+		if (blkno == 0) {
+			pthread_mutex_unlock(&frag_lock);
+			return -ENOSPC;
+		}
+		slot = 0;
+	}
+
+	// Step 3: Mark the run used and write the map through
+	for (int i = slot; i < slot + count; i++) {
+		bitmap_set(&frag_map, blkno * FRAGS_PER_BLOCK + i, 1);
+	}
+	bitmap_sync(&frag_map);
+	if (frag_find(blkno, 1) < 0) {
+		frag_forget(blkno);
+	} else {
+		frag_remember(blkno);
+	}
+	return make_frag_ptr(blkno, slot);
+}
+
+/* 
+ * Return count fragments to the fragment map; a fragment block whose last
+ * fragment goes is returned to the data bitmap
+ */
+static void release_frags(int32_t ptr, int count) {
+	pthread_mutex_lock(&frag_lock);
+	int blkno = frag_blkno(ptr);
+	for (int i = frag_slot(ptr); i < frag_slot(ptr) + count; i++) {
+		bitmap_set(&frag_map, blkno * FRAGS_PER_BLOCK + i, 0);
+	}
+	bitmap_sync(&frag_map);
+	if (frag_find(blkno, FRAGS_PER_BLOCK) == 0) {
+		frag_forget(blkno);
+		release_blkno(blkno);
+	} else {
+		frag_remember(blkno);
+	}
+	pthread_mutex_unlock(&frag_lock);
+}
+
+/*
+ * deferred block freeing
+ */
+static void reclaim_enqueue(struct reclaim_item *item) {
+	pthread_mutex_lock(&reclaim_lock);
+	item->next = reclaim_queue;
+	reclaim_queue = item;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+}
+
+/*
+ * Free every block referenced by a batch of items with a single
+ * write of each changed data bitmap segment
+ */
+static void reclaim_batch(struct reclaim_item *list) {
+	int32_t* ptrs = malloc(BLOCK_SIZE);
+
+	// Step 1: Gather block numbers outside the bitmap lock; detached indirect
+	// blocks belong to nobody else, so they can be read without locking
+	int cap = 0, count = 0;
+	int32_t* blocks = NULL;
+	for (struct reclaim_item* item = list; item != NULL; item = item->next) {
+		int need = count + item->ndirect + INDIRECT_PTRS*(PTRS_PER_BLOCK + 1);
+		if (need > cap) {
+			cap = need;
+			blocks = realloc(blocks, cap * sizeof(int32_t));
+		}
+		for (int i = 0; i < item->ndirect; i++) {
+			blocks[count++] = ptr_blkno(item->direct[i]);
+		}
+		for (int i = 0; i < INDIRECT_PTRS; i++) {
+			if (item->indirect[i] == -1) {
+				continue;
+			}
+			bio_read(item->indirect[i], ptrs);
+			for (int k = 0; k < PTRS_PER_BLOCK; k++) {
+				if (ptrs[k] != -1) {
+					blocks[count++] = ptr_blkno(ptrs[k]);
+				}
+			}
+			blocks[count++] = item->indirect[i];
+		}
+	}
+
+	// Step 2: Clear them all in one pass over the data bitmap
+	for (int i = 0; i < count; i++) {
+		cache_invalidate(CACHE_BLOCK, blocks[i], NULL);
+	}
+	if (count > 0) {
+		pthread_mutex_lock(&bitmap_lock);
+		for (int i = 0; i < count; i++) {
+			data_mark(blocks[i], 1, 0);
+		}
+		bitmap_sync(&data_map);
+		superblock->free_blocks += count;
+		pthread_mutex_unlock(&bitmap_lock);
+	}
+
+	while (list != NULL) {
+		struct reclaim_item* next = list->next;
+		free(list->direct);
+		free(list);
+		list = next;
+	}
+	free(blocks);
+	free(ptrs);
+}
+
+static void *reclaim_main(void *arg) {
+	pthread_mutex_lock(&reclaim_lock);
+	for (;;) {
+		while (reclaim_queue == NULL && !reclaim_stopping) {
+			pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+		}
+		if (reclaim_queue == NULL) { // stopping and fully drained
+			break;
+		}
+
+		// take everything queued so far as one batch
+		struct reclaim_item* batch = reclaim_queue;
+		reclaim_queue = NULL;
+		reclaim_busy = 1;
+		pthread_mutex_unlock(&reclaim_lock);
+
+		reclaim_batch(batch);
+
+		pthread_mutex_lock(&reclaim_lock);
+		reclaim_busy = 0;
+		pthread_cond_broadcast(&reclaim_done);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return NULL;
+}
+
+/*
+ * Block until everything queued so far has been freed. Returns 0 if there
+ * was nothing pending, so allocators know whether retrying can help.
+ */
+int reclaim_wait() {
+	pthread_mutex_lock(&reclaim_lock);
+	int pending = reclaim_queue != NULL || reclaim_busy;
+	while (reclaim_queue != NULL || reclaim_busy) {
+		pthread_cond_wait(&reclaim_done, &reclaim_lock);
+	}
+	pthread_mutex_unlock(&reclaim_lock);
+	return pending;
+}
+
+static void reclaim_start() {
+	reclaim_stopping = 0;
+	pthread_create(&reclaim_thread, NULL, reclaim_main, NULL);
+}
 
-	// Step 2: Traverse data block bitmap to find an available slot
-	for(int i = 0; i < superblock->max_dnum; i++){
-		if(!get_bitmap(data_bitmap, i)){
+static void reclaim_stop() {
+	pthread_mutex_lock(&reclaim_lock);
+	reclaim_stopping = 1;
+	pthread_cond_signal(&reclaim_cond);
+	pthread_mutex_unlock(&reclaim_lock);
+	pthread_join(reclaim_thread, NULL);
+}
+
+/*
+ * cache warm-up
+ */
+#define WARM_BATCH	64		/* most blocks read at once */
+#define WARM_GAP	8		/* read this many unwanted blocks rather than split a batch */
 
-			// Step 3: Update data block bitmap and write to disk 
-			set_bitmap(data_bitmap, i);
-			bio_write(superblock->d_bitmap_blk, data_bitmap);
-			free(data_bitmap);
-			return i;
+static pthread_t warm_thread;
+static int warm_running, warm_stopping;
+
+static int cmp_int32(const void *a, const void *b) {
+	int32_t x = *(const int32_t*)a, y = *(const int32_t*)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Read the saved hot blocks in ascending order, nearby ones in one request,
+ * and hand each to the cache unless something got there first
+ */
+static void *warm_main(void *arg) {
+	int32_t* list = aligned_alloc(BLOCK_SIZE, WARM_BLOCKS * BLOCK_SIZE);
+	char* buf = aligned_alloc(BLOCK_SIZE, WARM_BATCH * BLOCK_SIZE);
+	uint8_t reserved[WARM_BATCH];
+
+	// Step 1: Load the list, then sort it and drop duplicates and junk
+	int n = 0, count = superblock->warm_count;
+	if (bio_read_blocks(superblock->warm_blk, WARM_BLOCKS, list) < 0) {
+		count = 0;
+	}
+	qsort(list, count, sizeof(int32_t), cmp_int32);
+	for (int i = 0; i < count; i++) {
+		if (list[i] >= 0 && list[i] < superblock->max_dnum && (n == 0 || list[i] != list[n - 1])) {
+			list[n++] = list[i];
+		}
+	}
+
+	// Step 2: Read batches
+	for (int i = 0; i < n && !__atomic_load_n(&warm_stopping, __ATOMIC_ACQUIRE); ) {
+		int first = list[i], j = i + 1;
+		while (j < n && list[j] - list[j - 1] <= WARM_GAP && list[j] - first < WARM_BATCH) {
+			j++;
+		}
+		int len = list[j - 1] - first + 1;
+		memset(reserved, 0, len);
+		int want = 0;
+		for (int k = i; k < j; k++) {
+			reserved[list[k] - first] = cache_reserve(CACHE_BLOCK, list[k], NULL);
+			want += reserved[list[k] - first];
+		}
+		i = j;
+		if (want == 0) { // all cached already, or the cache is off
+			continue;
+		}
+		int ret = bio_read_blocks(first, len, buf);
+		for (int b = 0; b < len; b++) {
+			if (!reserved[b]) {
+				continue;
+			}
+			if (ret < 0) {
+				cache_abandon(CACHE_BLOCK, first + b, NULL);
+			} else {
+				cache_insert(CACHE_BLOCK, first + b, NULL, buf + (size_t)b * BLOCK_SIZE, BLOCK_SIZE);
+			}
+		}
+	}
+
+	free(buf);
+	free(list);
+	return NULL;
+}
+
+static void warm_start() {
+	warm_stopping = 0;
+	warm_running = !dev_in_memory() && superblock->warm_blk >= superblock->d_start_blk && // nothing to warm in RAM mode
+		superblock->warm_blk + WARM_BLOCKS <= superblock->max_dnum &&
+		superblock->warm_count > 0 && superblock->warm_count <= WARM_MAX &&
+		pthread_create(&warm_thread, NULL, warm_main, NULL) == 0;
+}
+
+static void warm_stop() {
+	if (warm_running) {
+		__atomic_store_n(&warm_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(warm_thread, NULL);
+		warm_running = 0;
+	}
+}
+
+/*
+ * Record what the cache holds; the list region is allocated on first use
+ * and kept, so later unmounts only rewrite it. An empty cache (turned off,
+ * or nothing was read) leaves the previous list in place.
+ */
+static void warm_save() {
+	int32_t* list = aligned_alloc(BLOCK_SIZE, WARM_BLOCKS * BLOCK_SIZE);
+	memset(list, 0xff, WARM_BLOCKS * BLOCK_SIZE);
+	int count = cache_hot_blocks((uint32_t*)list, WARM_MAX);
+	if (count == 0) {
+		free(list);
+		return;
+	}
+
+	if (superblock->warm_blk == 0) {
+		int got = 0;
+		int start = get_avail_extent(superblock->d_start_blk, WARM_BLOCKS, &got);
+		if (got < WARM_BLOCKS) {
+			for (int i = 0; i < got; i++) {
+				release_blkno(start + i);
+			}
+			free(list);
+			return;
+		}
+		superblock->warm_blk = start;
+	}
+
+	superblock->warm_count = 0;
+	if (bio_write_blocks(superblock->warm_blk, WARM_BLOCKS, list) >= 0) {
+		superblock->warm_count = count;
+	}
+	free(list);
+}
+
+/*
+ * Read-only images. Nothing on an image finalized by mkrufs -r ever
+ * changes, so the inode table, the directory blocks, the hash tables and
+ * every indirect block are read once at mount. Lookups, getattr and reads
+ * then use these copies from any thread without a lock; the block cache,
+ * the dispatch pools and the background threads are never started.
+ */
+static int ro_mount;
+static index_node* ro_itable;
+static direntry* ro_dirs;			/* the run of directory blocks */
+static uint16_t* ro_index;			/* per-inode table offsets, then the tables */
+static int32_t** ro_ptrs;			/* indirect block contents by block number */
+static int32_t* ro_ptr_mem;
+
+static int ro_load() {
+	// Step 1: Inode table; inodes from itable_init on were never written
+	if (superblock->itable_init * INODES_PER_BLOCK > superblock->max_inum) {
+		return -1;
+	}
+	ro_itable = calloc(superblock->max_inum, sizeof(index_node));
+	if (bio_read_blocks(superblock->i_start_blk, superblock->itable_init, ro_itable) < 0) {
+		return -1;
+	}
+
+	// Step 2: Directory blocks and hash tables
+	ro_dirs = malloc((size_t)superblock->ro_dir_blocks * BLOCK_SIZE);
+	ro_index = malloc((size_t)superblock->ro_index_blocks * BLOCK_SIZE);
+	if (superblock->ro_index_blocks * BLOCK_SIZE < superblock->max_inum * sizeof(uint32_t) ||
+		bio_read_blocks(superblock->ro_dir_blk, superblock->ro_dir_blocks, ro_dirs) < 0 ||
+		bio_read_blocks(superblock->ro_index_blk, superblock->ro_index_blocks, ro_index) < 0) {
+		return -1;
+	}
+
+	// Step 3: Indirect blocks, counted first so they share one allocation
+	int count = 0;
+	for (int ino = 0; ino < superblock->max_inum; ino++) {
+		for (int k = 0; ro_itable[ino].valid && k < INDIRECT_PTRS; k++) {
+			count += ro_itable[ino].indirect_ptr[k] != -1;
+		}
+	}
+	ro_ptrs = calloc(superblock->max_dnum, sizeof(int32_t*));
+	ro_ptr_mem = malloc((size_t)(count ? count : 1) * BLOCK_SIZE);
+	count = 0;
+	for (int ino = 0; ino < superblock->max_inum; ino++) {
+		for (int k = 0; ro_itable[ino].valid && k < INDIRECT_PTRS; k++) {
+			int32_t blk = ro_itable[ino].indirect_ptr[k];
+			if (blk == -1) {
+				continue;
+			}
+			if (blk < 0 || blk >= superblock->max_dnum) {
+				return -1;
+			}
+			ro_ptrs[blk] = ro_ptr_mem + (size_t)count++ * PTRS_PER_BLOCK;
+			if (bio_read_blocks(blk, 1, ro_ptrs[blk]) < 0) {
+				return -1;
+			}
 		}
 	}
-	free(data_bitmap);
 	return 0;
 }
 
+static void ro_unload() {
+	free(ro_itable);
+	free(ro_dirs);
+	free(ro_index);
+	free(ro_ptrs);
+	free(ro_ptr_mem);
+	ro_itable = NULL;
+	ro_dirs = NULL;
+	ro_index = NULL;
+	ro_ptrs = NULL;
+	ro_ptr_mem = NULL;
+	ro_mount = 0;
+}
+
+/* entry k of a directory, or NULL if its block is not in the directory run */
+static const direntry *ro_dirent(const index_node *dir, int k) {
+	if (k / MAX_DIRENTS >= DIRECT_PTRS) {
+		return NULL;
+	}
+	uint32_t blk = (uint32_t)dir->direct_ptr[k / MAX_DIRENTS] - superblock->ro_dir_blk;
+	if (blk >= superblock->ro_dir_blocks) {
+		return NULL;
+	}
+	return ro_dirs + blk * MAX_DIRENTS + k % MAX_DIRENTS;
+}
+
+/* one probe of the directory's perfect hash, then compare the name found there */
+static int ro_find(uint16_t ino, const char *fname, struct dirent *dirent) {
+	const index_node* dir = &ro_itable[ino];
+	uint32_t off = ino < superblock->max_inum ? ((uint32_t*)ro_index)[ino] : 0;
+	if (!S_ISDIR(dir->mode) || off == 0 || off >= superblock->ro_index_blocks * BLOCK_SIZE / sizeof(uint16_t)) {
+		return 0;
+	}
+	const uint16_t* t = ro_index + off;
+	uint16_t nkeys = t[0], nbuckets = t[1];
+	if (nkeys == 0 || nbuckets == 0) {
+		return 0;
+	}
+	uint16_t disp = t[2 + dir_hash(fname, 0) % nbuckets];
+	const direntry* d = ro_dirent(dir, t[2 + nbuckets + dir_hash(fname, disp + 1) % nkeys]);
+	if (d == NULL || d->valid == INVALID || strcmp(d->name, fname) != 0) {
+		return 0;
+	}
+	memcpy(dirent, d, sizeof(direntry));
+	return 1;
+}
+
 /* 
  * inode operations
  */
+
+/*
+ * mkfs leaves the inode table unwritten. Zero blocks up to at least upto,
+ * then record the new high-water mark; the zeroes must reach the disk before
+ * the superblock says they are there.
+ */
+static void itable_extend(uint32_t upto) {
+	pthread_mutex_lock(&itable_lock);
+	uint32_t total = superblock->d_start_blk - superblock->i_start_blk;
+	uint32_t from = superblock->itable_init;
+	if (upto > from) {
+		if (upto < from + ITABLE_INIT_BATCH) {
+			upto = from + ITABLE_INIT_BATCH;
+		}
+		if (upto > total) {
+			upto = total;
+		}
+		void* zeroes = arena_zalloc(BLOCK_SIZE);
+		for (uint32_t b = from; b < upto; b++) {
+			bio_write(superblock->i_start_blk + b, zeroes);
+		}
+		dev_flush();
+		__atomic_store_n(&superblock->itable_init, upto, __ATOMIC_RELEASE);
+		bio_write(0, superblock);
+	}
+	pthread_mutex_unlock(&itable_lock);
+}
+
 int readi(uint16_t ino, struct inode *inode) { // assumes that ino is checked beforehand and that this method always runs successfully
+	ARENA_SCOPE;
+
+	if (ro_mount) {
+		memcpy(inode, &ro_itable[ino], sizeof(index_node));
+		return 1;
+	}
+	if (ino / INODES_PER_BLOCK >= __atomic_load_n(&superblock->itable_init, __ATOMIC_ACQUIRE)) {
+		memset(inode, 0, sizeof(index_node)); // never written, so free
+		return 1;
+	}
+	if (cache_lookup(CACHE_INODE, ino, NULL, inode, sizeof(index_node)) == sizeof(index_node)) {
+		return 1;
+	}
+
   // Step 1: Get the inode's on-disk block number
-  	int block_num = superblock->i_start_blk + (ino)/(BLOCK_SIZE/sizeof(index_node));
+  	int block_num = superblock->i_start_blk + ino / INODES_PER_BLOCK;
 
   // Step 2: Get offset of the inode in the inode on-disk block
-	int offset = ino % (BLOCK_SIZE/sizeof(index_node));
+	int offset = ino % INODES_PER_BLOCK;
   // Step 3: Read the block from disk and then copy into inode structure
-  	index_node* desired_block = malloc(BLOCK_SIZE);
+  	index_node* desired_block = arena_alloc(BLOCK_SIZE);
 	bio_read(block_num, desired_block);
 
 	index_node * ptr = (desired_block) + offset;
 	memcpy(inode, ptr, sizeof(index_node));
-	free(desired_block);
+	cache_insert(CACHE_INODE, ino, NULL, inode, sizeof(index_node));
 	return 1;
 }
 
+/*
+ * Lock or unlock the stripes of count inode table blocks from first
+ */
+static void itable_lock_blocks(int first, int count, int lock) {
+	uint32_t stripes = 0;
+	for (int b = first; b < first + count && b < first + ITABLE_LOCKS; b++) {
+		stripes |= 1u << (b % ITABLE_LOCKS);
+	}
+	for (int i = 0; i < ITABLE_LOCKS; i++) {
+		if (stripes & (1u << i)) {
+			if (lock) {
+				pthread_mutex_lock(&itable_block_locks[i]);
+			} else {
+				pthread_mutex_unlock(&itable_block_locks[i]);
+			}
+		}
+	}
+}
+
 int writei(uint16_t ino, struct inode *inode) {
+	ARENA_SCOPE;
+
+	if (ino / INODES_PER_BLOCK >= __atomic_load_n(&superblock->itable_init, __ATOMIC_ACQUIRE)) {
+		itable_extend(ino / INODES_PER_BLOCK + 1);
+	}
+
 	// Step 1: Get the block number where this inode resides on disk
-	int block_num = superblock->i_start_blk + (ino)/(BLOCK_SIZE/sizeof(index_node));
+	int block_num = superblock->i_start_blk + ino / INODES_PER_BLOCK;
 	
 	// Step 2: Get the offset in the block where this inode resides on disk
-	int offset = ino % (BLOCK_SIZE/sizeof(index_node));
+	int offset = ino % INODES_PER_BLOCK;
 
 	// Step 3: Write inode to disk 
-	index_node* desired_block = malloc(BLOCK_SIZE);
+	index_node* desired_block = arena_alloc(BLOCK_SIZE);
+	itable_lock_blocks(ino / INODES_PER_BLOCK, 1, 1);
 	bio_read(block_num, desired_block);
 
 	index_node * ptr = (desired_block) + offset;
 	memcpy(ptr, inode, sizeof(index_node));
 
 	bio_write(block_num, desired_block);
-	free(desired_block);
+	cache_update(CACHE_INODE, ino, NULL, inode, sizeof(index_node));
+	itable_lock_blocks(ino / INODES_PER_BLOCK, 1, 0);
+	return 0;
+}
+
+/*
+ * Synthesize a struct stat from the compact on-disk inode
+ */
+void inode_to_stat(const struct inode *inode, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = inode->ino;
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_size = inode->size;
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_blocks = (blkcnt_t)inode->blocks * (BLOCK_SIZE / 512) + tail_frags(inode) * (FRAG_SIZE / 512);
+	stbuf->st_atime = inode->mtime;
+	stbuf->st_mtime = inode->mtime;
+	stbuf->st_ctime = inode->ctime;
+}
+
+/*
+ * block map operations
+ */
+int get_file_blkno(struct inode *inode, int lblk) { // returns -1 for a hole
+	ARENA_SCOPE;
+
+	if (lblk < DIRECT_PTRS) {
+		return inode->direct_ptr[lblk];
+	}
+	lblk -= DIRECT_PTRS;
+	if (lblk >= INDIRECT_PTRS*PTRS_PER_BLOCK || inode->indirect_ptr[lblk / PTRS_PER_BLOCK] == -1) {
+		return -1;
+	}
+	if (ro_mount) {
+		int32_t* ro = ro_ptrs[inode->indirect_ptr[lblk / PTRS_PER_BLOCK]];
+		return ro != NULL ? ro[lblk % PTRS_PER_BLOCK] : -1;
+	}
+
+	int32_t* ptrs = arena_alloc(BLOCK_SIZE);
+	bio_read(inode->indirect_ptr[lblk / PTRS_PER_BLOCK], ptrs);
+	int blkno = ptrs[lblk % PTRS_PER_BLOCK];
+	return blkno;
+}
+
+int set_file_blkno(struct inode *inode, int lblk, int blkno) { // caller writes the inode back
+	ARENA_SCOPE;
+
+	if (lblk < DIRECT_PTRS) {
+		inode->direct_ptr[lblk] = blkno;
+		return 0;
+	}
+	lblk -= DIRECT_PTRS;
+	if (lblk >= INDIRECT_PTRS*PTRS_PER_BLOCK) {
+		return -EFBIG;
+	}
+
+	int32_t* ptrs = arena_alloc(BLOCK_SIZE);
+	int slot = lblk / PTRS_PER_BLOCK;
+	if (inode->indirect_ptr[slot] == -1) { // indirect blocks start out as all holes
+		int ind = get_avail_blkno();
+		if (ind == 0) {
+			return -ENOSPC;
+		}
+		inode->indirect_ptr[slot] = ind;
+		memset(ptrs, 0xff, BLOCK_SIZE);
+	} else {
+		bio_read(inode->indirect_ptr[slot], ptrs);
+	}
+	ptrs[lblk % PTRS_PER_BLOCK] = blkno;
+	bio_write(inode->indirect_ptr[slot], ptrs);
+	return 0;
+}
+
+/*
+ * Fill every hole in [lblk, lblk+count) with data blocks, taking contiguous
+ * runs from the allocator. Newly allocated blocks are mapped unwritten when
+ * unwritten is set, so they read as zeroes until written; otherwise the
+ * caller is about to write them. The inode is updated in memory only.
+ */
+int alloc_file_blocks(struct inode *inode, int lblk, int count, int unwritten) {
+	ARENA_SCOPE;
+
+	if (lblk + count > MAX_FILE_BLOCKS) {
+		return -EFBIG;
+	}
+
+	int goal = 0, ret = 0;
+	int i = lblk;
+	while (i < lblk + count) {
+		int blkno = get_file_blkno(inode, i);
+		if (blkno != -1) {
+			goal = ptr_blkno(blkno) + 1;
+			i++;
+			continue;
+		}
+
+		// Step 1: Measure the run of holes starting here
+		int run = 1;
+		while (i + run < lblk + count && get_file_blkno(inode, i + run) == -1) {
+			run++;
+		}
+
+		// Step 2: Ask for a contiguous extent right after the previous block
+		int got = 0;
+		int start = get_avail_extent(goal, run, &got);
+		if (got == 0 && reclaim_wait()) { // space may be waiting on the reclaimer
+			start = get_avail_extent(goal, run, &got);
+		}
+		if (got == 0) {
+			ret = -ENOSPC;
+			break;
+		}
+
+		// Step 3: Map the extent into the file
+		for (int k = 0; k < got; k++) {
+			if ((ret = set_file_blkno(inode, i + k, unwritten ? (start + k) | UNWRITTEN_PTR : start + k)) < 0) {
+				break;
+			}
+			inode->blocks += 1;
+		}
+		if (ret < 0) {
+			break;
+		}
+		goal = start + got;
+		i += got;
+	}
+
+	return ret;
+}
+
+/*
+ * Find the next data (SEEK_DATA) or hole (SEEK_HOLE) offset at or after offset
+ */
+off_t seek_data_hole(struct inode *inode, off_t offset, int whence) {
+	if (offset < 0 || offset >= inode->size) {
+		return -ENXIO;
+	}
+
+	int last = (inode->size - 1) / BLOCK_SIZE;
+	for (int lblk = offset / BLOCK_SIZE; lblk <= last; lblk++) {
+		int mapped;
+		int slot = (lblk - DIRECT_PTRS) / PTRS_PER_BLOCK;
+		if (lblk >= DIRECT_PTRS && inode->indirect_ptr[slot] == -1) {
+			// a whole unmapped indirect block is a hole; skip it without reading
+			mapped = 0;
+			if (whence == SEEK_DATA) {
+				lblk = DIRECT_PTRS + (slot + 1) * PTRS_PER_BLOCK - 1;
+				continue;
+			}
+		} else {
+			mapped = get_file_blkno(inode, lblk) != -1;
+		}
+
+		if ((whence == SEEK_DATA && mapped) || (whence == SEEK_HOLE && !mapped)) {
+			off_t pos = (off_t)lblk * BLOCK_SIZE;
+			return pos > offset ? pos : offset;
+		}
+	}
+
+	// there is always an implicit hole at the end of the file
+	return (whence == SEEK_DATA) ? -ENXIO : inode->size;
+}
+
+/*
+ * Unmap every block at or after logical block from and collect them for the
+ * reclaimer. At most one indirect block is rewritten, so the cost does not
+ * depend on the file size. The inode is updated in memory only; the caller
+ * writes it and then passes the result to detach_commit(), so no block is
+ * freed while the inode on disk still points at it.
+ */
+struct reclaim_item *detach_file_blocks(struct inode *inode, int from) {
+	ARENA_SCOPE;
+
+	struct reclaim_item* item = malloc(sizeof(struct reclaim_item));
+	item->ndirect = 0;
+	item->nfrags = 0;
+	item->direct = malloc((DIRECT_PTRS + PTRS_PER_BLOCK) * sizeof(int32_t));
+	int32_t* ptrs = arena_alloc(BLOCK_SIZE);
+	int freed = 0;
+
+	// Step 1: Direct pointers past the cut; a packed tail gives back its
+	// fragments, which the file holds only while its size says so
+	int frags = tail_frags(inode);
+	for (int i = from; i < DIRECT_PTRS; i++) {
+		if (frags && is_frag_ptr(inode->direct_ptr[i])) {
+			item->frag_ptr = inode->direct_ptr[i];
+			item->nfrags = frags;
+			inode->direct_ptr[i] = -1;
+		} else if (inode->direct_ptr[i] != -1) {
+			item->direct[item->ndirect++] = inode->direct_ptr[i];
+			inode->direct_ptr[i] = -1;
+			freed++;
+		}
+	}
+
+	// Step 2: Indirect blocks; whole ones move to the reclaimer untouched and
+	// only the one straddling the cut is trimmed in place
+	for (int i = 0; i < INDIRECT_PTRS; i++) {
+		item->indirect[i] = -1;
+		if (inode->indirect_ptr[i] == -1) {
+			continue;
+		}
+		int base = DIRECT_PTRS + i * PTRS_PER_BLOCK;
+		if (from >= base + PTRS_PER_BLOCK) {
+			continue;
+		}
+
+		if (from == 0) { // whole file goes away, so no need to count blocks
+			item->indirect[i] = inode->indirect_ptr[i];
+			inode->indirect_ptr[i] = -1;
+			continue;
+		}
+
+		bio_read(inode->indirect_ptr[i], ptrs);
+		int start = (from > base) ? from - base : 0;
+		int kept = 0;
+		for (int k = 0; k < PTRS_PER_BLOCK; k++) {
+			if (ptrs[k] == -1) {
+				continue;
+			}
+			if (k < start) {
+				kept++;
+			} else {
+				freed++;
+				if (start == 0) {
+					continue; // the whole indirect block goes, entries included
+				}
+				item->direct[item->ndirect++] = ptrs[k];
+				ptrs[k] = -1;
+			}
+		}
+		if (start == 0) {
+			item->indirect[i] = inode->indirect_ptr[i];
+			inode->indirect_ptr[i] = -1;
+		} else {
+			bio_write(inode->indirect_ptr[i], ptrs);
+		}
+	}
+
+	inode->blocks = (from == 0) ? 0 : inode->blocks - freed;
+	return item;
+}
+
+/*
+ * Give back what detach_file_blocks() unmapped, once the inode is written
+ */
+void detach_commit(struct reclaim_item *item) {
+	if (item->nfrags > 0) {
+		release_frags(item->frag_ptr, item->nfrags);
+	}
+	reclaim_enqueue(item);
+}
+
+/*
+ * Move the partial last block of a small regular file into fragments of a
+ * shared block. Files with preallocated blocks past the end, or whose tail
+ * would need a whole block anyway, are left alone. Writes the inode back.
+ */
+int tail_pack(struct inode *inode) {
+	ARENA_SCOPE;
+
+	// Step 1: Only a mapped, partial last block held by a direct pointer
+	if (!S_ISREG(inode->mode) || inode->size == 0 || inode->size > DIRECT_PTRS * BLOCK_SIZE) {
+		return 0;
+	}
+	int lblk = (inode->size - 1) / BLOCK_SIZE;
+	int blkno = inode->direct_ptr[lblk];
+	int bytes = inode->size - lblk * BLOCK_SIZE;
+	int count = (bytes + FRAG_SIZE - 1) / FRAG_SIZE;
+	if (blkno == -1 || is_frag_ptr(blkno) || count == FRAGS_PER_BLOCK) {
+		return 0;
+	}
+	for (int i = lblk + 1; i < DIRECT_PTRS; i++) {
+		if (inode->direct_ptr[i] != -1) {
+			return 0;
+		}
+	}
+	for (int i = 0; i < INDIRECT_PTRS; i++) {
+		if (inode->indirect_ptr[i] != -1) {
+			return 0;
+		}
+	}
+
+	// Step 2: Copy the tail into its fragments. The shared block is patched
+	// under frag_lock, or a tail packed next to this one could be lost.
+	unsigned char* data = arena_zalloc(BLOCK_SIZE);
+	unsigned char* block = arena_alloc(BLOCK_SIZE);
+	if (is_unwritten_ptr(blkno)) { // never written, so the tail is all zeroes
+		blkno = ptr_blkno(blkno);
+	} else {
+		bio_read(blkno, data);
+		memset(data + bytes, 0, BLOCK_SIZE - bytes);
+	}
+	int32_t frag = get_avail_frags(count);
+	if (frag < 0) {
+		return frag;
+	}
+	bio_read(frag_blkno(frag), block);
+	memcpy(block + frag_slot(frag) * FRAG_SIZE, data, count * FRAG_SIZE);
+	bio_write(frag_blkno(frag), block);
+	pthread_mutex_unlock(&frag_lock);
+
+	// Step 3: Point the inode at the fragments before the block goes
+	inode->direct_ptr[lblk] = frag;
+	inode->blocks -= 1;
+	writei(inode->ino, inode);
+	release_blkno(blkno);
+	stats_count(CTR_TAIL_PACK, 1);
+	return 0;
+}
+
+/*
+ * Give a packed tail a block of its own again, next to the block before it
+ * when possible. Writes the inode back.
+ */
+int tail_unpack(struct inode *inode) {
+	ARENA_SCOPE;
+
+	int count = tail_frags(inode);
+	if (count == 0) {
+		return 0;
+	}
+	int lblk = (inode->size - 1) / BLOCK_SIZE;
+	int32_t frag = inode->direct_ptr[lblk];
+
+	// Step 1: Allocate the block
+	int goal = (lblk > 0 && inode->direct_ptr[lblk - 1] != -1) ? inode->direct_ptr[lblk - 1] + 1 : 0;
+	int got = 0;
+	int blkno = get_avail_extent(goal, 1, &got);
+	if (got == 0 && reclaim_wait()) {
+		blkno = get_avail_extent(goal, 1, &got);
+	}
+	if (got == 0) {
+		return -ENOSPC;
+	}
+
+	// Step 2: Copy the fragments out, zero filled to a whole block
+	unsigned char* block = arena_alloc(BLOCK_SIZE);
+	unsigned char* data = arena_zalloc(BLOCK_SIZE);
+	pthread_mutex_lock(&frag_lock);
+	bio_read(frag_blkno(frag), block);
+	pthread_mutex_unlock(&frag_lock);
+	memcpy(data, block + frag_slot(frag) * FRAG_SIZE, count * FRAG_SIZE);
+	bio_write(blkno, data);
+
+	// Step 3: Point the inode at the block before the fragments go
+	inode->direct_ptr[lblk] = blkno;
+	inode->blocks += 1;
+	writei(inode->ino, inode);
+	release_frags(frag, count);
+	stats_count(CTR_TAIL_UNPACK, 1);
 	return 0;
 }
 
@@ -116,12 +1286,15 @@ int writei(uint16_t ino, struct inode *inode) {
 /* 
  * directory operations
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+static int dir_scan(uint16_t ino, const char *fname, struct dirent *dirent) {
+	ARENA_SCOPE;
+
 	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	index_node* curr_dir = (index_node*)malloc(sizeof(index_node));
+	index_node* curr_dir = (index_node*)arena_alloc(sizeof(index_node));
 	readi(ino, curr_dir);
 
 	// Step 2: Get data block of current directory from inode
+	direntry* data_block = arena_alloc(BLOCK_SIZE);
 	for (int i = 0; i < 16; i++) { // looping thru direct_ptrs
 		/** 
 		 * blocks before were all full of dirents that DID NOT contain fname,
@@ -129,13 +1302,10 @@ int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *di
 		 * So the fname is not in this directory.
 		*/ 
 		if (curr_dir->direct_ptr[i] == -1) { 
-			free(curr_dir);
-
 			return 0; 
 		}
 		
 		int data_block_num = curr_dir->direct_ptr[i];
-		direntry* data_block = malloc(BLOCK_SIZE);
 		bio_read(data_block_num, data_block);
 
 		// Step 3: Read directory's data block and check each directory entry.
@@ -145,19 +1315,11 @@ int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *di
 		for (; ptr < end && ptr->valid != INVALID; ptr = ptr + 1) {
 			if (strcmp(fname, ptr->name) == 0) { 
 				memcpy(dirent, ptr, sizeof(direntry));
-				
-				free(data_block);
-				free(curr_dir);
-
 				return 1; // success			
 			}
 		}
 
 		if (ptr < end  && ptr->valid == INVALID) { 
-
-			free(data_block);
-			free(curr_dir);
-
 			return 0; // failure
 		}
 	}
@@ -165,7 +1327,29 @@ int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *di
 	return 0; // user allocated 256 dirents in this inode and none of them equal fname :D
 }
 
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+	TRACE_SCOPE(EV_DIR_FIND, ino);
+
+	if (ro_mount) {
+		return ro_find(ino, fname, dirent);
+	}
+
+	// Misses are cached too, so creating a new name costs one scan, not two
+	int len = cache_lookup(CACHE_DENTRY, ino, fname, dirent, sizeof(direntry));
+	if (len >= 0) {
+		return len > 0;
+	}
+	pthread_rwlock_rdlock(&dir_locks[ino % DIR_LOCKS]);
+	int found = dir_scan(ino, fname, dirent);
+	cache_insert(CACHE_DENTRY, ino, fname, dirent, found ? sizeof(direntry) : 0);
+	pthread_rwlock_unlock(&dir_locks[ino % DIR_LOCKS]);
+	return found;
+}
+
 int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t name_len) { // assumes caller method knows if f_ino is for file or directory
+	ARENA_SCOPE;
+
+	direntry* data_block = arena_alloc(BLOCK_SIZE);
 	int i = 0;
 	for (; i < 16; i++) { // go thru all dir pointers
 		if (dir_inode->direct_ptr[i] == -1) {
@@ -173,7 +1357,6 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 		}
 		// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
 		int data_block_num = dir_inode->direct_ptr[i];
-		direntry* data_block = malloc(BLOCK_SIZE);
 		bio_read(data_block_num, data_block);
 		
 		// Step 2: Check if fname (directory name) is already used in other entries
@@ -182,7 +1365,6 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 		int count = 0;
 		for (int k = 0; k < MAX_DIRENTS && ptr->valid != INVALID; k++) {
 			if (strcmp(fname, ptr->name) == 0) {
-				free(data_block);
 				return 0;
 			}
 			count++;
@@ -199,21 +1381,28 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 			ptr->name[name_len] = '\0';
 			ptr->len = name_len;
 			// Write directory entry
+			pthread_rwlock_wrlock(&dir_locks[dir_inode->ino % DIR_LOCKS]);
 			bio_write(data_block_num, data_block);
-			free(data_block);
+			cache_invalidate(CACHE_DENTRY, dir_inode->ino, ptr->name);
+			pthread_rwlock_unlock(&dir_locks[dir_inode->ino % DIR_LOCKS]);
 
 			return 1;
 		}
-		free(data_block);
 	}
 
 	// Step 3: Add directory entry in dir_inode's data block and write to disk
 	if (i<16) { // only runs if bro is assigning a 17th or higher file in this directory
 		// Allocate a new data block for this directory if it does not exist
 		int new_block_num = get_avail_blkno();
+		if (new_block_num == 0 && reclaim_wait()) {
+			new_block_num = get_avail_blkno();
+		}
+		if (new_block_num == 0) {
+			return -ENOSPC;
+		}
 		// dir_inode->direct_ptr[i] = new_block_num;
 
-		direntry* new_block = (direntry*)calloc(1, BLOCK_SIZE);
+		direntry* new_block = (direntry*)arena_zalloc(BLOCK_SIZE);
 
 		new_block->ino = f_ino;
 		new_block->valid = VALID;
@@ -223,14 +1412,16 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 
 		// Update directory inode
 		dir_inode->direct_ptr[i] = new_block_num;
-		dir_inode->size += 1;
-		dir_inode->vstat.st_size += BLOCK_SIZE;
+		dir_inode->blocks += 1;
+		dir_inode->size += BLOCK_SIZE;
+		dir_inode->mtime = time(NULL);
 
 		// Write directory entry
+		pthread_rwlock_wrlock(&dir_locks[dir_inode->ino % DIR_LOCKS]);
 		bio_write(new_block_num, new_block);
 		writei(dir_inode->ino, dir_inode);
-
-		free(new_block);
+		cache_invalidate(CACHE_DENTRY, dir_inode->ino, new_block->name);
+		pthread_rwlock_unlock(&dir_locks[dir_inode->ino % DIR_LOCKS]);
 
 		return 1;
 	}
@@ -239,20 +1430,73 @@ int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t n
 }
 
 int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+	ARENA_SCOPE;
+
+	direntry* data_block = arena_alloc(BLOCK_SIZE);
+	int found_blk = -1, found_slot = -1;
+	int last_blk = -1, last_slot = -1;
+	int read_blk = -1;
+
+	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode.
+	// Entries are kept packed, so the scan ends at the first free slot.
+	for (int i = 0; i < DIRECT_PTRS && dir_inode.direct_ptr[i] != -1; i++) {
+		bio_read(dir_inode.direct_ptr[i], data_block);
+		read_blk = i;
+		int k = 0;
+		for (; k < MAX_DIRENTS && data_block[k].valid != INVALID; k++) {
+			// Step 2: Check if fname exist
+			if (found_blk == -1 && strcmp(fname, data_block[k].name) == 0) {
+				found_blk = i;
+				found_slot = k;
+			}
+		}
+		if (k > 0) {
+			last_blk = i;
+			last_slot = k - 1;
+		}
+		if (k < MAX_DIRENTS) {
+			break;
+		}
+	}
 
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
+	if (found_blk == -1) {
+		return 0;
+	}
 
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
+	// Step 3: If exist, then remove it from dir_inode's data block and write to disk.
+	// The last entry of the directory moves into the hole to keep entries packed.
+	// Across two blocks it is written to its new slot before its old one is
+	// cleared, so a crash in between leaves it twice rather than not at all.
+	if (read_blk != last_blk) { // the scan ended on an empty trailing block
+		bio_read(dir_inode.direct_ptr[last_blk], data_block);
+	}
+	direntry last = data_block[last_slot];
+	pthread_rwlock_wrlock(&dir_locks[dir_inode.ino % DIR_LOCKS]);
+	if (found_blk != last_blk) {
+		direntry* found_block = arena_alloc(BLOCK_SIZE);
+		bio_read(dir_inode.direct_ptr[found_blk], found_block);
+		found_block[found_slot] = last;
+		bio_write(dir_inode.direct_ptr[found_blk], found_block);
+	} else if (found_slot != last_slot) {
+		data_block[found_slot] = last;
+	}
+	memset(&data_block[last_slot], 0, sizeof(direntry));
+	bio_write(dir_inode.direct_ptr[last_blk], data_block);
 
-	return 0;
+	// Step 4: Drop the cached names of the removed entry and the moved one
+	cache_invalidate(CACHE_DENTRY, dir_inode.ino, fname);
+	cache_invalidate(CACHE_DENTRY, dir_inode.ino, last.name);
+	pthread_rwlock_unlock(&dir_locks[dir_inode.ino % DIR_LOCKS]);
+	return 1;
 }
 
 /* 
  * namei operation
  */
 int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	TRACE_SCOPE(EV_GET_NODE_BY_PATH, ino);
+	ARENA_SCOPE;
+
 	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
 	// Note: You could either implement it in a iterative way or recursive way
 
@@ -275,31 +1519,23 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
 	}
 
 
-	char* dir_entry_name = (char*) malloc(index+1);
+	char* dir_entry_name = (char*) arena_alloc(index+1);
 	memcpy(dir_entry_name, ptr, index);
 	dir_entry_name[index] = '\0';
 
 	
 
-	unsigned char * dir_entry = malloc(sizeof(direntry));
+	unsigned char * dir_entry = arena_alloc(sizeof(direntry));
 	//direntry* dir_entry = (direntry*) malloc(256);
 
 	if (dir_find(ino, dir_entry_name, 0, ((direntry*)dir_entry)) == 0) { // dirent was not found
-		free(dir_entry_name);
-		free(dir_entry);
 		return -1; // failure
 	} else {
 		int node_ino = ((direntry*)dir_entry)->ino;
 		if ((ptr + index)[0] == '\0') { // Reached terminal point	
 			readi(node_ino, inode);
-			free(dir_entry);
-			free(dir_entry_name);
-
 			return 0; // success
 		} else {
-			free(dir_entry);
-			free(dir_entry_name);
-
 			return get_node_by_path(ptr+index, node_ino, inode);
 		}
 	}
@@ -329,6 +1565,8 @@ int rufs_mkfs() {
 	int total_bytes = (sizeof(index_node)*(supahblock->max_inum));
 	int total_inode_blocks = (total_bytes % BLOCK_SIZE == 0) ? (total_bytes/BLOCK_SIZE) : (total_bytes/BLOCK_SIZE) + 1;
 	supahblock->d_start_blk = supahblock->i_start_blk + total_inode_blocks;
+	supahblock->nstripes = dev_stripes();
+	supahblock->stripe_blocks = dev_stripe_blocks();
 
 	// initialize inode bitmap
 	bitmap_t inode_bitmap = calloc(1, BLOCK_SIZE); // "For completition purposes"
@@ -343,8 +1581,13 @@ int rufs_mkfs() {
 	index_node* root_dir = (index_node*)calloc(1, BLOCK_SIZE);
 	root_dir->ino = 0;
 	root_dir->valid = VALID;
-	root_dir->size = 1; // because it will have 1 block at the start
+	root_dir->version = INODE_VERSION;
+	root_dir->blocks = 1; // because it will have 1 block at the start
+	root_dir->size = BLOCK_SIZE;
 	root_dir->link = 2;
+	root_dir->uid = getuid();
+	root_dir->gid = getgid();
+	root_dir->mtime = root_dir->ctime = time(NULL);
 	for (int i = 0; i < 16; i++) { 
 		root_dir->direct_ptr[i] = -1; 
 	} // setting all direct pointers to invalid
@@ -356,8 +1599,7 @@ int rufs_mkfs() {
 	root_dirents->ino = 0; 
 
 	root_dir->direct_ptr[0] = supahblock->d_start_blk;
-	root_dir->vstat.st_mode = 0755 | __S_IFDIR;
-	root_dir->vstat.st_size = BLOCK_SIZE;
+	root_dir->mode = 0755 | __S_IFDIR;
 
 	set_bitmap(dblock_bitmap, 0);
 	set_bitmap(dblock_bitmap, supahblock->i_bitmap_blk);
@@ -368,6 +1610,14 @@ int rufs_mkfs() {
 	}
 
 	set_bitmap(dblock_bitmap, supahblock->d_start_blk); // setting 67th block
+
+	// only the root's inode block is written; the rest of the inode table is
+	// zeroed on first use, so mkfs cost does not grow with the image
+	supahblock->flags = SB_LAZY_ITABLE;
+	supahblock->state = SB_CLEAN;
+	supahblock->itable_init = 1;
+	supahblock->free_inodes = supahblock->max_inum - 1;
+	supahblock->free_blocks = supahblock->max_dnum - (supahblock->d_start_blk + 1);
 	
 	bio_write(0, supahblock);
 	bio_write(supahblock->i_bitmap_blk, inode_bitmap);
@@ -402,116 +1652,251 @@ static void *rufs_init(struct fuse_conn_info *conn) {
 
   // Step 1b: If disk file is found, just initialize in-memory data structures
   // and read superblock from disk
-	superblock = (sb*)malloc(BLOCK_SIZE);
+	superblock = (sb*)aligned_alloc(BLOCK_SIZE, BLOCK_SIZE);
 	bio_read(0, superblock);
 
-	// bitmap_t inode_bitmap = (unsigned char*)malloc(BLOCK_SIZE);
-	// bio_read(superblock->i_bitmap_blk, inode_bitmap);
+	// Step 1c: An image in another format would be read as garbage
+	if (superblock->magic_num != MAGIC_NUM) {
+		fprintf(stderr, "rufs: %s is not a rufs image of this version (magic 0x%x, expected 0x%x)\n",
+			diskfile_path, superblock->magic_num, MAGIC_NUM);
+		exit(EXIT_FAILURE);
+	}
 
-	// bitmap_t data_bitmap = (unsigned char*)malloc(BLOCK_SIZE);
-	// bio_read(superblock->d_bitmap_blk, data_bitmap);
+	// Step 1d: Block 0 sits at the start of the first backing file whatever
+	// the striping, so the superblock says how the rest is laid out
+	int nstripes = superblock->nstripes ? superblock->nstripes : 1;
+	if (nstripes != dev_stripes()) {
+		fprintf(stderr, "rufs: image is striped over %d backing files, %d given\n", nstripes, dev_stripes());
+		exit(EXIT_FAILURE);
+	}
+	if (dev_set_stripe(superblock->stripe_blocks) < 0) {
+		exit(EXIT_FAILURE);
+	}
+	record_start();
+
+	// Step 1e: A finalized image is served from memory and never written,
+	// so none of the write-path machinery below is needed
+	if (superblock->flags & SB_READONLY) {
+		if (ro_load() < 0) {
+			fprintf(stderr, "rufs: cannot load the read-only image\n");
+			exit(EXIT_FAILURE);
+		}
+		dev_readonly();
+		ro_mount = 1;
+		return NULL;
+	}
+	cache_init();
+
+	// Step 2: Bitmaps are loaded a segment at a time on first use
+	bitmap_open(&inode_map, superblock->i_bitmap_blk, superblock->max_inum);
+	bitmap_open(&data_map, superblock->d_bitmap_blk, superblock->max_dnum);
+	if (superblock->frag_map_blk != 0) {
+		bitmap_open(&frag_map, superblock->frag_map_blk, superblock->max_dnum * FRAGS_PER_BLOCK);
+	}
+	memset(frag_hint, 0, sizeof(frag_hint));
+
+	// Step 3: Images made before lazy mkfs have a fully written inode table,
+	// and the free counts can only be trusted after a clean unmount
+	if (!(superblock->flags & SB_LAZY_ITABLE)) {
+		superblock->flags |= SB_LAZY_ITABLE;
+		superblock->itable_init = superblock->d_start_blk - superblock->i_start_blk;
+	}
+	if (!(superblock->state & SB_CLEAN)) {
+		superblock->free_inodes = bitmap_count_free(&inode_map);
+		superblock->free_blocks = bitmap_count_free(&data_map);
+	}
+	superblock->state &= ~SB_CLEAN;
+	bio_write(0, superblock);
+
+	reclaim_start();
+	warm_start();
+	dispatch_start();
 	
 	return NULL;
 }
 
 static void rufs_destroy(void *userdata) {
+	record_stop();
+	if (ro_mount) { // nothing was started and there is nothing to write
+		ro_unload();
+		free(superblock);
+		dev_close();
+		return;
+	}
 
-	// Step 1: De-allocate in-memory data structures
+	// Step 1: Let the reclaimer finish, save the hot blocks for the next mount,
+	// then record that the free counts are exact
+	dispatch_stop();
+	warm_stop();
+	reclaim_stop();
+	warm_save();
+	dev_flush();
+	superblock->state |= SB_CLEAN;
+	bio_write(0, superblock);
+
+	// Step 2: De-allocate in-memory data structures
+	bitmap_close(&inode_map);
+	bitmap_close(&data_map);
+	bitmap_close(&frag_map);
+	extent_close(&data_free);
 	free(superblock);
 
-	// Step 2: Close diskfile
+	// Step 3: Close diskfile
+	cache_destroy();
 	dev_close();
 
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) { // Sibi // initializes an inode's vstat
+/*
+ * The read-only stats tree at /.rufs is synthesized and never touches disk
+ */
+static int is_stats_path(const char *path) {
+	size_t n = strlen(STATS_DIR);
+	return strncmp(path, STATS_DIR, n) == 0 && (path[n] == '\0' || path[n] == '/');
+}
+
+static int stats_getattr(const char *path, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_uid = getuid();
+	stbuf->st_gid = getgid();
+	if (strcmp(path, STATS_DIR) == 0) {
+		stbuf->st_mode = __S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	if (strcmp(path, STATS_FILE) == 0) {
+		stbuf->st_mode = __S_IFREG | 0444;	// size stays 0; reads use direct_io
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+#ifdef RUFS_TRACE
+	if (strcmp(path, TRACE_FILE) == 0) {
+		stbuf->st_mode = __S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		return 0;
+	}
+#endif
+	return -ENOENT;
+}
+
+/*
+ * Files under /.rufs are rendered once at open, so a reader sees one
+ * consistent snapshot however it chunks its reads
+ */
+struct snapshot {
+	char*	data;
+	size_t	len;
+};
+
+static struct snapshot *stats_snapshot(const char *path) {
+	struct snapshot* snap = malloc(sizeof(struct snapshot));
+#ifdef RUFS_TRACE
+	if (strcmp(path, TRACE_FILE) == 0) {
+		snap->data = trace_render(&snap->len);
+		return snap;
+	}
+#endif
+	size_t cap = 256 * 1024;
+	snap->data = malloc(cap);
+	snap->len = stats_render(snap->data, cap);
+	snap->len += cache_render(snap->data + snap->len, cap - snap->len);
+	snap->len += dispatch_render(snap->data + snap->len, cap - snap->len);
+	snap->len += log_render(snap->data + snap->len, cap - snap->len);
+	pthread_mutex_lock(&bitmap_lock);
+	if (snap->len < cap) {
+		int start;
+		snap->len += snprintf(snap->data + snap->len, cap - snap->len, "rufs_free_extent_max_blocks %d\n",
+			data_map.nbits ? extent_largest(data_index(), &start) : 0);
+	}
+	pthread_mutex_unlock(&bitmap_lock);
+	if (snap->len > cap) {
+		snap->len = cap;
+	}
+	return snap;
+}
+
+static int rufs_getattr(const char *path, struct stat *stbuf) { // Sibi
+	if (is_stats_path(path)) {
+		return stats_getattr(path, stbuf);
+	}
+
 	// Step 1: call get_node_by_path() to get inode from path
-	index_node * inode = (index_node*)malloc(sizeof(index_node));
-	int bruh = get_node_by_path(path, 0, inode);
-	// direntry* dd = (direntry*)malloc(BLOCK_SIZE);
-	// bio_read(inode->direct_ptr[0], dd);
-	
-	if (bruh == -1) {
-		free(inode);
+	index_node * inode = (index_node*)arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, inode) == -1) {
 		return -ENOENT;
 	}
 
-	stbuf->st_gid = getgid();
-	stbuf->st_uid = getuid();
-
 	// Step 2: fill attribute of file into stbuf from inode
-	if (strcmp(path, "/") == 0 || dir_var == 1) {
-		dir_var = 0;
-		stbuf->st_mode   = (inode->vstat.st_mode) | __S_IFDIR;
-		stbuf->st_nlink  = 2;
-		inode->link = 1;
-	} else {
-		stbuf->st_mode = __S_IFREG | 0644;
-		stbuf->st_nlink  = 1;
-		index_node * directory_node = (index_node*)malloc(sizeof(index_node));
-		get_node_by_path(dirname((char*) path), 0, directory_node);
-		directory_node->link += 1;
-		directory_node->vstat.st_nlink += 1;
-		time(&(directory_node->vstat.st_mtime));
-		time(&(directory_node->vstat.st_atime));
-		writei(directory_node->ino, directory_node);
-		free(directory_node);
-	}
-	
-	stbuf->st_ino = inode->ino;
-	stbuf->st_size = (inode->size)*BLOCK_SIZE;
-	time(&stbuf->st_mtime);
-	time(&stbuf->st_atime);
+	inode_to_stat(inode, stbuf);
 
-	*stbuf = inode->vstat;
-	
-	free(inode);
 	return 0;
 }
 
 static int rufs_opendir(const char *path, struct fuse_file_info *fi) { // Rahul
+	if (strcmp(path, STATS_DIR) == 0) {
+		return 0;
+	}
 
 	// Step 1: Call get_node_by_path() to get inode from path
-	index_node * in = (index_node*)malloc(sizeof(index_node));
+	index_node * in = (index_node*)arena_alloc(sizeof(index_node));
 
 	// Step 2: If not find, return -1
 	int val = get_node_by_path(path, 0, in);
-	free(in);
     return val;
 }
 
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) { // Rahul
+	if (strcmp(path, STATS_DIR) == 0) {
+		struct stat st;
+		stats_getattr(STATS_FILE, &st);
+		filler(buffer, STATS_FILE + strlen(STATS_DIR) + 1, &st, 0);
+#ifdef RUFS_TRACE
+		filler(buffer, TRACE_FILE + strlen(STATS_DIR) + 1, &st, 0);
+#endif
+		return 0;
+	}
 
 	// Step 1: Call get_node_by_path() to get inode from path
-	index_node * in = (index_node*)malloc(sizeof(index_node));
+	index_node * in = (index_node*)arena_alloc(sizeof(index_node));
     get_node_by_path(path, 0, in);
 
 	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	for(int i = 0; i < in->size; i++){
-		direntry * b = malloc(BLOCK_SIZE);
-		bio_read(in->direct_ptr[i], b);
-		direntry* a = b;
+	direntry * b = arena_alloc(BLOCK_SIZE);
+	index_node * bruh = arena_alloc(sizeof(index_node));
+	for(int i = 0; i < in->blocks; i++){
+		const direntry* a = b;
+		if (ro_mount) {
+			if ((a = ro_dirent(in, i * MAX_DIRENTS)) == NULL) {
+				break;
+			}
+		} else {
+			bio_read(in->direct_ptr[i], b);
+		}
 		for(int j = 0; j < MAX_DIRENTS && a->valid != INVALID; j++){
-			index_node * bruh = malloc(sizeof(index_node));
+			struct stat st;
 			readi(a->ino, bruh);
-			filler(buffer, a->name, &(bruh->vstat), offset);
+			inode_to_stat(bruh, &st);
+			filler(buffer, a->name, &st, offset);
 			a += 1;
-			free(bruh);
 		}
-		free(b);
 		// memcpy(buffer + (i * BLOCK_SIZE), copythebastard, BLOCK_SIZE);
 	}
 
-	free(in);
-
 	return 0;
 }
 
 
 static int rufs_mkdir(const char *path, mode_t mode) { // Sibi
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
+
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char* p1 = (char*) malloc(strlen(path)+1);
-	char* p2 = (char*) malloc(strlen(path)+1);
+	char* p1 = (char*) arena_alloc(strlen(path)+1);
+	char* p2 = (char*) arena_alloc(strlen(path)+1);
 	memcpy(p1, path, strlen(path)+1);
 	p1[strlen(path)] = '\0';
 	memcpy(p2, path, strlen(path)+1);
@@ -520,75 +1905,123 @@ static int rufs_mkdir(const char *path, mode_t mode) { // Sibi
 	char* base = basename(p2);
 
 	// Step 2: Call get_node_by_path() to get inode of parent directory
-	index_node * dir_inode = (index_node*) malloc(sizeof(index_node));
+	index_node * dir_inode = (index_node*) arena_alloc(sizeof(index_node));
 	int a = get_node_by_path(parent_directory, 0, dir_inode);
 	if (a == -1) {
-		free(dir_inode);
-		free(p1);
-		free(p2);
 		return -ENOENT;
 	}
 
-	// Step 3: Call get_avail_ino() to get an available inode number
+	// Step 3: Call get_avail_ino() and get_avail_blkno() to get an inode
+	// number and the directory's first block before the name shows up
 	int ino = get_avail_ino();
+	if (ino == 0) {
+		return -ENOSPC;
+	}
+	int blkno = get_avail_blkno();
+	if (blkno == 0 && reclaim_wait()) {
+		blkno = get_avail_blkno();
+	}
+	if (blkno == 0) {
+		release_ino(ino);
+		return -ENOSPC;
+	}
 
 	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
 	int b = dir_add(dir_inode, ino, base, strlen(base));
-	if (b == 0) {
-		free(dir_inode);
-		free(p1);
-		free(p2);
-		return -EIO;
+	if (b <= 0) {
+		release_blkno(blkno);
+		release_ino(ino);
+		return b < 0 ? b : -EIO;
 	}
-	if (strcmp(parent_directory, "/files") == 0) {
-		direntry* bruhh = malloc(BLOCK_SIZE);
-		bio_read(dir_inode->direct_ptr[0], bruhh);
-	}
-	
-
-	// Step 5: Update inode for target directory
-	index_node* target_node = (index_node*)malloc(sizeof(index_node));
-	target_node->direct_ptr[0] = get_avail_blkno();
+	dir_inode->link += 1; // the new directory's ".." refers to the parent
+	writei(dir_inode->ino, dir_inode);
 
+	// Step 5: Update inode for target directory. Its block may have belonged
+	// to a removed file, so it must start out empty.
+	index_node* target_node = (index_node*)arena_alloc(sizeof(index_node));
+	target_node->direct_ptr[0] = blkno;
+	direntry* dirents = (direntry*) arena_zalloc(BLOCK_SIZE);
+	bio_write(target_node->direct_ptr[0], dirents);
 
 	for (int i = 1; i < 16; i++) { target_node->direct_ptr[i] = -1; }
+	for (int i = 0; i < 8; i++) { target_node->indirect_ptr[i] = -1; }
 	target_node->ino = ino;
-	target_node->size = 1;
-	target_node->link = 1;
-	target_node->type = 1;
 	target_node->valid = VALID;
-	target_node->vstat.st_gid = getgid();
-	target_node->vstat.st_uid = getuid();
-	target_node->vstat.st_size = BLOCK_SIZE*target_node->size;
-	target_node->vstat.st_mode = mode | __S_IFDIR;
-	target_node->vstat.st_nlink = 1;
-	// time(&(target_node->vstat.st_atime));
-    // time(&(target_node->vstat.st_mtime));
-	//direntry* dirents = (direntry*) malloc(BLOCK_SIZE);
-
-	//bio_write(target_node->direct_ptr[0], dirents);
+	target_node->version = INODE_VERSION;
+	target_node->blocks = 1;
+	target_node->size = BLOCK_SIZE*target_node->blocks;
+	target_node->link = 2;
+	target_node->gid = getgid();
+	target_node->uid = getuid();
+	target_node->mode = mode | __S_IFDIR;
+	target_node->mtime = target_node->ctime = time(NULL);
 	// Step 6: Call writei() to write inode to disk
 	writei(ino, target_node);
-	free(target_node);
-	dir_var = 1;
 	return 0;
 }
 
 static int rufs_rmdir(const char *path) {
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
+	if (strcmp(path, "/") == 0) {
+		return -EBUSY;
+	}
+	char* p1 = arena_strdup(path);
+	char* p2 = arena_strdup(path);
+	char* parent_directory = dirname(p1);
+	char* base = basename(p2);
 
 	// Step 2: Call get_node_by_path() to get inode of target directory
-
-	// Step 3: Clear data block bitmap of target directory
-
-	// Step 4: Clear inode bitmap and its data block
+	index_node * target = (index_node*) arena_alloc(sizeof(index_node));
+	index_node * dir_inode = (index_node*) arena_alloc(sizeof(index_node));
+	int ret = 0;
+	if (get_node_by_path(path, 0, target) == -1) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (!S_ISDIR(target->mode)) {
+		ret = -ENOTDIR;
+		goto out;
+	}
+	direntry* first = arena_alloc(BLOCK_SIZE);
+	bio_read(target->direct_ptr[0], first);
+	int empty = first->valid == INVALID; // entries are packed, so slot 0 tells
+	if (!empty) {
+		ret = -ENOTEMPTY;
+		goto out;
+	}
 
 	// Step 5: Call get_node_by_path() to get inode of parent directory
+	get_node_by_path(parent_directory, 0, dir_inode);
 
 	// Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-
-	return 0;
+	if (dir_remove(*dir_inode, base, strlen(base)) == 0) {
+		ret = -ENOENT;
+		goto out;
+	}
+	dir_inode->link -= 1;
+	dir_inode->mtime = dir_inode->ctime = time(NULL);
+	writei(dir_inode->ino, dir_inode);
+
+	// Step 3: Unmap the directory's data blocks
+	struct reclaim_item* detached = detach_file_blocks(target, 0);
+
+	// Step 4: Clear the inode, then hand the blocks to the reclaimer and
+	// free the inode number
+	target->valid = INVALID;
+	target->link = 0;
+	writei(target->ino, target);
+	detach_commit(detached);
+	release_ino(target->ino);
+
+out:
+	return ret;
 }
 
 static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -598,9 +2031,16 @@ static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
 }
 
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) { // Sibi // needs to call getattr?
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
+
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char* p1 = (char*) malloc(strlen(path));
-	char* p2 = (char*) malloc(strlen(path));
+	char* p1 = (char*) arena_alloc(strlen(path)+1);
+	char* p2 = (char*) arena_alloc(strlen(path)+1);
 	memcpy(p1, path, strlen(path)+1);
 	p1[strlen(path)] = '\0';
 	memcpy(p2, path, strlen(path)+1);
@@ -609,180 +2049,741 @@ static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	char* base = basename(p2);
 
 	// Step 2: Call get_node_by_path() to get inode of parent directory
-	index_node * dir_inode = (index_node*) malloc(sizeof(index_node));
+	index_node * dir_inode = (index_node*) arena_alloc(sizeof(index_node));
 	int a = get_node_by_path(parent_directory, 0, dir_inode);
 	if (a == -1) {
-		free(dir_inode);
-		free(p1);
-		free(p2);
 		return -ENOENT;
 	}
 
 	// Step 3: Call get_avail_ino() to get an available inode number
 	int ino = get_avail_ino();
+	if (ino == 0) {
+		return -ENOSPC;
+	}
 
 	// Step 4: Call dir_add() to add directory entry of target file to parent directory
 	
 	int b = dir_add(dir_inode, ino, base, strlen(base));
-	if (b == 0) {
-		free(dir_inode);
-		free(p1);
-		free(p2);
-		return -EIO;
+	if (b <= 0) {
+		release_ino(ino);
+		return b < 0 ? b : -EIO;
 	}
 
 	// Step 5: Update inode for target file
-	index_node* target_node = (index_node*)malloc(sizeof(index_node));
-	target_node->direct_ptr[0] = get_avail_blkno();
-	for (int i = 1; i < 16; i++) { target_node->direct_ptr[i] = -1; }
+	index_node* target_node = (index_node*)arena_alloc(sizeof(index_node));
+	for (int i = 0; i < 16; i++) { target_node->direct_ptr[i] = -1; } // files start out as one big hole
+	for (int i = 0; i < 8; i++) { target_node->indirect_ptr[i] = -1; }
 	target_node->ino = ino;
-	target_node->size = 1;
-	target_node->link = 1;
 	target_node->valid = VALID;
-	target_node->vstat.st_gid = getgid();
-	target_node->vstat.st_uid = getuid();
-	target_node->vstat.st_size = BLOCK_SIZE*target_node->size;
-	target_node->vstat.st_mode = mode;
-	target_node->vstat.st_nlink = 1;
-	time(&(target_node->vstat.st_atime));
-    time(&(target_node->vstat.st_mtime));
+	target_node->version = INODE_VERSION;
+	target_node->blocks = 0;
+	target_node->size = 0;
+	target_node->link = 1;
+	target_node->gid = getgid();
+	target_node->uid = getuid();
+	target_node->mode = mode;
+	target_node->mtime = target_node->ctime = time(NULL);
 	
 	// Step 6: Call writei() to write inode to disk
 	writei(ino, target_node);
-	free(target_node);
 
 	return 0;
 }
 
 static int rufs_open(const char *path, struct fuse_file_info *fi) { // Sibi
+	if (is_stats_path(path)) {
+		if (fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY) {
+			return -EACCES;
+		}
+		struct stat st;
+		if (stats_getattr(path, &st) < 0) {
+			return -ENOENT;
+		}
+		if (S_ISDIR(st.st_mode)) {
+			return -EISDIR;
+		}
+		if (fi != NULL) {
+			fi->direct_io = 1; // the file has no fixed size, so bypass the page cache
+			fi->fh = (uint64_t)(uintptr_t)stats_snapshot(path);
+		}
+		return 0;
+	}
+
+	if (ro_mount && fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		return -EROFS;
+	}
 
 	// Step 1: Call get_node_by_path() to get inode from path
-	index_node * in = (index_node*)malloc(sizeof(index_node));
+	index_node * in = (index_node*)arena_alloc(sizeof(index_node));
 
-	// Step 2: If not find, return -1
+	// Step 2: If not find, return -ENOENT
 	int val = get_node_by_path(path, 0, in);
-	free(in);
-    return val;
+    return val == -1 ? -ENOENT : 0;
+}
+
+static int stats_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct snapshot* snap = (fi != NULL && fi->fh) ? (struct snapshot*)(uintptr_t)fi->fh : stats_snapshot(path);
+	int n = 0;
+	if (offset < snap->len) {
+		n = (snap->len - offset < size) ? snap->len - offset : size;
+		memcpy(buffer, snap->data + offset, n);
+	}
+	if (fi == NULL || !fi->fh) {
+		free(snap->data);
+		free(snap);
+	}
+	return n;
+}
+
+/*
+ * Reads on a read-only image go around the block cache and its lock. Each
+ * run of whole blocks that sit next to each other on disk, which mkrufs
+ * makes of every file, is a single read straight into the caller's buffer.
+ */
+static int ro_read(index_node *in, char *buffer, size_t size, off_t offset) {
+	unsigned char* blocko = arena_alloc(BLOCK_SIZE);
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		int lblk = pos / BLOCK_SIZE, boff = pos % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if (n > size - done) {
+			n = size - done;
+		}
+
+		int ret = 0;
+		int blkno = get_file_blkno(in, lblk);
+		if (blkno == -1 || is_unwritten_ptr(blkno)) {
+			memset(buffer + done, 0, n);
+		} else if (is_frag_ptr(blkno)) {
+			ret = bio_read_blocks(frag_blkno(blkno), 1, blocko);
+			memcpy(buffer + done, blocko + frag_slot(blkno) * FRAG_SIZE + boff, n);
+		} else if (n == BLOCK_SIZE) {
+			int run = 1;
+			while ((size_t)(run + 1) * BLOCK_SIZE <= size - done && get_file_blkno(in, lblk + run) == blkno + run) {
+				run++;
+			}
+			ret = bio_read_blocks(blkno, run, buffer + done);
+			n = (size_t)run * BLOCK_SIZE;
+		} else {
+			ret = bio_read_blocks(blkno, 1, blocko);
+			memcpy(buffer + done, blocko + boff, n);
+		}
+		if (ret < 0) {
+			return -EIO;
+		}
+		done += n;
+	}
+	return size;
 }
 
 static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) { // Rahul
+	if (is_stats_path(path)) {
+		return stats_read(path, buffer, size, offset, fi);
+	}
 
 	// Step 1: You could call get_node_by_path() to get inode from path
-	index_node * in = malloc(sizeof(index_node));
-	get_node_by_path(path, 0, in);
+	index_node * in = arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, in) == -1) {
+		return -ENOENT;
+	}
 
 	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: copy the correct amount of data from offset to buffer
-
-	int index = offset / BLOCK_SIZE;
-	unsigned char * blocko = malloc(BLOCK_SIZE);
-	bio_read(in->direct_ptr[index], blocko);
+	if (offset >= in->size) {
+		return 0;
+	}
+	if (offset + size > in->size) {
+		size = in->size - offset;
+	}
 
-	int s = size;
-	char *buffguy = buffer;
+	if (ro_mount) {
+		return ro_read(in, buffer, size, offset);
+	}
 
-	memcpy(buffer, blocko + (offset % BLOCK_SIZE), BLOCK_SIZE - (offset % BLOCK_SIZE));
+	// Step 3: copy the correct amount of data from offset to buffer
+	unsigned char * blocko = arena_alloc(BLOCK_SIZE);
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		int boff = pos % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if (n > size - done) {
+			n = size - done;
+		}
 
-	index++;
-	for(int i = 0; i < 16 && (s > 0); i++){
-		if(s < BLOCK_SIZE){
-			memcpy(buffer + (i * BLOCK_SIZE), blocko, s);
-			s = 0;
-		}else{
-			memcpy(buffer + (i * BLOCK_SIZE), blocko, BLOCK_SIZE);
-			buffguy += BLOCK_SIZE;
-			s -= BLOCK_SIZE;
+		int blkno = get_file_blkno(in, pos / BLOCK_SIZE);
+		if (blkno == -1 || is_unwritten_ptr(blkno)) { // holes read as zeroes without touching the disk
+			memset(buffer + done, 0, n);
+		} else if (is_frag_ptr(blkno)) { // a packed tail never runs past its fragments
+			bio_read(frag_blkno(blkno), blocko);
+			memcpy(buffer + done, blocko + frag_slot(blkno) * FRAG_SIZE + boff, n);
+		} else {
+			bio_read(blkno, blocko);
+			memcpy(buffer + done, blocko + boff, n);
 		}
+		done += n;
 	}
 
-	free(blocko);
-	free(in);
-
 	// Note: this function should return the amount of bytes you copied to buffer
 	return size;
 }
 
 static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) { // Rahul
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
 	// Step 1: You could call get_node_by_path() to get inode from path
-	index_node * in = malloc(sizeof(index_node));
-	get_node_by_path(path, 0, in);
-
-	// Step 2: Based on size and offset, read its data blocks from disk
-	// Step 3: Write the correct amount of data from offset to disk
-	int index = offset / BLOCK_SIZE;
-	unsigned char * blocko = malloc(BLOCK_SIZE);
-
-	if (in->direct_ptr[index] == -1) {
-		in->direct_ptr[index]= get_avail_blkno();
-		in->size += 1;
-		in->vstat.st_size += BLOCK_SIZE;
-		writei(in->ino, in);
+	index_node * in = arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, in) == -1) {
+		return -ENOENT;
+	}
+	if (size == 0) {
+		return 0;
+	}
+	if (offset < 0 || offset > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE - (off_t)size) { // written so nothing overflows
+		return -EFBIG;
 	}
 
-	bio_read(in->direct_ptr[index], blocko);
+	// Step 2: A packed tail the write reaches or grows past gets its block
+	// back first; rufs_release packs it again.
+	if (tail_frags(in) && offset + size > (in->size - 1) / BLOCK_SIZE * BLOCK_SIZE) {
+		int ret = tail_unpack(in);
+		if (ret < 0) {
+			return ret;
+		}
+	}
 
-	int s = size;
+	// Step 3: Allocate blocks for any holes the write covers. Partial head and
+	// tail blocks that were holes must start out as zeroes rather than be read.
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + size - 1) / BLOCK_SIZE;
+	int head_new = get_file_blkno(in, first) == -1;
+	int tail_new = get_file_blkno(in, last) == -1;
+	int ret = alloc_file_blocks(in, first, last - first + 1, 0);
+	if (ret < 0) {
+		writei(in->ino, in); // keep whatever was allocated reachable
+		return ret;
+	}
 
-	memcpy(blocko + (offset % BLOCK_SIZE), buffer, BLOCK_SIZE - (offset % BLOCK_SIZE));
-	char* buffguy = (char*)buffer + (offset % BLOCK_SIZE);
+	// Step 4: Write the correct amount of data from offset to disk
+	unsigned char * blocko = arena_alloc(BLOCK_SIZE);
+	size_t done = 0;
+	while (done < size) {
+		off_t pos = offset + done;
+		int lblk = pos / BLOCK_SIZE;
+		int boff = pos % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - boff;
+		if (n > size - done) {
+			n = size - done;
+		}
 
-	index++;
-	for(int i = index; i < 16 && (s > 0); i++){
-		unsigned char * block_is_hot = malloc(BLOCK_SIZE);
-		if (in->direct_ptr[index] == -1) {
-			in->direct_ptr[index]= get_avail_blkno();
-			in->size += 1;
-			in->vstat.st_size += BLOCK_SIZE;
-			writei(in->ino, in);
+		int blkno = get_file_blkno(in, lblk);
+		int unwritten = is_unwritten_ptr(blkno);
+		blkno = ptr_blkno(blkno);
+		if (n < BLOCK_SIZE) { // partial block: read-modify-write unless it is fresh
+			if ((lblk == first && head_new) || (lblk == last && tail_new) || unwritten) {
+				memset(blocko, 0, BLOCK_SIZE);
+			} else {
+				bio_read(blkno, blocko);
+			}
+			memcpy(blocko + boff, buffer + done, n);
+			bio_write(blkno, blocko);
+		} else {
+			bio_write(blkno, buffer + done);
 		}
-		if(s < BLOCK_SIZE){
-			if (in->direct_ptr[i] != -1) {
-				bio_read(in->direct_ptr[i], block_is_hot);
-			} 
-			memcpy(block_is_hot, buffguy, s);
-			s = 0;
-		}else{ // no need to read
-			memcpy(block_is_hot, buffguy, BLOCK_SIZE);
-			buffguy += BLOCK_SIZE;
-			s -= BLOCK_SIZE;
+		if (unwritten) { // the data is written, so the pointer may now say so
+			set_file_blkno(in, lblk, blkno);
 		}
-		bio_write(in->direct_ptr[i], block_is_hot);
+		done += n;
 	}
 
-	free(blocko);
-	free(in);
-	// Step 4: Update the inode info and write it to disk
+	// Step 5: Update the inode info and write it to disk
+	if (offset + size > in->size) {
+		in->size = offset + size;
+	}
+	in->mtime = time(NULL);
+	writei(in->ino, in);
 
 	// Note: this function should return the amount of bytes you write to disk
 	return size;
 }
 
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	// Only plain preallocation is supported, optionally keeping the file size
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
+	if (mode & ~FALLOC_FL_KEEP_SIZE) {
+		return -EOPNOTSUPP;
+	}
+	if (offset < 0 || len <= 0) {
+		return -EINVAL;
+	}
+	if (offset > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE - len) { // written so nothing overflows
+		return -EFBIG;
+	}
+
+	// Step 1: Call get_node_by_path() to get inode from path
+	index_node * in = arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, in) == -1) {
+		return -ENOENT;
+	}
+
+	// Step 2: Fill the holes with contiguous, unwritten extents; a packed
+	// tail is preallocated space too, so it gets its block back
+	int ret = tail_unpack(in);
+	if (ret < 0) {
+		return ret;
+	}
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + len - 1) / BLOCK_SIZE;
+	ret = alloc_file_blocks(in, first, last - first + 1, 1);
+
+	// Step 3: Update the inode info and write it to disk
+	if (ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > in->size) {
+		in->size = offset + len;
+	}
+	in->ctime = time(NULL);
+	writei(in->ino, in);
+	return ret;
+}
+
+/*
+ * Batched metadata, RUFS_IOC_BATCH (see rufs.h)
+ */
+static int batch_name(const struct rufs_batch_ent *e, char *name) { // name holds a direntry name
+	if (e->namelen == 0) {
+		return -EINVAL;
+	}
+	if (e->namelen >= sizeof(((direntry*)0)->name)) {
+		return -ENAMETOOLONG;
+	}
+	memcpy(name, (const char*)(e + 1), e->namelen);
+	name[e->namelen] = '\0';
+	if (strlen(name) != e->namelen || strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * The directory is read into memory once and every request is answered
+ * from there. Inodes and blocks for the whole batch are taken up front and
+ * what is left over goes back at the end. New inodes and directory blocks
+ * reach the disk before the entries naming them, a run of blocks at a
+ * time, and the directory's inode is written last.
+ */
+static int dir_batch(const char *path, struct rufs_batch *batch) {
+	// Step 1: Look the directory up once and read its entries, which are
+	// packed from the first slot on
+	index_node* dir = arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, dir) == -1) {
+		return -ENOENT;
+	}
+	if (!S_ISDIR(dir->mode)) {
+		return -ENOTDIR;
+	}
+	batch->done = 0;
+	if (batch->count > RUFS_BATCH_BYTES / sizeof(struct rufs_batch_ent)) {
+		return -EINVAL;
+	}
+	direntry* ents = arena_zalloc((size_t)DIRECT_PTRS * BLOCK_SIZE);
+	int nblocks = 0;
+	for (; nblocks < DIRECT_PTRS && dir->direct_ptr[nblocks] != -1; nblocks++) {
+		if (ro_mount) {
+			const direntry* run = ro_dirent(dir, nblocks * MAX_DIRENTS);
+			if (run == NULL) {
+				break;
+			}
+			memcpy(ents + nblocks * MAX_DIRENTS, run, BLOCK_SIZE);
+		} else {
+			bio_read(dir->direct_ptr[nblocks], ents + nblocks * MAX_DIRENTS);
+		}
+	}
+	int n = 0;
+	while (n < nblocks * (int)MAX_DIRENTS && ents[n].valid != INVALID) {
+		n++;
+	}
+	int n0 = n;
+
+	// Step 2: Check the requests fit the buffer and count what they may need
+	struct rufs_batch_ent** req = arena_alloc((batch->count + 1) * sizeof(struct rufs_batch_ent*));
+	int nnew = 0, nmkdir = 0;
+	for (size_t i = 0, off = 0; i < batch->count; i++) {
+		req[i] = (struct rufs_batch_ent*)(batch->data + off);
+		if (off + sizeof(struct rufs_batch_ent) > RUFS_BATCH_BYTES ||
+			off + RUFS_BATCH_ENT_SIZE(req[i]->namelen) > RUFS_BATCH_BYTES) {
+			return -EINVAL;
+		}
+		off += RUFS_BATCH_ENT_SIZE(req[i]->namelen);
+		nnew += req[i]->op == RUFS_BATCH_CREATE || req[i]->op == RUFS_BATCH_MKDIR;
+		nmkdir += req[i]->op == RUFS_BATCH_MKDIR;
+	}
+	if (ro_mount) {
+		nnew = nmkdir = 0;
+	}
+
+	// Step 3: One pass over each allocator; a new directory takes a block,
+	// and so does every MAX_DIRENTS entries the directory grows by
+	uint16_t* inos = arena_alloc((nnew + 1) * sizeof(uint16_t));
+	int ninos = nnew > 0 ? get_avail_inos(nnew, inos) : 0;
+	int max_ents = DIRECT_PTRS * MAX_DIRENTS;
+	int grow = ((n + nnew < max_ents ? n + nnew : max_ents) + MAX_DIRENTS - 1) / MAX_DIRENTS - nblocks;
+	int want = nmkdir + (grow > 0 ? grow : 0);
+	int32_t* blks = arena_alloc((want + 1) * sizeof(int32_t));
+	int nblks = 0;
+	for (int goal = nblocks ? dir->direct_ptr[nblocks - 1] + 1 : 0, got; nblks < want; goal += got) {
+		goal = get_avail_extent(goal, want - nblks, &got);
+		if (goal == 0) {
+			break;
+		}
+		for (int k = 0; k < got; k++) {
+			blks[nblks++] = goal + k;
+		}
+	}
+
+	// Step 4: Answer the requests in order against the in-memory directory
+	index_node* made = arena_zalloc((nnew + 1) * sizeof(index_node)); // inode of entry n0 + j
+	int used_inos = 0, used_blks = 0;
+	time_t now = time(NULL);
+	char* name = arena_alloc(sizeof(((direntry*)0)->name));
+	for (uint32_t i = 0; i < batch->count; i++) {
+		struct rufs_batch_ent* e = req[i];
+		if ((e->result = batch_name(e, name)) < 0) {
+			continue;
+		}
+		int k = 0;
+		while (k < n && strcmp(ents[k].name, name) != 0) {
+			k++;
+		}
+
+		if (e->op == RUFS_BATCH_STAT) {
+			if (k == n) {
+				e->result = -ENOENT;
+				continue;
+			}
+			index_node* in = &made[k - n0];
+			if (k < n0) {
+				in = arena_alloc(sizeof(index_node));
+				readi(ents[k].ino, in);
+			}
+			e->ino = in->ino;
+			e->mode = in->mode;
+			e->size = in->size;
+			e->mtime = in->mtime;
+			continue;
+		}
+		if (e->op != RUFS_BATCH_CREATE && e->op != RUFS_BATCH_MKDIR) {
+			e->result = -EINVAL;
+			continue;
+		}
+		int is_dir = e->op == RUFS_BATCH_MKDIR;
+		int new_blk = n == nblocks * (int)MAX_DIRENTS;
+		if (ro_mount) {
+			e->result = -EROFS;
+			continue;
+		}
+		if (k < n) {
+			e->result = -EEXIST;
+			continue;
+		}
+		if (n == max_ents || used_inos == ninos || used_blks + new_blk + is_dir > nblks) {
+			e->result = -ENOSPC;
+			continue;
+		}
+
+		if (new_blk) {
+			dir->direct_ptr[nblocks++] = blks[used_blks++];
+			dir->blocks++;
+			dir->size += BLOCK_SIZE;
+		}
+		index_node* in = &made[n - n0];
+		for (int p = 0; p < DIRECT_PTRS; p++) { in->direct_ptr[p] = -1; }
+		for (int p = 0; p < INDIRECT_PTRS; p++) { in->indirect_ptr[p] = -1; }
+		in->ino = inos[used_inos++];
+		in->valid = VALID;
+		in->version = INODE_VERSION;
+		in->gid = getgid();
+		in->uid = getuid();
+		in->mtime = in->ctime = now;
+		if (is_dir) {
+			in->direct_ptr[0] = blks[used_blks++];
+			in->blocks = 1;
+			in->size = BLOCK_SIZE;
+			in->link = 2;
+			in->mode = __S_IFDIR | (e->mode & 07777);
+			dir->link++;
+		} else {
+			in->link = 1;
+			in->mode = __S_IFREG | (e->mode & 07777);
+		}
+		ents[n].ino = in->ino;
+		ents[n].valid = VALID;
+		strcpy(ents[n].name, name);
+		ents[n].len = e->namelen;
+		n++;
+		e->ino = in->ino;
+		e->mode = in->mode;
+		e->size = in->size;
+		e->mtime = in->mtime;
+	}
+
+	batch->done = batch->count;
+
+	// Step 5: New directories start out empty, whatever their blocks held
+	int nmade = n - n0;
+	void* zeroes = arena_zalloc((size_t)(nmkdir + 1) * BLOCK_SIZE);
+	for (int j = 0; j < nmade; ) {
+		if (!S_ISDIR(made[j].mode)) {
+			j++;
+			continue;
+		}
+		int run = 1;
+		while (j + run < nmade && S_ISDIR(made[j + run].mode) &&
+			made[j + run].direct_ptr[0] == made[j].direct_ptr[0] + run) {
+			run++;
+		}
+		bio_write_blocks(made[j].direct_ptr[0], run, zeroes);
+		j += run;
+	}
+
+	// Step 6: New inodes, a run of inode table blocks at a time; inode
+	// numbers came out of the bitmap in ascending order
+	if (nmade > 0) {
+		uint32_t last = made[nmade - 1].ino / INODES_PER_BLOCK;
+		if (last >= __atomic_load_n(&superblock->itable_init, __ATOMIC_ACQUIRE)) {
+			itable_extend(last + 1);
+		}
+	}
+	for (int j = 0; j < nmade; ) {
+		int first = made[j].ino / INODES_PER_BLOCK, last = first, end = j + 1;
+		while (end < nmade && (int)(made[end].ino / INODES_PER_BLOCK) <= last + 1) {
+			last = made[end++].ino / INODES_PER_BLOCK;
+		}
+		int count = last - first + 1;
+		index_node* table = arena_alloc((size_t)count * BLOCK_SIZE);
+		itable_lock_blocks(first, count, 1); // as writei does, for the other inodes in these blocks
+		bio_read_blocks(superblock->i_start_blk + first, count, table);
+		for (int m = j; m < end; m++) {
+			memcpy(&table[made[m].ino - first * INODES_PER_BLOCK], &made[m], sizeof(index_node));
+		}
+		bio_write_blocks(superblock->i_start_blk + first, count, table);
+		for (int m = j; m < end; m++) {
+			cache_update(CACHE_INODE, made[m].ino, NULL, &made[m], sizeof(index_node));
+		}
+		itable_lock_blocks(first, count, 0);
+		j = end;
+	}
+
+	// Step 7: The directory blocks that changed, then the directory's inode
+	pthread_rwlock_wrlock(&dir_locks[dir->ino % DIR_LOCKS]);
+	for (int b = n0 / MAX_DIRENTS; nmade > 0 && b <= (n - 1) / (int)MAX_DIRENTS; ) {
+		int run = 1;
+		while (b + run <= (n - 1) / (int)MAX_DIRENTS && dir->direct_ptr[b + run] == dir->direct_ptr[b] + run) {
+			run++;
+		}
+		bio_write_blocks(dir->direct_ptr[b], run, ents + b * MAX_DIRENTS);
+		b += run;
+	}
+	if (nmade > 0) {
+		dir->mtime = dir->ctime = now;
+		writei(dir->ino, dir);
+	}
+	for (int k = n0; k < n; k++) { // a miss for the name may be cached
+		cache_invalidate(CACHE_DENTRY, dir->ino, ents[k].name);
+	}
+	pthread_rwlock_unlock(&dir_locks[dir->ino % DIR_LOCKS]);
+
+	// Step 8: Give back what the batch did not use
+	for (int j = used_inos; j < ninos; j++) {
+		release_ino(inos[j]);
+	}
+	for (int j = used_blks; j < nblks; j++) {
+		release_blkno(blks[j]);
+	}
+	return 0;
+}
+
+static int rufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+	if (flags & FUSE_IOCTL_COMPAT) {
+		return -ENOSYS;
+	}
+
+	switch (cmd) {
+	case RUFS_IOC_SEEK: {
+		struct rufs_seek* req = data;
+		if (req->whence != SEEK_DATA && req->whence != SEEK_HOLE) {
+			return -EINVAL;
+		}
+		index_node * in = arena_alloc(sizeof(index_node));
+		if (get_node_by_path(path, 0, in) == -1) {
+			return -ENOENT;
+		}
+		off_t pos = seek_data_hole(in, req->offset, req->whence);
+		if (pos < 0) {
+			return pos;
+		}
+		req->offset = pos;
+		return 0;
+	}
+	case RUFS_IOC_BATCH:
+		return dir_batch(path, data);
+	}
+
+	return -ENOTTY;
+}
+
 static int rufs_unlink(const char *path) {
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
+	char* p1 = arena_strdup(path);
+	char* p2 = arena_strdup(path);
+	char* parent_directory = dirname(p1);
+	char* base = basename(p2);
 
 	// Step 2: Call get_node_by_path() to get inode of target file
-
-	// Step 3: Clear data block bitmap of target file
-
-	// Step 4: Clear inode bitmap and its data block
+	index_node * target = (index_node*) arena_alloc(sizeof(index_node));
+	index_node * dir_inode = (index_node*) arena_alloc(sizeof(index_node));
+	int ret = 0;
+	if (get_node_by_path(path, 0, target) == -1) {
+		ret = -ENOENT;
+		goto out;
+	}
+	if (S_ISDIR(target->mode)) {
+		ret = -EISDIR;
+		goto out;
+	}
 
 	// Step 5: Call get_node_by_path() to get inode of parent directory
+	get_node_by_path(parent_directory, 0, dir_inode);
 
 	// Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+	if (dir_remove(*dir_inode, base, strlen(base)) == 0) {
+		ret = -ENOENT;
+		goto out;
+	}
+	dir_inode->mtime = dir_inode->ctime = time(NULL);
+	writei(dir_inode->ino, dir_inode);
+
+	target->link -= 1;
+	if (target->link > 0) {
+		target->ctime = time(NULL);
+		writei(target->ino, target);
+		goto out;
+	}
 
-	return 0;
+	// Step 3: Unmap the file's data blocks; this is O(1) however large the
+	// file is
+	struct reclaim_item* detached = detach_file_blocks(target, 0);
+
+	// Step 4: Clear the inode, then hand the blocks to the reclaimer and
+	// free the inode number
+	target->valid = INVALID;
+	writei(target->ino, target);
+	detach_commit(detached);
+	release_ino(target->ino);
+
+out:
+	return ret;
 }
 
 static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
+	if (is_stats_path(path)) {
+		return -EACCES;
+	}
+	if (ro_mount) {
+		return -EROFS;
+	}
+	// Step 1: Call get_node_by_path() to get inode from path
+	index_node * in = arena_alloc(sizeof(index_node));
+	if (get_node_by_path(path, 0, in) == -1) {
+		return -ENOENT;
+	}
+	if (S_ISDIR(in->mode)) {
+		return -EISDIR;
+	}
+	if (size < 0 || size > (off_t)MAX_FILE_BLOCKS * BLOCK_SIZE) {
+		return -EFBIG;
+	}
+
+	// Step 2: When shrinking, unmap the blocks past the new end and zero
+	// the tail of the new last block, so that a later extension reads
+	// zeroes. Growing just leaves a hole. A packed tail is unpacked first
+	// and the new tail packed again afterwards.
+	int ret = tail_unpack(in);
+	if (ret < 0) {
+		return ret;
+	}
+	struct reclaim_item* detached = NULL;
+	if (size < in->size) {
+		detached = detach_file_blocks(in, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+		int blkno = (size % BLOCK_SIZE) ? get_file_blkno(in, size / BLOCK_SIZE) : -1;
+		if (blkno != -1 && !is_unwritten_ptr(blkno)) {
+			unsigned char* block = arena_alloc(BLOCK_SIZE);
+			bio_read(blkno, block);
+			memset(block + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+			bio_write(blkno, block);
+		}
+	}
+
+	// Step 3: Update the inode info and write it to disk; only then can the
+	// unmapped blocks go to the reclaimer
+	in->size = size;
+	in->mtime = in->ctime = time(NULL);
+	writei(in->ino, in);
+	if (detached != NULL) {
+		detach_commit(detached);
+	}
+	tail_pack(in);
     return 0;
 }
 
+static int rufs_statfs(const char *path, struct statvfs *stbuf) {
+	// Answered from the superblock's summary counts, without touching the bitmaps
+	memset(stbuf, 0, sizeof(struct statvfs));
+	stbuf->f_bsize = BLOCK_SIZE;
+	stbuf->f_frsize = BLOCK_SIZE;
+	stbuf->f_blocks = superblock->max_dnum;
+	stbuf->f_bfree = stbuf->f_bavail = superblock->free_blocks;
+	stbuf->f_files = superblock->max_inum;
+	stbuf->f_ffree = stbuf->f_favail = superblock->free_inodes;
+	stbuf->f_namemax = sizeof(((direntry*)0)->name) - 1;
+	stbuf->f_flag = ro_mount ? ST_RDONLY : 0;
+	return 0;
+}
+
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
+	if (is_stats_path(path)) {
+		if (fi != NULL && fi->fh) {
+			struct snapshot* snap = (struct snapshot*)(uintptr_t)fi->fh;
+			free(snap->data);
+			free(snap);
+			fi->fh = 0;
+		}
+		return 0;
+	}
+
+	// Once a writer is done with a small file, its tail goes into fragments
+	if (fi != NULL && (fi->flags & O_ACCMODE) != O_RDONLY) {
+		index_node * in = arena_alloc(sizeof(index_node));
+		if (get_node_by_path(path, 0, in) != -1) {
+			tail_pack(in);
+		}
+	}
 	return 0;
 }
 
@@ -792,45 +2793,243 @@ static int rufs_flush(const char * path, struct fuse_file_info * fi) {
     return 0;
 }
 
+// write-back holds dirty blocks of every file together, so sync them all
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	if (is_stats_path(path)) {
+		return 0;
+	}
+	dev_sync();
+	return 0;
+}
+
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
 	// For this project, you don't need to fill this function
 	// But DO NOT DELETE IT!
-    return 0;
+    return ro_mount ? -EROFS : 0;
 }
 
 
-static struct fuse_operations rufs_ope = {
-	.init		= rufs_init,
-	.destroy	= rufs_destroy,
+/*
+ * Timed entry points. Each op is wrapped once here so its latency lands in
+ * the stats histograms, and in the recording if one is on, whichever way it
+ * returns, queueing included. The op itself goes through dispatch: reads,
+ * writes, truncate, fallocate and release as data ops, everything else as
+ * metadata ops.
+ */
+struct op_call {
+	enum stats_op			op;
+	const char*				path;
+	void*					buf;
+	size_t					size;
+	off_t					offset;
+	off_t					len;
+	int						mode;
+	struct fuse_file_info*	fi;
+	struct stat*			stbuf;
+	struct statvfs*			vfs;
+	fuse_fill_dir_t			filler;
+	int						cmd;
+	void*					arg;
+	unsigned int			flags;
+	void*					data;
+};
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
+/*
+ * Per-inode locks, striped by inode number. Ops run concurrently on the
+ * dispatch pools and the FUSE threads, so op_run holds the lock of the
+ * inode an op works on: shared for reads, which must not see blocks a
+ * truncate is giving away, exclusive for ops that change it. create,
+ * mkdir, unlink and rmdir change the parent directory and hold its lock
+ * exclusively too; a name that does not exist yet is guarded by it. Two
+ * stripes are taken in index order.
+ */
+#define INODE_LOCKS		64
 
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
+static pthread_rwlock_t inode_locks[INODE_LOCKS] = {
+	[0 ... INODE_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER
+};
 
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+struct op_locks {
+	int		n;
+	int		ino[2];			/* what the path named when locked, -1 if nothing */
+	int		nheld;
+	int		held[2];		/* stripes, in the order taken */
 };
 
+static int path_ino(const char *path) {
+	index_node* in = arena_alloc(sizeof(index_node));
+	return get_node_by_path(path, 0, in) == -1 ? -1 : in->ino;
+}
+
+// create and mkdir leave an existing name alone, so only its parent counts
+static void op_locks_resolve(struct op_call *c, struct op_locks *l) {
+	l->n = 0;
+	if (c->op == OP_CREATE || c->op == OP_MKDIR || c->op == OP_UNLINK || c->op == OP_RMDIR) {
+		l->ino[l->n++] = path_ino(dirname(arena_strdup(c->path)));
+	}
+	if (c->op != OP_CREATE && c->op != OP_MKDIR) {
+		l->ino[l->n++] = path_ino(c->path);
+	}
+}
+
+static void op_unlock(struct op_locks *l) {
+	for (int i = l->nheld - 1; i >= 0; i--) {
+		pthread_rwlock_unlock(&inode_locks[l->held[i]]);
+	}
+	l->nheld = 0;
+}
+
+static void op_lock(struct op_call *c, struct op_locks *l) {
+	l->nheld = 0;
+	if (ro_mount || c->op == OP_GETATTR || c->op == OP_OPENDIR || c->op == OP_OPEN ||
+		c->op == OP_STATFS || c->op == OP_FSYNC || is_stats_path(c->path)) {
+		return; // these only copy an inode out, which writei keeps whole
+	}
+	int shared = c->op == OP_READDIR || c->op == OP_READ;
+
+	// Find the inodes, lock their stripes, then check the path still names
+	// them; an unlink in between may have freed one for reuse
+	for (;;) {
+		op_locks_resolve(c, l);
+		l->nheld = 0;
+		for (int i = 0; i < l->n; i++) {
+			if (l->ino[i] >= 0) {
+				l->held[l->nheld++] = l->ino[i] % INODE_LOCKS;
+			}
+		}
+		if (l->nheld == 2 && l->held[0] == l->held[1]) {
+			l->nheld = 1;
+		} else if (l->nheld == 2 && l->held[0] > l->held[1]) {
+			int t = l->held[0];
+			l->held[0] = l->held[1];
+			l->held[1] = t;
+		}
+		for (int i = 0; i < l->nheld; i++) {
+			if (shared) {
+				pthread_rwlock_rdlock(&inode_locks[l->held[i]]);
+			} else {
+				pthread_rwlock_wrlock(&inode_locks[l->held[i]]);
+			}
+		}
 
-int main(int argc, char *argv[]) {
-	int fuse_stat;
+		struct op_locks now;
+		op_locks_resolve(c, &now);
+		if (now.ino[0] == l->ino[0] && (l->n == 1 || now.ino[1] == l->ino[1])) {
+			return;
+		}
+		op_unlock(l);
+	}
+}
 
-	getcwd(diskfile_path, PATH_MAX);
-	strcat(diskfile_path, "/DISKFILE");
+static int op_run(void *arg) {
+	struct op_call* c = arg;
+	struct op_locks locks;
+	int ret = -ENOSYS;
+	TRACE_BEGIN(c->op, 0);
+	op_lock(c, &locks);
+	switch (c->op) {
+	case OP_GETATTR:	ret = rufs_getattr(c->path, c->stbuf); break;
+	case OP_OPENDIR:	ret = rufs_opendir(c->path, c->fi); break;
+	case OP_READDIR:	ret = rufs_readdir(c->path, c->buf, c->filler, c->offset, c->fi); break;
+	case OP_MKDIR:		ret = rufs_mkdir(c->path, c->mode); break;
+	case OP_RMDIR:		ret = rufs_rmdir(c->path); break;
+	case OP_CREATE:		ret = rufs_create(c->path, c->mode, c->fi); break;
+	case OP_OPEN:		ret = rufs_open(c->path, c->fi); break;
+	case OP_READ:		ret = rufs_read(c->path, c->buf, c->size, c->offset, c->fi); break;
+	case OP_WRITE:		ret = rufs_write(c->path, c->buf, c->size, c->offset, c->fi); break;
+	case OP_UNLINK:		ret = rufs_unlink(c->path); break;
+	case OP_TRUNCATE:	ret = rufs_truncate(c->path, c->len); break;
+	case OP_FALLOCATE:	ret = rufs_fallocate(c->path, c->mode, c->offset, c->len, c->fi); break;
+	case OP_IOCTL:		ret = rufs_ioctl(c->path, c->cmd, c->arg, c->fi, c->flags, c->data); break;
+	case OP_STATFS:		ret = rufs_statfs(c->path, c->vfs); break;
+	case OP_RELEASE:	ret = rufs_release(c->path, c->fi); break;
+	case OP_FSYNC:		ret = rufs_fsync(c->path, c->mode, c->fi); break;
+	default:			break;
+	}
+	op_unlock(&locks);
+	TRACE_END(c->op);
+	return ret;
+}
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+// what rufs-replay needs to issue the op again; buffers and results are not kept
+static void record_call(struct op_call *c, uint64_t start, int ret) {
+	if (!record_enabled()) {
+		return;
+	}
+	uint64_t offset = c->op == OP_TRUNCATE ? c->len : c->offset;
+	uint64_t len = c->op == OP_FALLOCATE ? c->len : c->size;
+	uint32_t mode = c->op == OP_IOCTL ? c->cmd : c->mode;
+	record_add(c->op, c->path, start, ret, offset, len, mode, c->fi ? c->fi->flags : 0);
+}
 
-	return fuse_stat;
+#define TIMED(cls, ...) { \
+	uint64_t start = stats_now(); \
+	struct op_call call = { __VA_ARGS__ }; \
+	int ret = dispatch_run(cls, op_run, &call); \
+	stats_op(call.op, start, ret); \
+	record_call(&call, start, ret); \
+	return ret; \
 }
 
+static int timed_getattr(const char *path, struct stat *stbuf)
+	TIMED(DISPATCH_META, .op = OP_GETATTR, .path = path, .stbuf = stbuf)
+static int timed_opendir(const char *path, struct fuse_file_info *fi)
+	TIMED(DISPATCH_META, .op = OP_OPENDIR, .path = path, .fi = fi)
+static int timed_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+	TIMED(DISPATCH_META, .op = OP_READDIR, .path = path, .buf = buffer, .filler = filler, .offset = offset, .fi = fi)
+static int timed_mkdir(const char *path, mode_t mode)
+	TIMED(DISPATCH_META, .op = OP_MKDIR, .path = path, .mode = mode)
+static int timed_rmdir(const char *path)
+	TIMED(DISPATCH_META, .op = OP_RMDIR, .path = path)
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+	TIMED(DISPATCH_META, .op = OP_CREATE, .path = path, .mode = mode, .fi = fi)
+static int timed_open(const char *path, struct fuse_file_info *fi)
+	TIMED(DISPATCH_META, .op = OP_OPEN, .path = path, .fi = fi)
+static int timed_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(DISPATCH_DATA, .op = OP_READ, .path = path, .buf = buffer, .size = size, .offset = offset, .fi = fi)
+static int timed_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+	TIMED(DISPATCH_DATA, .op = OP_WRITE, .path = path, .buf = (void*)buffer, .size = size, .offset = offset, .fi = fi)
+static int timed_unlink(const char *path)
+	TIMED(DISPATCH_META, .op = OP_UNLINK, .path = path)
+static int timed_truncate(const char *path, off_t size)
+	TIMED(DISPATCH_DATA, .op = OP_TRUNCATE, .path = path, .len = size)
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi)
+	TIMED(DISPATCH_DATA, .op = OP_FALLOCATE, .path = path, .mode = mode, .offset = offset, .len = len, .fi = fi)
+static int timed_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
+	TIMED(DISPATCH_META, .op = OP_IOCTL, .path = path, .cmd = cmd, .arg = arg, .fi = fi, .flags = flags, .data = data)
+
+static int timed_statfs(const char *path, struct statvfs *stbuf)
+	TIMED(DISPATCH_META, .op = OP_STATFS, .path = path, .vfs = stbuf)
+static int timed_release(const char *path, struct fuse_file_info *fi)
+	TIMED(DISPATCH_DATA, .op = OP_RELEASE, .path = path, .fi = fi)
+static int timed_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+	TIMED(DISPATCH_META, .op = OP_FSYNC, .path = path, .mode = datasync, .fi = fi)
+
+struct fuse_operations rufs_ope = {
+	.init		= rufs_init,
+	.destroy	= rufs_destroy,
+
+	.getattr	= timed_getattr,
+	.readdir	= timed_readdir,
+	.opendir	= timed_opendir,
+	.releasedir	= rufs_releasedir,
+	.mkdir		= timed_mkdir,
+	.rmdir		= timed_rmdir,
+
+	.create		= timed_create,
+	.open		= timed_open,
+	.read 		= timed_read,
+	.write		= timed_write,
+	.unlink		= timed_unlink,
+
+	.truncate   = timed_truncate,
+	.flush      = rufs_flush,
+	.fsync      = timed_fsync,
+	.utimens    = rufs_utimens,
+	.release	= timed_release,
+
+	.fallocate	= timed_fallocate,
+	.ioctl		= timed_ioctl,
+	.statfs		= timed_statfs
+};
+
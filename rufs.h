@@ -7,13 +7,16 @@
  */
 
 #include <linux/limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
+/* bumped with every incompatible on-disk layout; 0x5C3A embedded struct stat in the inode */
+#define MAGIC_NUM 0x5C3B
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
@@ -21,7 +24,70 @@
 #define INVALID 0
 
 #define MAX_DIRENTS (BLOCK_SIZE/sizeof(direntry))
+#define INODES_PER_BLOCK (BLOCK_SIZE/sizeof(index_node))
 
+#define INODE_VERSION 1
+
+#define DIRECT_PTRS 16
+#define INDIRECT_PTRS 8
+#define PTRS_PER_BLOCK (BLOCK_SIZE/sizeof(int32_t))
+#define MAX_FILE_BLOCKS (DIRECT_PTRS + INDIRECT_PTRS*PTRS_PER_BLOCK)
+
+/*
+ * Tail packing. The last block of a regular file that fits in the direct
+ * pointers can live in a run of fragments inside a shared fragment block.
+ * Its pointer then has FRAG_PTR set and names the first fragment, and the
+ * run length follows from the file size. The fragment map has one bit per
+ * fragment of every data block and is allocated the first time it is needed.
+ */
+#define FRAG_SIZE 512
+#define FRAGS_PER_BLOCK (BLOCK_SIZE/FRAG_SIZE)
+#define FRAG_PTR 0x40000000
+#define FRAG_MAP_BLOCKS ((MAX_DNUM*FRAGS_PER_BLOCK + BLOCK_SIZE*8 - 1) / (BLOCK_SIZE*8))
+
+/*
+ * Unwritten blocks. fallocate maps blocks without writing them; their
+ * pointers carry UNWRITTEN_PTR until the first write reaches them, and
+ * until then they read as zeroes without touching the disk.
+ */
+#define UNWRITTEN_PTR 0x20000000
+
+/*
+ * Cache warm-up. Unmount saves the block numbers held by the cache, hottest
+ * first, and the next mount reads them back in the background.
+ */
+#define WARM_BLOCKS 4
+#define WARM_MAX (WARM_BLOCKS*PTRS_PER_BLOCK)
+
+/*
+ * Read-only images. mkrufs -r finalizes an image: every directory gets a
+ * minimal perfect hash over its names, so a lookup looks at exactly one
+ * entry. The tables fill a region the superblock points at, which opens
+ * with one uint32_t per inode, the offset in 16-bit words of that
+ * directory's table or 0 for none. A table is the name count n, the bucket
+ * count, one displacement per bucket and n slots, each the index of an
+ * entry in the directory. A name hashes to bucket
+ * dir_hash(name, 0) % buckets and to slot dir_hash(name, disp + 1) % n.
+ */
+#define RO_BUCKET_KEYS 4		/* names per bucket */
+#define RO_DISP_MAX 65535
+
+static inline uint32_t dir_hash(const char *name, uint32_t seed) {
+	uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+	for (; *name != '\0'; name++) {
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	h ^= h >> 16; // FNV leaves the low bits weak; mix before they are reduced
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	return h ^ (h >> 16);
+}
+
+
+#define SB_LAZY_ITABLE	0x1		/* flags: inode blocks from itable_init on were never written */
+#define SB_READONLY		0x2		/* flags: finalized by mkrufs -r, mounted read-only */
+#define SB_CLEAN		0x1		/* state: unmounted cleanly, so the free counts are exact */
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
@@ -31,18 +97,44 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	flags;				/* SB_* feature flags */
+	uint32_t	state;				/* SB_CLEAN or 0 while mounted */
+	uint32_t	free_inodes;		/* summary counts for statfs */
+	uint32_t	free_blocks;
+	uint32_t	itable_init;		/* inode table blocks initialized so far */
+	uint32_t	frag_map_blk;		/* start block of the fragment map, 0 until first used */
+	uint32_t	nstripes;			/* backing files the disk is striped over, 0 for one */
+	uint32_t	stripe_blocks;		/* blocks per stripe unit */
+	uint32_t	warm_blk;			/* start block of the hot block list, 0 until first unmount */
+	uint32_t	warm_count;			/* block numbers in the hot block list */
+	uint32_t	ro_index_blk;		/* start block of the directory hash tables, SB_READONLY only */
+	uint32_t	ro_index_blocks;
+	uint32_t	ro_dir_blk;			/* start block of the run holding every directory block */
+	uint32_t	ro_dir_blocks;
 } typedef sb;
 
+/*
+ * On-disk inode. Every field has a fixed width and the struct is packed to
+ * 128 bytes, so 32 inodes share a block. struct stat is not stored; it is
+ * synthesized from these fields on getattr.
+ */
 struct inode {
 	uint16_t	ino;				/* inode number */
-	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
-	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
-} typedef index_node;
+	uint8_t		valid;				/* validity of the inode */
+	uint8_t		version;			/* on-disk inode format version */
+	uint16_t	mode;				/* file type and permission bits */
+	uint16_t	link;				/* link count */
+	uint32_t	uid;				/* owner user id */
+	uint32_t	gid;				/* owner group id */
+	uint32_t	size;				/* size of the file in bytes */
+	uint32_t	blocks;				/* number of allocated data blocks */
+	uint32_t	mtime;				/* last modification time */
+	uint32_t	ctime;				/* last status change time */
+	int32_t		direct_ptr[16];		/* direct pointer to data block */
+	int32_t		indirect_ptr[8];	/* indirect pointer to data block */
+} __attribute__((packed)) typedef index_node;
+
+_Static_assert(sizeof(index_node) == 128, "on-disk inode must stay 128 bytes");
 
 struct dirent {
 	uint16_t ino;					/* inode number of the directory entry */
@@ -52,26 +144,149 @@ struct dirent {
 } typedef direntry;
 
 /*
- * bitmap operations
+ * ioctl interface. FUSE 2.x has no lseek operation, so SEEK_DATA/SEEK_HOLE
+ * are answered through RUFS_IOC_SEEK on an open file handle.
  */
-typedef unsigned char* bitmap_t;
+struct rufs_seek {
+	int64_t		offset;				/* in: start offset, out: result offset */
+	int32_t		whence;				/* SEEK_DATA or SEEK_HOLE */
+	int32_t		pad;
+};
 
-/**
- * Memory Data Structures
+#define RUFS_IOC_SEEK	_IOWR('R', 1, struct rufs_seek)
+
+/*
+ * Batched metadata. RUFS_IOC_BATCH on an open directory runs count packed
+ * requests against names in it, in order, under one lookup of the
+ * directory, one allocation of inodes and blocks and one write of each
+ * block touched. Each request is a struct rufs_batch_ent followed by its
+ * name, not NUL-terminated, and the next request starts at the following
+ * 4-byte boundary. Every request gets its own result, and done is set to
+ * count once they all have one. The struct has to fit _IOC_SIZE's 14 bits.
  */
-sb* superblock; // used for memory purposes only
-static int dir_var;
+#define RUFS_BATCH_CREATE	1
+#define RUFS_BATCH_MKDIR	2
+#define RUFS_BATCH_STAT		3
+
+#define RUFS_BATCH_BYTES	16000
+
+struct rufs_batch_ent {
+	uint8_t		op;					/* RUFS_BATCH_* */
+	uint8_t		namelen;
+	uint16_t	mode;				/* in: permission bits, out: file mode */
+	int32_t		result;				/* out: 0 or -errno */
+	uint32_t	ino;				/* out */
+	uint32_t	size;				/* out, RUFS_BATCH_STAT only */
+	uint32_t	mtime;
+	uint32_t	pad;
+};
+
+struct rufs_batch {
+	uint32_t	count;				/* in: requests in data */
+	uint32_t	done;				/* out: requests processed */
+	char		data[RUFS_BATCH_BYTES];
+};
 
-void set_bitmap(bitmap_t b, int i) {
+#define RUFS_BATCH_ENT_SIZE(namelen) ((sizeof(struct rufs_batch_ent) + (namelen) + 3) & ~(size_t)3)
+
+#define RUFS_IOC_BATCH	_IOWR('R', 2, struct rufs_batch)
+
+/*
+ * bitmap operations
+ */
+typedef unsigned char* bitmap_t;
+
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
+/*
+ * fragment pointers
+ */
+static inline int is_frag_ptr(int32_t ptr) {
+	return ptr != -1 && (ptr & FRAG_PTR);
+}
+
+static inline int is_unwritten_ptr(int32_t ptr) {
+	return ptr != -1 && !(ptr & FRAG_PTR) && (ptr & UNWRITTEN_PTR);
+}
+
+/* the block a whole-block pointer names, written or not */
+static inline int32_t ptr_blkno(int32_t ptr) {
+	return is_unwritten_ptr(ptr) ? ptr & ~UNWRITTEN_PTR : ptr;
+}
+
+static inline int32_t make_frag_ptr(int blkno, int slot) {
+	return FRAG_PTR | (blkno * FRAGS_PER_BLOCK + slot);
+}
+
+static inline int frag_blkno(int32_t ptr) {
+	return (ptr & ~FRAG_PTR) / FRAGS_PER_BLOCK;
+}
+
+static inline int frag_slot(int32_t ptr) {
+	return (ptr & ~FRAG_PTR) % FRAGS_PER_BLOCK;
+}
+
+/* number of fragments holding the file's tail, 0 if it is not packed */
+static inline int tail_frags(const struct inode *inode) {
+	if (!S_ISREG(inode->mode) || inode->size == 0 || inode->size > DIRECT_PTRS * BLOCK_SIZE) {
+		return 0;
+	}
+	int lblk = (inode->size - 1) / BLOCK_SIZE;
+	if (!is_frag_ptr(inode->direct_ptr[lblk])) {
+		return 0;
+	}
+	return (inode->size - lblk * BLOCK_SIZE + FRAG_SIZE - 1) / FRAG_SIZE;
+}
+
+/**
+ * Memory Data Structures
+ */
+extern sb* superblock; // used for memory purposes only
+extern char diskfile_path[PATH_MAX];
+
+/*
+ * rufs core, built into librufs.a so tools and benchmarks can drive it
+ * without a FUSE mount
+ */
+int get_avail_ino();
+int get_avail_inos(int want, uint16_t *inos);
+int get_avail_blkno();
+int get_avail_extent(int goal, int want, int *got);
+void release_ino(uint16_t ino);
+int reclaim_wait();
+
+int readi(uint16_t ino, struct inode *inode);
+int writei(uint16_t ino, struct inode *inode);
+void inode_to_stat(const struct inode *inode, struct stat *stbuf);
+
+int get_file_blkno(struct inode *inode, int lblk);
+int set_file_blkno(struct inode *inode, int lblk, int blkno);
+int alloc_file_blocks(struct inode *inode, int lblk, int count, int unwritten);
+off_t seek_data_hole(struct inode *inode, off_t offset, int whence);
+struct reclaim_item *detach_file_blocks(struct inode *inode, int from);
+void detach_commit(struct reclaim_item *item);
+int tail_pack(struct inode *inode);
+int tail_unpack(struct inode *inode);
+
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent);
+int dir_add(struct inode* dir_inode, uint16_t f_ino, const char *fname, size_t name_len);
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len);
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode);
+
+int rufs_mkfs();
+
+#ifdef FUSE_USE_VERSION
+extern struct fuse_operations rufs_ope;	/* FUSE entry points, see rufs_main.c */
+#endif
+
 #endif
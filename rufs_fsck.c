@@ -0,0 +1,815 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_fsck.c
+ *
+ *	Offline consistency checker. Run it on an unmounted DISKFILE:
+ *
+ *	./rufs-fsck [-n] [-j THREADS] [DISKFILE[,DISKFILE...]]
+ *
+ *	The inode table, block maps and directories are scanned in parallel,
+ *	the inode table with large sequential reads. Both bitmaps are then
+ *	rebuilt from what is actually reachable from the root, so blocks and
+ *	inodes leaked by a crash between the bitmap update and the inode or
+ *	directory write come back. Link counts, block counts and directory
+ *	sizes are recomputed, dangling and duplicate directory entries are
+ *	dropped, and a block claimed twice stays with the lower inode. Packed
+ *	tails are checked against each other and the fragment map is rebuilt
+ *	along with the bitmaps.
+ *	Inodes that cannot be reached from the root are freed; there is no
+ *	lost+found to reconnect them to.
+ *
+ *	Exit status follows e2fsck: 0 clean, 1 errors fixed, 4 errors left
+ *	uncorrected (always the case with -n), 8 operational error.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+#define FSCK_READ_BLOCKS	256		/* inode table is read 1 MiB at a time */
+#define FSCK_BLOCK_MAX		INT32_MAX
+
+#define EXIT_CLEAN		0
+#define EXIT_FIXED		1
+#define EXIT_UNFIXED	4
+#define EXIT_ERROR		8
+
+/* one block pointer found while walking an inode's block map */
+struct claim {
+	int32_t	lblk;		/* logical block, or -1 - slot for an indirect block */
+	int32_t	pblk;		/* physical block, -1 once the claim is dropped */
+};
+
+struct inode_state {
+	uint8_t			valid;		/* passed the pass 1 checks */
+	uint8_t			reachable;	/* found from the root in pass 5 */
+	uint16_t		links;		/* link count implied by the tree */
+	int				nclaims;
+	struct claim*	claims;
+	int				nentries;
+	direntry*		entries;	/* directory contents, once read */
+	int				dir_dirty;	/* entries or blocks changed, rewrite */
+};
+
+struct fsck {
+	int					fix;
+	int					threads;
+	sb					super;
+	int					itable_blocks;
+	int					itable_init;	/* blocks mkfs or rufs ever wrote */
+	index_node*			itable;			/* whole inode table, read in pass 1 */
+	uint8_t*			itable_dirty;	/* per inode table block */
+	struct inode_state*	state;
+	int32_t*			owner;			/* lowest inode claiming each block */
+	int					frag_map;		/* fragment map start block, 0 if none */
+	int					warm;			/* hot block list start block, 0 if none */
+	int					ro_index;		/* directory hash tables of a read-only image, 0 if none */
+	int					used_blocks;
+	int					next;			/* work counter shared by a pass */
+	int					problems;
+	pthread_mutex_t		report_lock;
+};
+
+static const char* progname = "rufs-fsck";
+
+static void problem(struct fsck *f, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void problem(struct fsck *f, const char *fmt, ...) {
+	va_list ap;
+	pthread_mutex_lock(&f->report_lock);
+	f->problems++;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(f->fix ? ", fixed\n" : "\n");
+	pthread_mutex_unlock(&f->report_lock);
+}
+
+static double now_s(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_blocks(struct fsck *f, int blk, int count, void *buf) {
+	// past the end of a short image reads as zeroes
+	return bio_read_blocks(blk, count, buf) < 0 ? -EIO : 0;
+}
+
+static void write_blocks(struct fsck *f, int blk, int count, const void *buf) {
+	if (!f->fix) {
+		return;
+	}
+	if (bio_write_blocks(blk, count, buf) < 0) {
+		exit(EXIT_ERROR);
+	}
+}
+
+static int data_block_ok(struct fsck *f, int32_t blk) {
+	return blk >= (int32_t)f->super.d_start_blk && blk < (int32_t)f->super.max_dnum;
+}
+
+static int frag_ok(struct fsck *f, int32_t frag, int count) {
+	return f->frag_map != 0 && data_block_ok(f, frag_blkno(frag)) && frag_slot(frag) + count <= FRAGS_PER_BLOCK;
+}
+
+static void mark_inode_dirty(struct fsck *f, int ino) {
+	f->itable_dirty[ino / INODES_PER_BLOCK] = 1;
+}
+
+/*
+ * Run fn on every thread. Each one takes work items off f->next until none
+ * are left.
+ */
+static void run_pass(struct fsck *f, void *(*fn)(void *)) {
+	pthread_t tids[f->threads];
+	f->next = 0;
+	for (int i = 0; i < f->threads; i++) {
+		pthread_create(&tids[i], NULL, fn, f);
+	}
+	for (int i = 0; i < f->threads; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+static int take(struct fsck *f, int step) {
+	return __atomic_fetch_add(&f->next, step, __ATOMIC_RELAXED);
+}
+
+static void add_claim(struct inode_state *s, int32_t lblk, int32_t pblk) {
+	if (s->nclaims % 64 == 0) {
+		s->claims = realloc(s->claims, (s->nclaims + 64) * sizeof(struct claim));
+	}
+	s->claims[s->nclaims].lblk = lblk;
+	s->claims[s->nclaims].pblk = pblk;
+	s->nclaims++;
+}
+
+static void claim_block(struct fsck *f, int32_t blk, int32_t ino) {
+	if (!data_block_ok(f, blk)) {
+		return;
+	}
+	int32_t cur = __atomic_load_n(&f->owner[blk], __ATOMIC_RELAXED);
+	while (ino < cur && !__atomic_compare_exchange_n(&f->owner[blk], &cur, ino, 0,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+/*
+ * Pass 1: read the inode table in large sequential chunks and check each
+ * inode on its own. Blocks past the lazy init mark are free by definition.
+ */
+static void *pass1_inodes(void *arg) {
+	struct fsck* f = arg;
+	int start;
+	while ((start = take(f, FSCK_READ_BLOCKS)) < f->itable_init) {
+		int count = f->itable_init - start < FSCK_READ_BLOCKS ? f->itable_init - start : FSCK_READ_BLOCKS;
+		index_node* chunk = f->itable + start * INODES_PER_BLOCK;
+		if (read_blocks(f, f->super.i_start_blk + start, count, chunk) < 0) {
+			fprintf(stderr, "%s: inode table read failed\n", progname);
+			exit(EXIT_ERROR);
+		}
+
+		int first = start * INODES_PER_BLOCK;
+		int last = first + count * INODES_PER_BLOCK;
+		if (last > f->super.max_inum) {
+			last = f->super.max_inum;
+		}
+		for (int ino = first; ino < last; ino++) {
+			index_node* in = &f->itable[ino];
+			if (in->valid != VALID) {
+				continue;
+			}
+			if (in->version != INODE_VERSION || (!S_ISDIR(in->mode) && !S_ISREG(in->mode))) {
+				problem(f, "inode %d: unknown version %d or mode 0%o", ino, in->version, in->mode);
+				in->valid = INVALID;
+				mark_inode_dirty(f, ino);
+				continue;
+			}
+			if (in->ino != ino) {
+				problem(f, "inode %d: records number %d", ino, in->ino);
+				in->ino = ino;
+				mark_inode_dirty(f, ino);
+			}
+			f->state[ino].valid = 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Pass 2: walk every block map, indirect blocks included, and record who
+ * claims each block. Ownership goes to the lowest inode number so the
+ * outcome does not depend on thread timing.
+ */
+static void *pass2_blockmaps(void *arg) {
+	struct fsck* f = arg;
+	int32_t* ptrs = malloc(BLOCK_SIZE);
+	int ino;
+	while ((ino = take(f, 1)) < f->super.max_inum) {
+		if (!f->state[ino].valid) {
+			continue;
+		}
+		index_node* in = &f->itable[ino];
+		struct inode_state* s = &f->state[ino];
+
+		for (int i = 0; i < DIRECT_PTRS; i++) {
+			if (in->direct_ptr[i] != -1) {
+				add_claim(s, i, ptr_blkno(in->direct_ptr[i])); // unwritten blocks are owned all the same
+				if (!is_frag_ptr(in->direct_ptr[i])) { // fragment blocks are shared, pass 3 sorts them out
+					claim_block(f, ptr_blkno(in->direct_ptr[i]), ino);
+				}
+			}
+		}
+		if (S_ISDIR(in->mode)) {
+			for (int i = 0; i < INDIRECT_PTRS; i++) {
+				if (in->indirect_ptr[i] != -1) { // directories only use direct pointers
+					add_claim(s, -1 - i, -1);
+				}
+			}
+			continue;
+		}
+		for (int i = 0; i < INDIRECT_PTRS; i++) {
+			int32_t ind = in->indirect_ptr[i];
+			if (ind == -1) {
+				continue;
+			}
+			add_claim(s, -1 - i, ind);
+			if (!data_block_ok(f, ind)) {
+				continue;
+			}
+			claim_block(f, ind, ino);
+			read_blocks(f, ind, 1, ptrs);
+			for (int k = 0; k < PTRS_PER_BLOCK; k++) {
+				if (ptrs[k] != -1) {
+					add_claim(s, DIRECT_PTRS + i * PTRS_PER_BLOCK + k, ptr_blkno(ptrs[k]));
+					claim_block(f, ptr_blkno(ptrs[k]), ino);
+				}
+			}
+		}
+	}
+	free(ptrs);
+	return NULL;
+}
+
+/*
+ * Pass 3: drop pointers that are out of range or lost to a lower inode,
+ * then fix the block counts. Runs in inode order. A packed tail must be
+ * the file's last block and may not share fragments or sit in a block
+ * somebody holds whole; the first inode to claim a fragment keeps it.
+ */
+static void pass3_resolve(struct fsck *f) {
+	uint8_t* seen = calloc(1, (f->super.max_dnum + 7) / 8);
+	uint8_t* frag_seen = calloc(FRAGS_PER_BLOCK, (f->super.max_dnum + 7) / 8);
+	int32_t* ptrs = malloc(BLOCK_SIZE);
+
+	for (int ino = 0; ino < f->super.max_inum; ino++) {
+		struct inode_state* s = &f->state[ino];
+		if (!s->valid) {
+			continue;
+		}
+		index_node* in = &f->itable[ino];
+		int dropped_ind = 0;	// bit i set when indirect slot i was dropped
+		int ind_blk = -1;		// indirect block currently loaded in ptrs
+		int ind_dirty = 0;
+		uint32_t blocks = 0;
+
+		for (int c = 0; c < s->nclaims; c++) {
+			struct claim* cl = &s->claims[c];
+			int slot = cl->lblk < 0 ? -1 - cl->lblk : (cl->lblk - DIRECT_PTRS) / (int)PTRS_PER_BLOCK;
+			if (cl->lblk >= DIRECT_PTRS && (dropped_ind & (1 << slot))) {
+				cl->pblk = -1; // went with its indirect block
+				continue;
+			}
+
+			const char* why = NULL;
+			if (cl->lblk >= 0 && cl->lblk < DIRECT_PTRS && is_frag_ptr(cl->pblk)) {
+				int count = tail_frags(in);
+				int first = frag_blkno(cl->pblk) * FRAGS_PER_BLOCK + frag_slot(cl->pblk);
+				if (count == 0 || cl->lblk != (int)(in->size - 1) / BLOCK_SIZE) {
+					why = "misplaced";
+				} else if (!frag_ok(f, cl->pblk, count)) {
+					why = "bad";
+				} else if (f->owner[frag_blkno(cl->pblk)] != FSCK_BLOCK_MAX) {
+					why = "duplicate";
+				}
+				for (int i = first; why == NULL && i < first + count; i++) {
+					if (get_bitmap(frag_seen, i)) {
+						why = "duplicate";
+					}
+				}
+				if (why == NULL) {
+					for (int i = first; i < first + count; i++) {
+						set_bitmap(frag_seen, i);
+					}
+					continue;
+				}
+				problem(f, "inode %d: %s packed tail at logical block %d", ino, why, cl->lblk);
+				in->direct_ptr[cl->lblk] = -1;
+				cl->pblk = -1;
+				mark_inode_dirty(f, ino);
+				continue;
+			}
+			if (!data_block_ok(f, cl->pblk)) {
+				why = "bad block";
+			} else if (f->owner[cl->pblk] != ino || get_bitmap(seen, cl->pblk)) {
+				why = "duplicate block";
+			}
+			if (why == NULL) {
+				set_bitmap(seen, cl->pblk);
+				if (cl->lblk >= 0) {
+					blocks++;
+				}
+				continue;
+			}
+
+			if (cl->lblk < 0) {
+				problem(f, "inode %d: %s %d in indirect slot %d", ino, why, cl->pblk, slot);
+				in->indirect_ptr[slot] = -1;
+				dropped_ind |= 1 << slot;
+			} else if (cl->lblk < DIRECT_PTRS) {
+				problem(f, "inode %d: %s %d at logical block %d", ino, why, cl->pblk, cl->lblk);
+				in->direct_ptr[cl->lblk] = -1;
+				s->dir_dirty = 1;
+			} else {
+				problem(f, "inode %d: %s %d at logical block %d", ino, why, cl->pblk, cl->lblk);
+				if (ind_blk != in->indirect_ptr[slot]) {
+					if (ind_dirty) {
+						write_blocks(f, ind_blk, 1, ptrs);
+					}
+					ind_blk = in->indirect_ptr[slot];
+					read_blocks(f, ind_blk, 1, ptrs);
+					ind_dirty = 0;
+				}
+				ptrs[(cl->lblk - DIRECT_PTRS) % PTRS_PER_BLOCK] = -1;
+				ind_dirty = 1;
+			}
+			cl->pblk = -1;
+			mark_inode_dirty(f, ino);
+		}
+		if (ind_dirty) {
+			write_blocks(f, ind_blk, 1, ptrs);
+		}
+
+		if (in->blocks != blocks) {
+			problem(f, "inode %d: block count %u, counted %u", ino, in->blocks, blocks);
+			in->blocks = blocks;
+			mark_inode_dirty(f, ino);
+		}
+	}
+
+	free(ptrs);
+	free(frag_seen);
+	free(seen);
+}
+
+static int entry_ok(struct fsck *f, const direntry *e) {
+	size_t len = strnlen(e->name, sizeof(e->name));
+	return e->ino < f->super.max_inum && len > 0 && len < sizeof(e->name) && strchr(e->name, '/') == NULL;
+}
+
+/*
+ * Pass 4: read every directory. Entries are packed, so each block is read
+ * up to its first free slot, as rufs does.
+ */
+static void *pass4_dirs(void *arg) {
+	struct fsck* f = arg;
+	direntry* block = malloc(BLOCK_SIZE);
+	int ino;
+	while ((ino = take(f, 1)) < f->super.max_inum) {
+		struct inode_state* s = &f->state[ino];
+		index_node* in = &f->itable[ino];
+		if (!s->valid || !S_ISDIR(in->mode)) {
+			continue;
+		}
+		for (int i = 0; i < DIRECT_PTRS; i++) {
+			if (in->direct_ptr[i] == -1) {
+				continue;
+			}
+			read_blocks(f, in->direct_ptr[i], 1, block);
+			s->entries = realloc(s->entries, (s->nentries + MAX_DIRENTS) * sizeof(direntry));
+			for (int k = 0; k < MAX_DIRENTS && block[k].valid != INVALID; k++) {
+				direntry* e = &block[k];
+				if (!entry_ok(f, e)) {
+					problem(f, "directory %d: corrupt entry in block %d slot %d", ino, in->direct_ptr[i], k);
+					s->dir_dirty = 1;
+					continue;
+				}
+				int dup = 0;
+				for (int j = 0; j < s->nentries && !dup; j++) {
+					dup = strcmp(s->entries[j].name, e->name) == 0;
+				}
+				if (dup) {
+					problem(f, "directory %d: duplicate entry '%s'", ino, e->name);
+					s->dir_dirty = 1;
+					continue;
+				}
+				s->entries[s->nentries++] = *e;
+			}
+		}
+	}
+	free(block);
+	return NULL;
+}
+
+/*
+ * Pass 5: walk the tree from the root, dropping entries that point at free
+ * inodes or at a directory that already has a parent, and count links
+ */
+static void pass5_connect(struct fsck *f) {
+	int* queue = malloc(f->super.max_inum * sizeof(int));
+	int head = 0, tail = 0;
+
+	f->state[0].reachable = 1;
+	f->state[0].links = 2;
+	queue[tail++] = 0;
+	while (head < tail) {
+		int dir = queue[head++];
+		struct inode_state* s = &f->state[dir];
+		int kept = 0;
+		for (int j = 0; j < s->nentries; j++) {
+			direntry* e = &s->entries[j];
+			struct inode_state* t = &f->state[e->ino];
+			if (!t->valid) {
+				problem(f, "directory %d: entry '%s' points at free inode %d", dir, e->name, e->ino);
+				s->dir_dirty = 1;
+				continue;
+			}
+			if (S_ISDIR(f->itable[e->ino].mode)) {
+				if (t->reachable) {
+					problem(f, "directory %d: entry '%s' links directory %d a second time", dir, e->name, e->ino);
+					s->dir_dirty = 1;
+					continue;
+				}
+				t->reachable = 1;
+				t->links = 2;
+				s->links++; // the child's ".."
+				queue[tail++] = e->ino;
+			} else {
+				t->reachable = 1;
+				t->links++;
+			}
+			s->entries[kept++] = *e;
+		}
+		s->nentries = kept;
+	}
+	free(queue);
+}
+
+/*
+ * Rewrite a directory whose entries or blocks changed, packing the surviving
+ * entries into its surviving blocks
+ */
+static void rewrite_dir(struct fsck *f, int ino) {
+	struct inode_state* s = &f->state[ino];
+	index_node* in = &f->itable[ino];
+	direntry* block = malloc(BLOCK_SIZE);
+
+	// Step 1: Close the gaps left by dropped block pointers
+	int nblocks = 0;
+	for (int i = 0; i < DIRECT_PTRS; i++) {
+		if (in->direct_ptr[i] != -1) {
+			in->direct_ptr[nblocks++] = in->direct_ptr[i];
+		}
+	}
+	for (int i = nblocks; i < DIRECT_PTRS; i++) {
+		in->direct_ptr[i] = -1;
+	}
+
+	// Step 2: Pack the entries; a directory always keeps at least one block
+	int j = 0;
+	for (int i = 0; i < nblocks; i++) {
+		memset(block, 0, BLOCK_SIZE);
+		for (int k = 0; k < MAX_DIRENTS && j < s->nentries; k++) {
+			block[k] = s->entries[j++];
+		}
+		write_blocks(f, in->direct_ptr[i], 1, block);
+	}
+	if (j < s->nentries) {
+		problem(f, "directory %d: %d entries do not fit in its blocks", ino, s->nentries - j);
+	}
+	mark_inode_dirty(f, ino);
+	free(block);
+}
+
+/*
+ * Pass 6: fix inodes and directories, then rebuild both bitmaps
+ */
+static void pass6_fix(struct fsck *f) {
+	int bitmap_bytes = (f->super.max_dnum + 7) / 8;
+	bitmap_t inode_bitmap = calloc(1, BLOCK_SIZE);
+	bitmap_t data_bitmap = calloc(1, BLOCK_SIZE > bitmap_bytes ? BLOCK_SIZE : bitmap_bytes);
+	bitmap_t old = malloc(BLOCK_SIZE);
+	int frag_bytes = FRAG_MAP_BLOCKS * BLOCK_SIZE;
+	bitmap_t frag_bitmap = calloc(1, frag_bytes);
+
+	// a rewritten directory no longer matches its hash table, so a repaired
+	// read-only image mounts read-write and the tables are freed
+	for (int ino = 0; f->ro_index != 0 && ino < f->super.max_inum; ino++) {
+		if (f->state[ino].valid && f->state[ino].reachable && f->state[ino].dir_dirty) {
+			problem(f, "superblock: directory %d changed, dropping the read-only hash tables", ino);
+			f->ro_index = 0;
+			f->super.flags &= ~SB_READONLY;
+			f->super.ro_index_blk = f->super.ro_index_blocks = 0;
+			f->super.ro_dir_blk = f->super.ro_dir_blocks = 0;
+		}
+	}
+
+	// Step 1: Metadata blocks are always in use
+	for (int i = 0; i < (int)f->super.d_start_blk; i++) {
+		set_bitmap(data_bitmap, i);
+	}
+	for (int i = 0; f->frag_map != 0 && i < FRAG_MAP_BLOCKS; i++) {
+		set_bitmap(data_bitmap, f->frag_map + i);
+	}
+	for (int i = 0; f->warm != 0 && i < WARM_BLOCKS; i++) {
+		set_bitmap(data_bitmap, f->warm + i);
+	}
+	for (int i = 0; f->ro_index != 0 && i < (int)f->super.ro_index_blocks; i++) {
+		set_bitmap(data_bitmap, f->ro_index + i);
+	}
+
+	for (int ino = 0; ino < f->super.max_inum; ino++) {
+		struct inode_state* s = &f->state[ino];
+		index_node* in = &f->itable[ino];
+		if (!s->valid) {
+			continue;
+		}
+
+		// Step 2: Inodes nothing points at go back to the free pool
+		if (!s->reachable) {
+			problem(f, "inode %d: not reachable from the root", ino);
+			in->valid = INVALID;
+			mark_inode_dirty(f, ino);
+			continue;
+		}
+		set_bitmap(inode_bitmap, ino);
+
+		if (S_ISDIR(in->mode)) {
+			if (s->dir_dirty) {
+				rewrite_dir(f, ino);
+			}
+			if (in->size != in->blocks * BLOCK_SIZE) {
+				problem(f, "directory %d: size %u, expected %u", ino, in->size, in->blocks * BLOCK_SIZE);
+				in->size = in->blocks * BLOCK_SIZE;
+				mark_inode_dirty(f, ino);
+			}
+		}
+		if (in->link != s->links) {
+			problem(f, "inode %d: link count %d, counted %d", ino, in->link, s->links);
+			in->link = s->links;
+			mark_inode_dirty(f, ino);
+		}
+
+		// Step 3: Only blocks and fragments of live inodes are in use
+		for (int c = 0; c < s->nclaims; c++) {
+			int32_t pblk = s->claims[c].pblk;
+			if (pblk == -1) {
+				continue;
+			}
+			if (is_frag_ptr(pblk)) {
+				int first = frag_blkno(pblk) * FRAGS_PER_BLOCK + frag_slot(pblk);
+				for (int i = first; i < first + tail_frags(in); i++) {
+					set_bitmap(frag_bitmap, i);
+				}
+				pblk = frag_blkno(pblk);
+			}
+			set_bitmap(data_bitmap, pblk);
+		}
+	}
+
+	// Step 4: Write back the inode table blocks that changed
+	for (int b = 0; b < f->itable_blocks; b++) {
+		if (f->itable_dirty[b]) {
+			write_blocks(f, f->super.i_start_blk + b, 1, f->itable + b * INODES_PER_BLOCK);
+		}
+	}
+
+	// Step 5: Compare the rebuilt bitmaps with the ones on disk
+	read_blocks(f, f->super.i_bitmap_blk, 1, old);
+	int leaked = 0, missing = 0;
+	for (int i = 0; i < f->super.max_inum; i++) {
+		leaked += get_bitmap(old, i) && !get_bitmap(inode_bitmap, i);
+		missing += !get_bitmap(old, i) && get_bitmap(inode_bitmap, i);
+	}
+	if (leaked || missing) {
+		problem(f, "inode bitmap: %d leaked, %d in use but free", leaked, missing);
+		write_blocks(f, f->super.i_bitmap_blk, 1, inode_bitmap);
+	}
+
+	read_blocks(f, f->super.d_bitmap_blk, 1, old);
+	leaked = missing = 0;
+	for (int i = 0; i < f->super.max_dnum && i / 8 < BLOCK_SIZE; i++) {
+		leaked += get_bitmap(old, i) && !get_bitmap(data_bitmap, i);
+		missing += !get_bitmap(old, i) && get_bitmap(data_bitmap, i);
+	}
+	if (leaked || missing) {
+		problem(f, "data bitmap: %d leaked, %d in use but free", leaked, missing);
+		write_blocks(f, f->super.d_bitmap_blk, 1, data_bitmap);
+	}
+
+	if (f->frag_map != 0) {
+		bitmap_t old_frags = malloc(frag_bytes);
+		read_blocks(f, f->frag_map, FRAG_MAP_BLOCKS, old_frags);
+		leaked = missing = 0;
+		for (int i = 0; i < f->super.max_dnum * FRAGS_PER_BLOCK; i++) {
+			leaked += get_bitmap(old_frags, i) && !get_bitmap(frag_bitmap, i);
+			missing += !get_bitmap(old_frags, i) && get_bitmap(frag_bitmap, i);
+		}
+		if (leaked || missing) {
+			problem(f, "fragment map: %d leaked, %d in use but free", leaked, missing);
+			write_blocks(f, f->frag_map, FRAG_MAP_BLOCKS, frag_bitmap);
+		}
+		free(old_frags);
+	}
+
+	// Step 6: Summary counts; they are only promised to be exact after a
+	// clean unmount, so stale ones in a dirty image are not a problem
+	uint32_t free_inodes = 0, free_blocks = 0;
+	for (int i = 0; i < f->super.max_inum; i++) {
+		free_inodes += !get_bitmap(inode_bitmap, i);
+	}
+	for (int i = 0; i < f->super.max_dnum; i++) {
+		free_blocks += !get_bitmap(data_bitmap, i);
+	}
+	if ((f->super.state & SB_CLEAN) &&
+		(f->super.free_inodes != free_inodes || f->super.free_blocks != free_blocks)) {
+		problem(f, "superblock: free counts %u inodes %u blocks, counted %u and %u",
+			f->super.free_inodes, f->super.free_blocks, free_inodes, free_blocks);
+	}
+	f->super.free_inodes = free_inodes;
+	f->super.free_blocks = free_blocks;
+	f->used_blocks = f->super.max_dnum - free_blocks;
+	f->super.state |= SB_CLEAN;
+	memset(old, 0, BLOCK_SIZE);
+	read_blocks(f, 0, 1, old);
+	memcpy(old, &f->super, sizeof(sb));
+	write_blocks(f, 0, 1, old);
+
+	free(old);
+	free(inode_bitmap);
+	free(data_bitmap);
+	free(frag_bitmap);
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: %s [-n] [-j THREADS] [DISKFILE[,DISKFILE...]]\n"
+		"  -n    check only, change nothing\n"
+		"  -j    scanning threads (default: online CPUs)\n", progname);
+	exit(EXIT_ERROR);
+}
+
+int main(int argc, char **argv) {
+	struct fsck f;
+	memset(&f, 0, sizeof(f));
+	f.fix = 1;
+	f.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_mutex_init(&f.report_lock, NULL);
+
+	int opt;
+	while ((opt = getopt(argc, argv, "nj:")) != -1) {
+		switch (opt) {
+		case 'n': f.fix = 0; break;
+		case 'j': f.threads = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (f.threads < 1) {
+		f.threads = 1;
+	}
+	const char* path = optind < argc ? argv[optind] : "DISKFILE";
+
+	if (dev_open(path) < 0) {
+		return EXIT_ERROR;
+	}
+
+	// Step 1: Superblock
+	char* block = malloc(BLOCK_SIZE);
+	if (read_blocks(&f, 0, 1, block) < 0) {
+		fprintf(stderr, "%s: %s: superblock read failed\n", progname, path);
+		return EXIT_ERROR;
+	}
+	memcpy(&f.super, block, sizeof(sb));
+	free(block);
+	if ((f.super.nstripes ? (int)f.super.nstripes : 1) != dev_stripes()) {
+		fprintf(stderr, "%s: %s: image is striped over %u backing files\n", progname, path, f.super.nstripes);
+		return EXIT_ERROR;
+	}
+	dev_set_stripe(f.super.stripe_blocks);
+	int inode_bytes = f.super.max_inum * sizeof(index_node);
+	f.itable_blocks = (inode_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	f.itable_init = (f.super.flags & SB_LAZY_ITABLE) ? (int)f.super.itable_init : f.itable_blocks;
+	if (f.super.magic_num != MAGIC_NUM || f.super.max_inum == 0 ||
+		f.super.d_start_blk != f.super.i_start_blk + f.itable_blocks ||
+		f.super.d_start_blk >= f.super.max_dnum || f.itable_init > f.itable_blocks) {
+		fprintf(stderr, "%s: %s: bad superblock\n", progname, path);
+		return EXIT_ERROR;
+	}
+
+	f.itable = calloc(f.itable_blocks, BLOCK_SIZE);
+	f.itable_dirty = calloc(f.itable_blocks, 1);
+	f.state = calloc(f.super.max_inum, sizeof(struct inode_state));
+	f.owner = malloc(f.super.max_dnum * sizeof(int32_t));
+	for (int i = 0; i < f.super.max_dnum; i++) {
+		f.owner[i] = FSCK_BLOCK_MAX;
+	}
+
+	// the fragment map belongs to no inode; -1 beats every claim on it
+	f.frag_map = f.super.frag_map_blk;
+	if (f.frag_map != 0 && (!data_block_ok(&f, f.frag_map) || !data_block_ok(&f, f.frag_map + FRAG_MAP_BLOCKS - 1))) {
+		problem(&f, "superblock: fragment map at bad block %d", f.frag_map);
+		f.frag_map = 0;
+		f.super.frag_map_blk = 0;
+	}
+	for (int i = 0; f.frag_map != 0 && i < FRAG_MAP_BLOCKS; i++) {
+		f.owner[f.frag_map + i] = -1;
+	}
+
+	// so does the hot block list, which is only a hint and can be dropped
+	f.warm = f.super.warm_blk;
+	if (f.warm != 0 && (!data_block_ok(&f, f.warm) || !data_block_ok(&f, f.warm + WARM_BLOCKS - 1) ||
+		(f.frag_map != 0 && f.warm < f.frag_map + FRAG_MAP_BLOCKS && f.frag_map < f.warm + WARM_BLOCKS) ||
+		f.super.warm_count > WARM_MAX)) {
+		problem(&f, "superblock: hot block list at bad block %d", f.warm);
+		f.warm = 0;
+		f.super.warm_blk = 0;
+		f.super.warm_count = 0;
+	}
+	for (int i = 0; f.warm != 0 && i < WARM_BLOCKS; i++) {
+		f.owner[f.warm + i] = -1;
+	}
+
+	// and the hash tables of a read-only image; without them it mounts
+	// read-write again and directories are scanned
+	if (f.super.flags & SB_READONLY) {
+		f.ro_index = f.super.ro_index_blk;
+		int last = f.ro_index + (int)f.super.ro_index_blocks - 1;
+		if (f.super.ro_index_blocks == 0 || !data_block_ok(&f, f.ro_index) || !data_block_ok(&f, last) ||
+			(f.frag_map != 0 && f.ro_index < f.frag_map + FRAG_MAP_BLOCKS && f.frag_map <= last) ||
+			(f.warm != 0 && f.ro_index < f.warm + WARM_BLOCKS && f.warm <= last)) {
+			problem(&f, "superblock: directory hash tables at bad block %d", f.ro_index);
+			f.ro_index = 0;
+			f.super.flags &= ~SB_READONLY;
+			f.super.ro_index_blk = f.super.ro_index_blocks = 0;
+			f.super.ro_dir_blk = f.super.ro_dir_blocks = 0;
+		}
+	}
+	for (int i = 0; f.ro_index != 0 && i < (int)f.super.ro_index_blocks; i++) {
+		f.owner[f.ro_index + i] = -1;
+	}
+
+	// Step 2: Scan
+	double t0 = now_s();
+	run_pass(&f, pass1_inodes);
+	if (!f.state[0].valid || !S_ISDIR(f.itable[0].mode)) {
+		fprintf(stderr, "%s: %s: root inode is damaged\n", progname, path);
+		return EXIT_UNFIXED;
+	}
+	double t1 = now_s();
+	run_pass(&f, pass2_blockmaps);
+	pass3_resolve(&f);
+	double t2 = now_s();
+	run_pass(&f, pass4_dirs);
+	pass5_connect(&f);
+	double t3 = now_s();
+
+	// Step 3: Repair
+	pass6_fix(&f);
+	if (f.fix) {
+		dev_sync();
+	}
+	double t4 = now_s();
+
+	int inodes = 0;
+	for (int ino = 0; ino < f.super.max_inum; ino++) {
+		if (f.state[ino].valid && f.state[ino].reachable) {
+			inodes++;
+		}
+		free(f.state[ino].claims);
+		free(f.state[ino].entries);
+	}
+	printf("%s: %d/%d inodes, %d/%d blocks, %d problem%s%s\n", path, inodes, f.super.max_inum,
+		f.used_blocks, f.super.max_dnum, f.problems, f.problems == 1 ? "" : "s",
+		f.problems == 0 ? "" : (f.fix ? " fixed" : " found"));
+	printf("%s: inodes %.3fs, block maps %.3fs, directories %.3fs, repair %.3fs (%d threads)\n",
+		progname, t1 - t0, t2 - t1, t3 - t2, t4 - t3, f.threads);
+
+	dev_close();
+	free(f.itable);
+	free(f.itable_dirty);
+	free(f.state);
+	free(f.owner);
+	if (f.problems == 0) {
+		return EXIT_CLEAN;
+	}
+	return f.fix ? EXIT_FIXED : EXIT_UNFIXED;
+}
@@ -0,0 +1,78 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	rufs_main.c
+ *
+ *	FUSE entry point. Everything else lives in librufs.a.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "cache.h"
+#include "dispatch.h"
+#include "record.h"
+#include "rufs.h"
+
+int main(int argc, char *argv[]) {
+	int fuse_stat;
+
+	// RUFS_DISKFILE may name several backing files separated by commas to
+	// stripe a new image over them, RUFS_STRIPE_BLOCKS blocks at a time
+	if (getenv("RUFS_DISKFILE") != NULL) {
+		strncpy(diskfile_path, getenv("RUFS_DISKFILE"), PATH_MAX - 1);
+	} else {
+		getcwd(diskfile_path, PATH_MAX);
+		strcat(diskfile_path, "/DISKFILE");
+	}
+	if (getenv("RUFS_STRIPE_BLOCKS") != NULL) {
+		dev_set_stripe(atoi(getenv("RUFS_STRIPE_BLOCKS")));
+	}
+
+	// RUFS_DIRECT=1 keeps the image out of the host page cache
+	if (getenv("RUFS_DIRECT") != NULL) {
+		dev_set_direct(atoi(getenv("RUFS_DIRECT")));
+	}
+
+	// RUFS_LOG=1 makes a new image log-structured; existing ones keep their kind
+	if (getenv("RUFS_LOG") != NULL) {
+		dev_set_log(atoi(getenv("RUFS_LOG")));
+	}
+
+	// RUFS_RAM=1 keeps a scratch image in memory only, RUFS_RAM=2 also loads
+	// it from and saves it to the disk file; RUFS_RAM_HUGE=1 asks for huge pages
+	if (getenv("RUFS_RAM") != NULL) {
+		dev_set_ram(atoi(getenv("RUFS_RAM")),
+			getenv("RUFS_RAM_HUGE") != NULL && atoi(getenv("RUFS_RAM_HUGE")));
+	}
+
+	// RUFS_WRITEBACK=1 queues block writes and flushes them in sorted batches
+	if (getenv("RUFS_WRITEBACK") != NULL) {
+		dev_set_writeback(atoi(getenv("RUFS_WRITEBACK")));
+	}
+
+	// RUFS_CACHE_MB sizes the block/inode/dentry cache, 0 turns it off
+	if (getenv("RUFS_CACHE_MB") != NULL) {
+		cache_set_budget((size_t)atol(getenv("RUFS_CACHE_MB")) * 1024 * 1024);
+	}
+
+	// RUFS_META_THREADS and RUFS_DATA_THREADS size the two worker pools
+	if (getenv("RUFS_META_THREADS") != NULL || getenv("RUFS_DATA_THREADS") != NULL) {
+		dispatch_set_threads(getenv("RUFS_META_THREADS") ? atoi(getenv("RUFS_META_THREADS")) : -1,
+			getenv("RUFS_DATA_THREADS") ? atoi(getenv("RUFS_DATA_THREADS")) : -1);
+	}
+
+	// RUFS_RECORD names a file to record every op to, for rufs-replay
+	if (getenv("RUFS_RECORD") != NULL) {
+		record_set_file(getenv("RUFS_RECORD"));
+	}
+
+	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+
+	return fuse_stat;
+}
@@ -0,0 +1,262 @@
+/*
+ *	Tiny File System
+ *	File:	rufs_replay.c
+ *
+ *	Offline replay of an op recording made with RUFS_RECORD. Links
+ *	librufs.a and issues the recorded ops through rufs_ope, so no FUSE
+ *	mount is needed:
+ *
+ *	./rufs-replay [-m] [-f DISKFILE[,DISKFILE...]] RECORDING
+ *
+ *	Ops go out one at a time in the order they started, each at its
+ *	recorded offset from the start unless -m asks for maximum speed. The
+ *	threads of the recording are not reproduced. Writes carry a fixed
+ *	pattern, since only sizes are recorded, and ioctls are skipped, since
+ *	their payload is not. The image is modified: replay against a copy of
+ *	the one the recording started from to get the same results back.
+ *
+ *	Prints one JSON line per op with its latency, how many calls failed
+ *	and how many returned something other than in the recording, then a
+ *	total.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "record.h"
+#include "rufs.h"
+
+struct op_latency {
+	uint64_t*	ns;
+	long		count;
+	long		cap;
+	long		errors;
+	long		mismatched;
+	uint64_t	recorded_ns;	/* sum of the recorded durations */
+};
+
+// records sit unaligned after the paths before them, so each is copied out
+struct replay_op {
+	record_op	r;
+	const char*	path;		/* not NUL-terminated */
+};
+
+static const char* progname = "rufs-replay";
+static struct op_latency lat[OP_MAX];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void usage(void) {
+	fprintf(stderr, "usage: %s [-m] [-f DISKFILE[,DISKFILE...]] RECORDING\n"
+		"  -m    replay at maximum speed instead of the recorded pace\n"
+		"  -f    image to replay against (default: DISKFILE)\n", progname);
+	exit(2);
+}
+
+static int filler(void *buf, const char *name, const struct stat *stbuf, off_t off) {
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+// records are added as ops finish; replay wants them as they started
+static int cmp_start(const void *a, const void *b) {
+	const struct replay_op* x = a;
+	const struct replay_op* y = b;
+	if (x->r.start_ns != y->r.start_ns) {
+		return x->r.start_ns < y->r.start_ns ? -1 : 1;
+	}
+	return x->path < y->path ? -1 : x->path > y->path;
+}
+
+static void add_latency(struct op_latency *l, uint64_t ns) {
+	if (l->count == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->ns = realloc(l->ns, l->cap * sizeof(uint64_t));
+	}
+	l->ns[l->count++] = ns;
+}
+
+static int replay_one(const record_op *r, const char *path, char *buf) {
+	struct fuse_file_info fi;
+	struct stat st;
+	struct statvfs vfs;
+	int ret = -ENOSYS;
+
+	memset(&fi, 0, sizeof(fi));
+	fi.flags = r->flags;
+	switch (r->op) {
+	case OP_GETATTR:	ret = rufs_ope.getattr(path, &st); break;
+	case OP_OPENDIR:	ret = rufs_ope.opendir(path, &fi); break;
+	case OP_READDIR:	ret = rufs_ope.readdir(path, NULL, filler, r->offset, &fi); break;
+	case OP_MKDIR:		ret = rufs_ope.mkdir(path, r->mode); break;
+	case OP_RMDIR:		ret = rufs_ope.rmdir(path); break;
+	case OP_CREATE:		ret = rufs_ope.create(path, r->mode, &fi); break;
+	case OP_OPEN:		ret = rufs_ope.open(path, &fi); break;
+	case OP_READ:		ret = rufs_ope.read(path, buf, r->len, r->offset, &fi); break;
+	case OP_WRITE:		ret = rufs_ope.write(path, buf, r->len, r->offset, &fi); break;
+	case OP_UNLINK:		ret = rufs_ope.unlink(path); break;
+	case OP_TRUNCATE:	ret = rufs_ope.truncate(path, r->offset); break;
+	case OP_FALLOCATE:	ret = rufs_ope.fallocate(path, r->mode, r->offset, r->len, &fi); break;
+	case OP_STATFS:		ret = rufs_ope.statfs(path, &vfs); break;
+	case OP_RELEASE:	ret = rufs_ope.release(path, &fi); break;
+	case OP_FSYNC:		ret = rufs_ope.fsync(path, r->mode, &fi); break;
+	default:			break;
+	}
+
+	// an open under /.rufs renders a snapshot into fi; the recorded release
+	// comes with a fresh fi, so drop it now
+	if ((r->op == OP_OPEN || r->op == OP_CREATE) && fi.fh != 0) {
+		rufs_ope.release(path, &fi);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	int max_speed = 0, opt;
+	const char* image = "DISKFILE";
+
+	while ((opt = getopt(argc, argv, "mf:")) != -1) {
+		switch (opt) {
+		case 'm': max_speed = 1; break;
+		case 'f': image = optarg; break;
+		default: usage();
+		}
+	}
+	if (optind != argc - 1) {
+		usage();
+	}
+
+	// Step 1: Read the whole recording and check its header
+	FILE* f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "%s: cannot open %s\n", progname, argv[optind]);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char* data = malloc(size > 0 ? size : 1);
+	if (size < (long)sizeof(record_header) || fread(data, 1, size, f) != (size_t)size) {
+		fprintf(stderr, "%s: %s: short read\n", progname, argv[optind]);
+		return 1;
+	}
+	fclose(f);
+	record_header* hdr = (record_header*)data;
+	if (hdr->magic != RECORD_MAGIC || hdr->version != RECORD_VERSION) {
+		fprintf(stderr, "%s: %s: not a rufs recording\n", progname, argv[optind]);
+		return 1;
+	}
+
+	// Step 2: Index the records, stopping at a torn one at the end, and
+	// size one buffer for the largest read or write
+	long nops = 0, cap = 1024;
+	struct replay_op* ops = malloc(cap * sizeof(struct replay_op));
+	size_t max_len = BLOCK_SIZE;
+	for (long off = sizeof(record_header); off + (long)sizeof(record_op) <= size; ) {
+		record_op r;
+		memcpy(&r, data + off, sizeof(r));
+		if (off + (long)sizeof(record_op) + r.pathlen > size || r.pathlen >= PATH_MAX || r.op >= OP_MAX) {
+			fprintf(stderr, "%s: %s: bad record at byte %ld, ignoring the rest\n", progname, argv[optind], off);
+			break;
+		}
+		if (nops == cap) {
+			cap *= 2;
+			ops = realloc(ops, cap * sizeof(struct replay_op));
+		}
+		ops[nops].r = r;
+		ops[nops].path = data + off + sizeof(record_op);
+		nops++;
+		if ((r.op == OP_READ || r.op == OP_WRITE) && r.len > max_len) {
+			max_len = r.len;
+		}
+		off += sizeof(record_op) + r.pathlen;
+	}
+	qsort(ops, nops, sizeof(struct replay_op), cmp_start);
+	char* buf = malloc(max_len);
+	memset(buf, 0x5a, max_len);
+
+	// Step 3: Mount the image the way rufs does; a missing one is formatted
+	strncpy(diskfile_path, image, PATH_MAX - 1);
+	rufs_ope.init(NULL);
+
+	// Step 4: Issue the ops, sleeping up to each one's recorded start
+	// unless at maximum speed
+	long skipped = 0;
+	char path[PATH_MAX];
+	uint64_t begin = now_ns();
+	for (long i = 0; i < nops; i++) {
+		const record_op* r = &ops[i].r;
+		if (r->op == OP_IOCTL) {
+			skipped++;
+			continue;
+		}
+		memcpy(path, ops[i].path, r->pathlen);
+		path[r->pathlen] = '\0';
+
+		if (!max_speed) {
+			uint64_t due = begin + r->start_ns;
+			struct timespec ts = { .tv_sec = due / 1000000000ull, .tv_nsec = due % 1000000000ull };
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+			}
+		}
+
+		uint64_t t = now_ns();
+		int ret = replay_one(r, path, buf);
+		struct op_latency* l = &lat[r->op];
+		add_latency(l, now_ns() - t);
+		l->errors += ret < 0;
+		l->mismatched += ret != r->ret;
+		l->recorded_ns += r->dur_ns;
+	}
+	uint64_t elapsed = now_ns() - begin;
+
+	rufs_ope.destroy(NULL);
+
+	// Step 5: Report
+	for (int op = 0; op < OP_MAX; op++) {
+		struct op_latency* l = &lat[op];
+		if (l->count == 0) {
+			continue;
+		}
+		qsort(l->ns, l->count, sizeof(uint64_t), cmp_u64);
+		uint64_t sum = 0;
+		for (long i = 0; i < l->count; i++) {
+			sum += l->ns[i];
+		}
+		printf("{\"op\":\"%s\",\"count\":%ld,\"errors\":%ld,\"mismatched\":%ld,"
+			"\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"recorded_mean_ns\":%.1f}\n",
+			stats_op_name(op), l->count, l->errors, l->mismatched, (double)sum / l->count,
+			(unsigned long long)l->ns[l->count / 2], (unsigned long long)l->ns[l->count * 99 / 100],
+			(unsigned long long)l->ns[l->count - 1], (double)l->recorded_ns / l->count);
+		free(l->ns);
+	}
+	printf("{\"op\":\"total\",\"count\":%ld,\"skipped\":%ld,\"elapsed_ns\":%llu,\"ops_per_s\":%.1f}\n",
+		nops - skipped, skipped, (unsigned long long)elapsed,
+		elapsed ? (nops - skipped) * 1e9 / elapsed : 0.0);
+
+	free(buf);
+	free(ops);
+	free(data);
+	return 0;
+}
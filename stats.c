@@ -0,0 +1,176 @@
+/*
+ *	Tiny File System
+ *	File:	stats.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+struct op_hist {
+	uint64_t	count;
+	uint64_t	errors;
+	uint64_t	total_ns;
+	uint64_t	buckets[STATS_BUCKETS];
+};
+
+/*
+ * One per thread, never freed, so counts survive the thread. Only the owner
+ * writes; readers may see a slightly stale value, which is fine for stats.
+ */
+struct thread_stats {
+	struct thread_stats*	next;
+	struct op_hist			ops[OP_MAX];
+	uint64_t				counters[CTR_MAX];
+	uint64_t				scan_buckets[STATS_BUCKETS];
+};
+
+static const char* op_names[OP_MAX] = {
+	"getattr", "opendir", "readdir", "mkdir", "rmdir", "create", "open",
+	"read", "write", "unlink", "truncate", "fallocate", "ioctl",
+	"statfs", "release", "fsync"
+};
+
+static const char* counter_names[CTR_MAX] = {
+	"bio_reads", "bio_writes", "bio_read_bytes", "bio_write_bytes",
+	"cache_hits", "cache_misses", "alloc_calls", "alloc_scanned_bits",
+	"arena_chunk_allocs", "tails_packed", "tails_unpacked",
+	"writeback_runs", "writeback_blocks"
+};
+
+static __thread struct thread_stats* local;
+static struct thread_stats* all_threads;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct thread_stats *get_local() {
+	if (local == NULL) {
+		local = calloc(1, sizeof(struct thread_stats));
+		pthread_mutex_lock(&register_lock);
+		local->next = all_threads;
+		__atomic_store_n(&all_threads, local, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&register_lock);
+	}
+	return local;
+}
+
+// single writer, so a relaxed load and store is enough; no locked add
+static inline void bump(uint64_t *x, uint64_t v) {
+	__atomic_store_n(x, __atomic_load_n(x, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+static inline int bucket_of(uint64_t v) {
+	int b = v ? 64 - __builtin_clzll(v) : 0;
+	return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+const char *stats_op_name(enum stats_op op) {
+	return op_names[op];
+}
+
+uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_op(enum stats_op op, uint64_t start_ns, int ret) {
+	struct op_hist* h = &get_local()->ops[op];
+	uint64_t ns = stats_now() - start_ns;
+	bump(&h->count, 1);
+	bump(&h->total_ns, ns);
+	bump(&h->buckets[bucket_of(ns)], 1);
+	if (ret < 0) {
+		bump(&h->errors, 1);
+	}
+}
+
+void stats_count(enum stats_counter ctr, uint64_t v) {
+	bump(&get_local()->counters[ctr], v);
+}
+
+void stats_alloc_scan(uint64_t scanned) {
+	struct thread_stats* t = get_local();
+	bump(&t->counters[CTR_ALLOC_CALLS], 1);
+	bump(&t->counters[CTR_ALLOC_SCANNED], scanned);
+	bump(&t->scan_buckets[bucket_of(scanned)], 1);
+}
+
+/*
+ * Sum every thread's stats and print them in Prometheus text format.
+ * Returns the number of bytes written, truncated to size.
+ */
+int stats_render(char *buf, size_t size) {
+	struct op_hist ops[OP_MAX];
+	uint64_t counters[CTR_MAX];
+	uint64_t scans[STATS_BUCKETS];
+	memset(ops, 0, sizeof(ops));
+	memset(counters, 0, sizeof(counters));
+	memset(scans, 0, sizeof(scans));
+
+	// Step 1: Aggregate per-thread copies
+	for (struct thread_stats* t = __atomic_load_n(&all_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+		for (int op = 0; op < OP_MAX; op++) {
+			ops[op].count += __atomic_load_n(&t->ops[op].count, __ATOMIC_RELAXED);
+			ops[op].errors += __atomic_load_n(&t->ops[op].errors, __ATOMIC_RELAXED);
+			ops[op].total_ns += __atomic_load_n(&t->ops[op].total_ns, __ATOMIC_RELAXED);
+			for (int b = 0; b < STATS_BUCKETS; b++) {
+				ops[op].buckets[b] += __atomic_load_n(&t->ops[op].buckets[b], __ATOMIC_RELAXED);
+			}
+		}
+		for (int c = 0; c < CTR_MAX; c++) {
+			counters[c] += __atomic_load_n(&t->counters[c], __ATOMIC_RELAXED);
+		}
+		for (int b = 0; b < STATS_BUCKETS; b++) {
+			scans[b] += __atomic_load_n(&t->scan_buckets[b], __ATOMIC_RELAXED);
+		}
+	}
+
+	// Step 2: Print them
+	size_t n = 0;
+#define EMIT(...) do { \
+		if (n < size) { \
+			n += snprintf(buf + n, size - n, __VA_ARGS__); \
+		} \
+	} while (0)
+
+	for (int c = 0; c < CTR_MAX; c++) {
+		EMIT("rufs_%s %llu\n", counter_names[c], (unsigned long long)counters[c]);
+	}
+
+	for (int op = 0; op < OP_MAX; op++) {
+		if (ops[op].count == 0) {
+			continue;
+		}
+		EMIT("rufs_op_count{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)ops[op].count);
+		EMIT("rufs_op_errors{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)ops[op].errors);
+		EMIT("rufs_op_latency_ns_sum{op=\"%s\"} %llu\n", op_names[op], (unsigned long long)ops[op].total_ns);
+		uint64_t cum = 0;
+		for (int b = 0; b < STATS_BUCKETS - 1 && cum < ops[op].count; b++) {
+			cum += ops[op].buckets[b];
+			if (ops[op].buckets[b]) {
+				EMIT("rufs_op_latency_ns_bucket{op=\"%s\",le=\"%llu\"} %llu\n", op_names[op],
+					(unsigned long long)(1ull << b), (unsigned long long)cum);
+			}
+		}
+		EMIT("rufs_op_latency_ns_bucket{op=\"%s\",le=\"+Inf\"} %llu\n", op_names[op],
+			(unsigned long long)ops[op].count);
+	}
+
+	uint64_t cum = 0;
+	for (int b = 0; b < STATS_BUCKETS - 1; b++) {
+		cum += scans[b];
+		if (scans[b]) {
+			EMIT("rufs_alloc_scan_bits_bucket{le=\"%llu\"} %llu\n", (unsigned long long)(1ull << b),
+				(unsigned long long)cum);
+		}
+	}
+	EMIT("rufs_alloc_scan_bits_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)counters[CTR_ALLOC_CALLS]);
+#undef EMIT
+
+	return n < size ? n : size;
+}
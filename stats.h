@@ -0,0 +1,64 @@
+/*
+ *	Tiny File System
+ *	File:	stats.h
+ *
+ *	Per-operation counters and latency histograms. Each thread bumps its
+ *	own copy without locks; stats_render() sums them for /.rufs/stats.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_DIR	"/.rufs"
+#define STATS_FILE	"/.rufs/stats"
+
+#define STATS_BUCKETS 40	/* log2 buckets: bucket i holds values in [2^(i-1), 2^i) */
+
+enum stats_op {
+	OP_GETATTR,
+	OP_OPENDIR,
+	OP_READDIR,
+	OP_MKDIR,
+	OP_RMDIR,
+	OP_CREATE,
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_UNLINK,
+	OP_TRUNCATE,
+	OP_FALLOCATE,
+	OP_IOCTL,
+	OP_STATFS,
+	OP_RELEASE,
+	OP_FSYNC,
+	OP_MAX
+};
+
+enum stats_counter {
+	CTR_BIO_READ,
+	CTR_BIO_WRITE,
+	CTR_BIO_READ_BYTES,
+	CTR_BIO_WRITE_BYTES,
+	CTR_CACHE_HIT,
+	CTR_CACHE_MISS,
+	CTR_ALLOC_CALLS,
+	CTR_ALLOC_SCANNED,		/* bitmap bits examined by the allocators */
+	CTR_ARENA_GROW,			/* scratch arena chunks taken from the heap */
+	CTR_TAIL_PACK,			/* file tails moved into fragments */
+	CTR_TAIL_UNPACK,		/* packed tails moved back to a block */
+	CTR_WB_RUNS,			/* pwritev calls made by write-back */
+	CTR_WB_BLOCKS,			/* dirty blocks they wrote */
+	CTR_MAX
+};
+
+const char *stats_op_name(enum stats_op op);
+uint64_t stats_now();
+void stats_op(enum stats_op op, uint64_t start_ns, int ret);
+void stats_count(enum stats_counter ctr, uint64_t v);
+void stats_alloc_scan(uint64_t scanned);
+int stats_render(char *buf, size_t size);
+
+#endif
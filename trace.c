@@ -0,0 +1,127 @@
+/*
+ *	Tiny File System
+ *	File:	trace.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace_record {
+	uint64_t	ts_ns;
+	uint32_t	arg;
+	uint16_t	ev;
+	char		phase;		/* 'B'egin or 'E'nd */
+	char		pad;
+};
+
+/*
+ * One ring per thread with a single writer. head only ever grows and is
+ * published with a release store; the dumper copies the newest records.
+ */
+struct trace_ring {
+	struct trace_ring*		next;
+	pid_t					tid;
+	uint64_t				head;
+	struct trace_record		records[TRACE_RING_EVENTS];
+};
+
+static const char* event_names[EV_MAX - OP_MAX] = {
+	"get_node_by_path", "dir_find", "get_avail_ino", "get_avail_blkno",
+	"get_avail_extent", "bio_read", "bio_write"
+};
+
+static __thread struct trace_ring* local;
+static struct trace_ring* all_rings;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct trace_ring *get_local() {
+	if (local == NULL) {
+		local = calloc(1, sizeof(struct trace_ring));
+		local->tid = syscall(SYS_gettid);
+		pthread_mutex_lock(&register_lock);
+		local->next = all_rings;
+		__atomic_store_n(&all_rings, local, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&register_lock);
+	}
+	return local;
+}
+
+void trace_event(int ev, char phase, uint32_t arg) {
+	struct trace_ring* ring = get_local();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	struct trace_record* r = &ring->records[ring->head & (TRACE_RING_EVENTS - 1)];
+	r->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	r->arg = arg;
+	r->ev = ev;
+	r->phase = phase;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_scope_end(int *ev) {
+	trace_event(*ev, 'E', 0);
+}
+
+static const char *event_name(int ev) {
+	return ev < OP_MAX ? stats_op_name(ev) : event_names[ev - OP_MAX];
+}
+
+/*
+ * Snapshot every ring as a Chrome trace JSON document. The caller frees the
+ * returned buffer. Records overwritten while copying may come out garbled;
+ * that is the price of never blocking the writers.
+ */
+char *trace_render(size_t *len) {
+	size_t cap = 1 << 20, n = 0;
+	char* out = malloc(cap);
+	struct trace_record* copy = malloc(sizeof(struct trace_record) * TRACE_RING_EVENTS);
+	pid_t pid = getpid();
+	int first = 1;
+
+	n += snprintf(out + n, cap - n, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (struct trace_ring* ring = __atomic_load_n(&all_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t count = head < TRACE_RING_EVENTS ? head : TRACE_RING_EVENTS;
+		for (uint64_t i = 0; i < count; i++) {
+			copy[i] = ring->records[(head - count + i) & (TRACE_RING_EVENTS - 1)];
+		}
+
+		for (uint64_t i = 0; i < count; i++) {
+			struct trace_record* r = &copy[i];
+			if (r->ev >= EV_MAX || (r->phase != 'B' && r->phase != 'E')) {
+				continue;
+			}
+			if (cap - n < 256) {
+				cap *= 2;
+				out = realloc(out, cap);
+			}
+			n += snprintf(out + n, cap - n,
+				"%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,\"pid\":%d,\"tid\":%d",
+				first ? "" : ",", event_name(r->ev), r->phase,
+				(unsigned long long)(r->ts_ns / 1000), (unsigned)(r->ts_ns % 1000), pid, ring->tid);
+			if (r->phase == 'B') {
+				n += snprintf(out + n, cap - n, ",\"args\":{\"arg\":%u}}", r->arg);
+			} else {
+				n += snprintf(out + n, cap - n, "}");
+			}
+			first = 0;
+		}
+	}
+	if (cap - n < 8) {
+		out = realloc(out, cap + 8);
+	}
+	n += sprintf(out + n, "\n]}\n");
+
+	free(copy);
+	*len = n;
+	return out;
+}
@@ -0,0 +1,51 @@
+/*
+ *	Tiny File System
+ *	File:	trace.h
+ *
+ *	Optional tracepoints on the FUSE op -> block I/O path. Build with
+ *	"make TRACE=1" to compile them in; otherwise every TRACE_* macro
+ *	expands to nothing. Events go to per-thread ring buffers and are
+ *	dumped in Chrome trace format (chrome://tracing, Perfetto) by
+ *	reading /.rufs/trace.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define TRACE_FILE		"/.rufs/trace"
+#define TRACE_RING_EVENTS	65536	/* per thread, power of two */
+
+enum trace_event {
+	/* values below OP_MAX are the FUSE ops of enum stats_op */
+	EV_GET_NODE_BY_PATH = OP_MAX,
+	EV_DIR_FIND,
+	EV_ALLOC_INO,
+	EV_ALLOC_BLKNO,
+	EV_ALLOC_EXTENT,
+	EV_BIO_READ,
+	EV_BIO_WRITE,
+	EV_MAX
+};
+
+void trace_event(int ev, char phase, uint32_t arg);
+void trace_scope_end(int *ev);
+char *trace_render(size_t *len);
+
+#ifdef RUFS_TRACE
+#define TRACE_BEGIN(ev, arg)	trace_event(ev, 'B', arg)
+#define TRACE_END(ev)			trace_event(ev, 'E', 0)
+/* begin now, end automatically when the enclosing scope exits */
+#define TRACE_SCOPE(ev, arg) \
+	int __trace_scope __attribute__((cleanup(trace_scope_end), unused)) = (trace_event(ev, 'B', arg), ev)
+#else
+#define TRACE_BEGIN(ev, arg)	do {} while (0)
+#define TRACE_END(ev)			do {} while (0)
+#define TRACE_SCOPE(ev, arg)	do {} while (0)
+#endif
+
+#endif